@@ -22,6 +22,15 @@
 
 -printconfiguration '~/Desktop/full-r8-config.txt'
 
--keep public class tech.smallwonder.mp3fy.AudioFileInfo, tech.smallwonder.mp3fy.MP3fy
+-keep public class tech.smallwonder.mp3fy.AudioFileInfo, tech.smallwonder.mp3fy.MP3fy, tech.smallwonder.mp3fy.EncodingProfile { *; }
 
--keep public interface tech.smallwonder.mp3fy.interfaces.OnFailureListener, tech.smallwonder.mp3fy.interfaces.OnMetadataAvailableListener, tech.smallwonder.mp3fy.interfaces.OnSuccessListener
\ No newline at end of file
+# Created from native code
+-keep public class tech.smallwonder.mp3fy.AlbumArtCacheStats { *; }
+
+# onFinished() and onBatch() are only called from native code
+-keep public class tech.smallwonder.mp3fy.ConversionSession, tech.smallwonder.mp3fy.MetadataScan { *; }
+
+# Their fields are read from native code
+-keep public class tech.smallwonder.mp3fy.MediaInput, tech.smallwonder.mp3fy.MediaOutput { *; }
+
+-keep public interface tech.smallwonder.mp3fy.interfaces.OnFailureListener, tech.smallwonder.mp3fy.interfaces.OnMetadataAvailableListener, tech.smallwonder.mp3fy.interfaces.OnMetadataBatchListener, tech.smallwonder.mp3fy.interfaces.OnSuccessListener
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "Resampler.h"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Built with -DMP3FY_BUILD_TESTS=ON, run on a device or an emulator
+
+static const int CHUNK_SIZE = 1152;
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+/**
+ * One second of a sine in every channel, planar float
+ */
+static std::vector<std::vector<float>> make_sine(int rate, int channels, double frequency, float amplitude) {
+    std::vector<std::vector<float>> planes((size_t)channels, std::vector<float>((size_t)rate));
+    for (int c = 0; c < channels; c++) {
+        for (int i = 0; i < rate; i++) planes[c][i] = amplitude * (float)std::sin(2 * M_PI * frequency * i / rate);
+    }
+    return planes;
+}
+
+/**
+ * Feeds the input in chunks, the output always gets exactly what get_out_samples promises at most, then flushes
+ * @return the output, planar float
+ */
+static std::vector<std::vector<float>> run(Resampler* resampler, const std::vector<std::vector<float>>& input, int output_channels) {
+    std::vector<std::vector<float>> output((size_t)output_channels);
+    std::vector<uint8_t*> destination((size_t)output_channels);
+    std::vector<const uint8_t*> source(input.size());
+    int length = (int)input[0].size();
+
+    for (int offset = 0;;) {
+        bool flush = offset == length;
+        int count = flush ? 0 : std::min(CHUNK_SIZE, length - offset);
+        int out_count = resampler->get_out_samples(count);
+        CHECK(out_count >= 0);
+
+        size_t written_before = output[0].size();
+        for (int c = 0; c < output_channels; c++) {
+            output[c].resize(written_before + out_count);
+            destination[c] = reinterpret_cast<uint8_t*>(output[c].data() + written_before);
+        }
+        for (size_t c = 0; c < input.size(); c++) source[c] = reinterpret_cast<const uint8_t*>(input[c].data() + offset);
+
+        int converted = resampler->convert(destination.data(), out_count, flush ? nullptr : source.data(), count);
+        CHECK(converted >= 0 && converted <= out_count);
+        for (int c = 0; c < output_channels; c++) output[c].resize(written_before + std::max(converted, 0));
+        if (flush) {
+            CHECK(resampler->get_out_samples(0) == 0);
+            break;
+        }
+        offset += count;
+    }
+    return output;
+}
+
+static double rms(const std::vector<float>& samples, size_t from, size_t to) {
+    double sum = 0;
+    for (size_t i = from; i < to; i++) sum += (double)samples[i] * samples[i];
+    return std::sqrt(sum / (to - from));
+}
+
+static int rising_zero_crossings(const std::vector<float>& samples, size_t from, size_t to) {
+    int crossings = 0;
+    for (size_t i = from + 1; i < to; i++) {
+        if (samples[i - 1] < 0 && samples[i] >= 0) crossings++;
+    }
+    return crossings;
+}
+
+static void test_changes_rate(int input_rate, int output_rate, int quality) {
+    Resampler resampler(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, 2, input_rate, AV_SAMPLE_FMT_FLTP, 2, output_rate, quality);
+    std::vector<std::vector<float>> output = run(&resampler, make_sine(input_rate, 2, 1000, 0.5f), 2);
+
+    // One second in, one second out
+    CHECK(std::abs((int)output[0].size() - output_rate) <= 1);
+    // Same level and pitch, away from the edges
+    size_t from = output[0].size() / 10, to = output[0].size() - output[0].size() / 10;
+    CHECK(std::abs(rms(output[0], from, to) - 0.5 / std::sqrt(2.0)) < 0.01);
+    CHECK(std::abs(rising_zero_crossings(output[1], from, to) - 800) <= 1);
+}
+
+static void test_removes_what_the_output_cant_hold() {
+    // 15kHz is above the Nyquist frequency of 22050Hz
+    Resampler resampler(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_MONO, 1, 44100, AV_SAMPLE_FMT_FLTP, 1, 22050, RESAMPLE_QUALITY_DEFAULT);
+    std::vector<std::vector<float>> output = run(&resampler, make_sine(44100, 1, 15000, 0.5f), 1);
+    CHECK(rms(output[0], 2205, 19845) < 0.01);
+}
+
+static void test_downmixes_to_stereo() {
+    // 5.1 with a signal in the center channel only, and full scale noise in the LFE channel
+    int length = 4800;
+    std::vector<std::vector<float>> input(6, std::vector<float>((size_t)length, 0.0f));
+    for (int i = 0; i < length; i++) {
+        input[2][i] = 0.5f * (float)std::sin(2 * M_PI * 440 * i / 48000);
+        input[3][i] = i % 2 ? 1.0f : -1.0f;
+    }
+
+    Resampler resampler(AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_5POINT1, 6, 48000, AV_SAMPLE_FMT_FLTP, 2, 48000, RESAMPLE_QUALITY_DEFAULT);
+    std::vector<std::vector<float>> output = run(&resampler, input, 2);
+    CHECK((int)output[0].size() == length);
+    for (int i = 0; i < length; i++) {
+        CHECK(output[0][i] == output[1][i]);
+        CHECK(std::abs(output[0][i]) <= 0.5f);
+    }
+    CHECK(rms(output[0], 0, length) > 0.05);
+}
+
+static void test_converts_formats_losslessly() {
+    std::vector<int16_t> input;
+    for (int i = 0; i < 1000; i++) {
+        input.push_back((int16_t)(i * 65 - 32768));
+        input.push_back((int16_t)(32767 - i * 65));
+    }
+    std::vector<int16_t> left(1000), right(1000);
+
+    Resampler resampler(AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO, 2, 44100, AV_SAMPLE_FMT_S16P, 2, 44100, RESAMPLE_QUALITY_FAST);
+    const uint8_t* source[] = {reinterpret_cast<const uint8_t*>(input.data())};
+    uint8_t* destination[] = {reinterpret_cast<uint8_t*>(left.data()), reinterpret_cast<uint8_t*>(right.data())};
+    CHECK(resampler.get_out_samples(1000) == 1000);
+    CHECK(resampler.convert(destination, 1000, source, 1000) == 1000);
+    for (int i = 0; i < 1000; i++) {
+        CHECK(left[i] == input[i * 2]);
+        CHECK(right[i] == input[i * 2 + 1]);
+    }
+}
+
+int main() {
+    test_changes_rate(48000, 44100, RESAMPLE_QUALITY_DEFAULT);
+    test_changes_rate(44100, 48000, RESAMPLE_QUALITY_HIGH);
+    test_changes_rate(44100, 22050, RESAMPLE_QUALITY_FAST);
+    test_changes_rate(8000, 44100, RESAMPLE_QUALITY_DEFAULT);
+    test_removes_what_the_output_cant_hold();
+    test_downmixes_to_stereo();
+    test_converts_formats_losslessly();
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
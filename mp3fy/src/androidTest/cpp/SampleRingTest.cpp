@@ -0,0 +1,103 @@
+#include "SampleRing.h"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+// Built with -DMP3FY_BUILD_TESTS=ON, run on a device or an emulator
+
+static const int FRAME_SIZE = 1152;
+static const int CHANNELS = 2;
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+/**
+ * Same rate, format only: get_out_samples is exact, which is when the output can fill the free space to the sample
+ */
+static std::unique_ptr<Resampler> open_format_converter() {
+    return std::unique_ptr<Resampler>(new Resampler(AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO, CHANNELS, 44100,
+                                                    AV_SAMPLE_FMT_S16P, CHANNELS, 44100, RESAMPLE_QUALITY_DEFAULT));
+}
+
+/**
+ * Packed stereo where sample i is i in the left channel and -i in the right one
+ */
+static std::vector<int16_t> make_samples(int first, int count) {
+    std::vector<int16_t> samples;
+    for (int i = first; i < first + count; i++) {
+        samples.push_back((int16_t)i);
+        samples.push_back((int16_t)-i);
+    }
+    return samples;
+}
+
+static bool resample(SampleRing* ring, Resampler* resampler, const std::vector<int16_t>& samples) {
+    const uint8_t* input[] = {reinterpret_cast<const uint8_t*>(samples.data())};
+    return ring->resample(resampler, input, (int)samples.size() / CHANNELS);
+}
+
+/**
+ * Reads everything in the ring and checks it counts up from first
+ */
+static void check_samples(SampleRing* ring, int first, int count) {
+    AVFrame* frame = av_frame_alloc();
+    int read = 0;
+    while (ring->read(frame, FRAME_SIZE)) {
+        auto* left = reinterpret_cast<const int16_t*>(frame->extended_data[0]);
+        auto* right = reinterpret_cast<const int16_t*>(frame->extended_data[1]);
+        for (int i = 0; i < frame->nb_samples; i++) {
+            CHECK(left[i] == (int16_t)(first + read + i));
+            CHECK(right[i] == (int16_t)-(first + read + i));
+        }
+        read += frame->nb_samples;
+        av_frame_unref(frame);
+    }
+    CHECK(read == count);
+    av_frame_free(&frame);
+}
+
+static void test_fills_empty_ring_exactly() {
+    std::unique_ptr<Resampler> resampler = open_format_converter();
+    SampleRing ring(AV_SAMPLE_FMT_S16P, CHANNELS, FRAME_SIZE, FRAME_SIZE * 2);
+
+    // Free space is exactly what the resampler puts out, the ring is full after the first go
+    CHECK(resample(&ring, resampler.get(), make_samples(0, FRAME_SIZE * 2)));
+    CHECK(ring.size() == FRAME_SIZE * 2);
+    check_samples(&ring, 0, FRAME_SIZE * 2);
+}
+
+static void test_fills_wrapped_ring_exactly() {
+    std::unique_ptr<Resampler> resampler = open_format_converter();
+    SampleRing ring(AV_SAMPLE_FMT_S16P, CHANNELS, FRAME_SIZE, FRAME_SIZE * 2);
+
+    // One frame and a bit, then the frame is read and given back: the free space wraps around the end of the ring
+    int buffered = FRAME_SIZE + 500;
+    CHECK(resample(&ring, resampler.get(), make_samples(0, buffered)));
+    AVFrame* frame = av_frame_alloc();
+    CHECK(ring.read(frame, FRAME_SIZE));
+    av_frame_free(&frame);
+
+    // Exactly the free space, in two goes: up to the end of the ring, then from its start
+    int free_space = FRAME_SIZE * 2 - (buffered - FRAME_SIZE);
+    CHECK(resample(&ring, resampler.get(), make_samples(buffered, free_space)));
+    CHECK(ring.size() == FRAME_SIZE * 2);
+    check_samples(&ring, FRAME_SIZE, FRAME_SIZE * 2);
+}
+
+int main() {
+    test_fills_empty_ring_exactly();
+    test_fills_wrapped_ring_exactly();
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
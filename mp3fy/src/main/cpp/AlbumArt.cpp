@@ -0,0 +1,310 @@
+#include "AlbumArt.h"
+
+#include <android/bitmap.h>
+#include <android/log.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+static const int64_t DEFAULT_THUMBNAIL_CACHE_SIZE = 8 * 1024 * 1024;
+
+struct ThumbnailKey {
+    uint64_t hash;
+    int size;
+    int width;
+    int height;
+    int format;
+
+    bool operator==(const ThumbnailKey& other) const {
+        return hash == other.hash && size == other.size && width == other.width && height == other.height &&
+               format == other.format;
+    }
+};
+
+struct ThumbnailKeyHash {
+    size_t operator()(const ThumbnailKey& key) const {
+        return (size_t)(key.hash ^ ((uint64_t)key.width << 48) ^ ((uint64_t)key.height << 32) ^ (uint64_t)key.format);
+    }
+};
+
+struct CachedThumbnail {
+    ThumbnailKey key;
+    // Rows are packed
+    std::vector<uint8_t> pixels;
+};
+
+/**
+ * Decoded thumbnails, most recently used first
+ */
+struct ThumbnailCache {
+    std::mutex mutex;
+    std::list<CachedThumbnail> thumbnails;
+    std::unordered_map<ThumbnailKey, std::list<CachedThumbnail>::iterator, ThumbnailKeyHash> index;
+    int64_t budget = DEFAULT_THUMBNAIL_CACHE_SIZE;
+    int64_t bytes = 0;
+    int64_t hits = 0;
+    int64_t misses = 0;
+
+    void evict() {
+        while (bytes > budget && !thumbnails.empty()) {
+            bytes -= thumbnails.back().pixels.size();
+            index.erase(thumbnails.back().key);
+            thumbnails.pop_back();
+        }
+    }
+};
+
+static ThumbnailCache& thumbnail_cache() {
+    static ThumbnailCache cache;
+    return cache;
+}
+
+int thumbnail_bytes_per_pixel(int format) {
+    switch (format) {
+        case THUMBNAIL_FORMAT_RGBA_8888: return 4;
+        case THUMBNAIL_FORMAT_RGB_565: return 2;
+        default: return 0;
+    }
+}
+
+uint64_t hash_album_art(const uint8_t* data, size_t size) {
+    // FNV-1a over 8 bytes at a time, with a shift so the high bits of a word reach the low bits of the hash too
+    uint64_t hash = 14695981039346656037ull ^ size;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash ? hash : 1;
+}
+
+static void copy_rows(uint8_t* destination, int destination_stride, const uint8_t* source, int source_stride, int row_size, int height) {
+    for (int y = 0; y < height; y++) {
+        memcpy(destination + (size_t)y * destination_stride, source + (size_t)y * source_stride, row_size);
+    }
+}
+
+/**
+ * Only counts hits, a miss is counted once the picture gets decoded instead (by decode_thumbnail)
+ */
+bool find_cached_thumbnail(uint64_t hash, int size, uint8_t* pixels, int width, int height, int stride, int format) {
+    ThumbnailCache& cache = thumbnail_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto entry = cache.index.find({hash, size, width, height, format});
+    if (entry == cache.index.end()) return false;
+
+    cache.thumbnails.splice(cache.thumbnails.begin(), cache.thumbnails, entry->second);
+    int row_size = width * thumbnail_bytes_per_pixel(format);
+    copy_rows(pixels, stride, entry->second->pixels.data(), row_size, row_size, height);
+    cache.hits++;
+    return true;
+}
+
+static void store_cached_thumbnail(const ThumbnailKey& key, const uint8_t* pixels, int stride) {
+    ThumbnailCache& cache = thumbnail_cache();
+    int row_size = key.width * thumbnail_bytes_per_pixel(key.format);
+    int64_t size = (int64_t)row_size * key.height;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (size > cache.budget || cache.index.count(key)) return;
+
+    cache.thumbnails.push_front({key, std::vector<uint8_t>((size_t)size)});
+    copy_rows(cache.thumbnails.front().pixels.data(), row_size, pixels, stride, row_size, key.height);
+    cache.index[key] = cache.thumbnails.begin();
+    cache.bytes += size;
+    cache.evict();
+}
+
+void set_thumbnail_cache_size(int64_t bytes) {
+    ThumbnailCache& cache = thumbnail_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.budget = std::max<int64_t>(0, bytes);
+    cache.evict();
+}
+
+ThumbnailCacheStats get_thumbnail_cache_stats() {
+    ThumbnailCache& cache = thumbnail_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    return {cache.hits, cache.misses, (int64_t)cache.thumbnails.size(), cache.bytes};
+}
+
+/**
+ * The biggest part of a picture with the aspect ratio of the thumbnail, around its center
+ */
+static void crop_to_aspect(int picture_width, int picture_height, int width, int height, int* crop_width, int* crop_height) {
+    *crop_width = picture_width;
+    *crop_height = picture_height;
+    if ((int64_t)picture_width * height > (int64_t)picture_height * width) {
+        *crop_width = std::max(1, (int)((int64_t)picture_height * width / height));
+    } else {
+        *crop_height = std::max(1, (int)((int64_t)picture_width * height / width));
+    }
+}
+
+/**
+ * Decodes the picture with BitmapFactory, the bundled FFmpeg has no image decoders. The picture is subsampled by the
+ * biggest power of 2 that keeps the crop of it at least as big as the thumbnail, which BitmapFactory does while it
+ * decodes a JPEG, so a big cover never gets decoded in full for a small thumbnail
+ * @return a local reference to an ARGB_8888 bitmap (premultiplied), null if the picture couldn't be decoded
+ */
+static jobject decode_picture(JNIEnv* env, const AVPacket* picture, int width, int height) {
+    jclass factory_class = env->FindClass("android/graphics/BitmapFactory");
+    jclass options_class = env->FindClass("android/graphics/BitmapFactory$Options");
+    jclass config_class = env->FindClass("android/graphics/Bitmap$Config");
+    jmethodID decode_method = env->GetStaticMethodID(factory_class, "decodeByteArray",
+                                                     "([BIILandroid/graphics/BitmapFactory$Options;)Landroid/graphics/Bitmap;");
+    jfieldID just_decode_bounds_field = env->GetFieldID(options_class, "inJustDecodeBounds", "Z");
+    jfieldID sample_size_field = env->GetFieldID(options_class, "inSampleSize", "I");
+    jfieldID preferred_config_field = env->GetFieldID(options_class, "inPreferredConfig", "Landroid/graphics/Bitmap$Config;");
+    jfieldID width_field = env->GetFieldID(options_class, "outWidth", "I");
+    jfieldID height_field = env->GetFieldID(options_class, "outHeight", "I");
+    jobject argb_8888 = env->GetStaticObjectField(config_class, env->GetStaticFieldID(config_class, "ARGB_8888", "Landroid/graphics/Bitmap$Config;"));
+
+    jobject options = env->NewObject(options_class, env->GetMethodID(options_class, "<init>", "()V"));
+    jbyteArray data = env->NewByteArray(picture->size);
+    jobject bitmap = nullptr;
+    if (options && data) {
+        env->SetByteArrayRegion(data, 0, picture->size, reinterpret_cast<const jbyte*>(picture->data));
+
+        // Only reads the size of the picture
+        env->SetBooleanField(options, just_decode_bounds_field, JNI_TRUE);
+        env->CallStaticObjectMethod(factory_class, decode_method, data, 0, picture->size, options);
+        int picture_width = env->GetIntField(options, width_field);
+        int picture_height = env->GetIntField(options, height_field);
+
+        if (!env->ExceptionCheck() && picture_width > 0 && picture_height > 0) {
+            int crop_width, crop_height;
+            crop_to_aspect(picture_width, picture_height, width, height, &crop_width, &crop_height);
+            int sample_size = 1;
+            while (crop_width / (sample_size * 2) >= width && crop_height / (sample_size * 2) >= height) sample_size *= 2;
+
+            env->SetBooleanField(options, just_decode_bounds_field, JNI_FALSE);
+            env->SetIntField(options, sample_size_field, sample_size);
+            env->SetObjectField(options, preferred_config_field, argb_8888);
+            bitmap = env->CallStaticObjectMethod(factory_class, decode_method, data, 0, picture->size, options);
+        }
+    }
+    if (env->ExceptionCheck()) {
+        // Out of memory, most likely
+        env->ExceptionClear();
+        bitmap = nullptr;
+    }
+
+    env->DeleteLocalRef(data);
+    env->DeleteLocalRef(options);
+    env->DeleteLocalRef(argb_8888);
+    env->DeleteLocalRef(config_class);
+    env->DeleteLocalRef(options_class);
+    env->DeleteLocalRef(factory_class);
+    return bitmap;
+}
+
+/**
+ * Position of a thumbnail pixel center in the source, in 1/65536 of a source pixel, clamped to the source
+ */
+static void map_position(int position, int size, int source_size, int* first, int* second, int* weight) {
+    int64_t mapped = ((int64_t)(2 * position + 1) * source_size * 65536 / size - 65536) / 2;
+    mapped = std::max<int64_t>(0, std::min<int64_t>(mapped, (int64_t)(source_size - 1) * 65536));
+    *first = (int)(mapped >> 16);
+    *second = std::min(*first + 1, source_size - 1);
+    *weight = (int)(mapped & 0xFFFF);
+}
+
+/**
+ * Bilinear scale of RGBA pixels (premultiplied, as Android bitmaps are) into the thumbnail. decode_picture keeps the
+ * source under twice the size of the thumbnail, which is as far as bilinear goes without skipping source pixels
+ */
+static void scale_pixels(const uint8_t* source, int source_width, int source_height, int source_stride,
+                         uint8_t* pixels, int width, int height, int stride, int format) {
+    std::vector<int> first_x((size_t)width), second_x((size_t)width), weight_x((size_t)width);
+    for (int x = 0; x < width; x++) map_position(x, width, source_width, &first_x[x], &second_x[x], &weight_x[x]);
+
+    for (int y = 0; y < height; y++) {
+        int first_y, second_y, weight_y;
+        map_position(y, height, source_height, &first_y, &second_y, &weight_y);
+        const uint8_t* top = source + (size_t)first_y * source_stride;
+        const uint8_t* bottom = source + (size_t)second_y * source_stride;
+        uint8_t* row = pixels + (size_t)y * stride;
+
+        for (int x = 0; x < width; x++) {
+            uint8_t color[4];
+            for (int c = 0; c < 4; c++) {
+                int64_t upper = top[first_x[x] * 4 + c] * (65536 - weight_x[x]) + top[second_x[x] * 4 + c] * weight_x[x];
+                int64_t lower = bottom[first_x[x] * 4 + c] * (65536 - weight_x[x]) + bottom[second_x[x] * 4 + c] * weight_x[x];
+                color[c] = (uint8_t)((upper * (65536 - weight_y) + lower * weight_y + (1ll << 31)) >> 32);
+            }
+
+            if (format == THUMBNAIL_FORMAT_RGBA_8888) {
+                memcpy(row + x * 4, color, 4);
+            } else {
+                uint16_t rgb565 = (uint16_t)(((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3));
+                memcpy(row + x * 2, &rgb565, 2);
+            }
+        }
+    }
+}
+
+static int scale_picture(JNIEnv* env, const AVPacket* picture, uint8_t* pixels, int width, int height, int stride, int format) {
+    auto started = std::chrono::steady_clock::now();
+    jobject bitmap = decode_picture(env, picture, width, height);
+    if (!bitmap) return AVERROR_INVALIDDATA;
+
+    AndroidBitmapInfo info = {};
+    void* source = nullptr;
+    int ret = AVERROR_INVALIDDATA;
+    // Pictures with more than 8 bits per channel can come out as RGBA_F16 on newer Androids
+    if (AndroidBitmap_getInfo(env, bitmap, &info) == ANDROID_BITMAP_RESULT_SUCCESS && info.format == ANDROID_BITMAP_FORMAT_RGBA_8888 &&
+        AndroidBitmap_lockPixels(env, bitmap, &source) == ANDROID_BITMAP_RESULT_SUCCESS) {
+        int crop_width, crop_height;
+        crop_to_aspect(info.width, info.height, width, height, &crop_width, &crop_height);
+        const uint8_t* crop = static_cast<const uint8_t*>(source) + (size_t)((info.height - crop_height) / 2) * info.stride +
+                              (size_t)((info.width - crop_width) / 2) * 4;
+        scale_pixels(crop, crop_width, crop_height, info.stride, pixels, width, height, stride, format);
+        AndroidBitmap_unlockPixels(env, bitmap);
+        ret = 0;
+    }
+
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Thumbnail %dx%d from a %dx%d decode in %lld us", width, height,
+                        info.width, info.height,
+                        (long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+
+    // Frees the pixels now, instead of whenever the garbage collector gets to the bitmap
+    jclass bitmap_class = env->GetObjectClass(bitmap);
+    env->CallVoidMethod(bitmap, env->GetMethodID(bitmap_class, "recycle", "()V"));
+    env->DeleteLocalRef(bitmap_class);
+    env->DeleteLocalRef(bitmap);
+    return ret;
+}
+
+int decode_thumbnail(JNIEnv* env, const AVStream* stream, uint8_t* pixels, int width, int height, int stride, int format) {
+    if (width <= 0 || height <= 0 || !thumbnail_bytes_per_pixel(format) || stride < width * thumbnail_bytes_per_pixel(format)) {
+        return AVERROR(EINVAL);
+    }
+    const AVPacket* picture = &stream->attached_pic;
+    if (!picture->data) return AVERROR_STREAM_NOT_FOUND;
+
+    ThumbnailKey key = {hash_album_art(picture->data, picture->size), picture->size, width, height, format};
+    if (find_cached_thumbnail(key.hash, key.size, pixels, width, height, stride, format)) return 0;
+    {
+        ThumbnailCache& cache = thumbnail_cache();
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        cache.misses++;
+    }
+
+    int ret = scale_picture(env, picture, pixels, width, height, stride, format);
+    if (ret == 0) store_cached_thumbnail(key, pixels, stride);
+    return ret;
+}
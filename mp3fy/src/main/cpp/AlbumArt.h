@@ -0,0 +1,61 @@
+#ifndef MP3FY_ALBUMART_H
+#define MP3FY_ALBUMART_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include <jni.h>
+
+// Pixel layouts thumbnails are decoded to, these have to match the THUMBNAIL_FORMAT_* constants in MP3fy.java
+enum ThumbnailFormat {
+    // 4 bytes per pixel, R G B A in memory (Bitmap.Config.ARGB_8888), alpha premultiplied
+    THUMBNAIL_FORMAT_RGBA_8888 = 0,
+    // 2 bytes per pixel, native endian (Bitmap.Config.RGB_565)
+    THUMBNAIL_FORMAT_RGB_565 = 1,
+};
+
+/**
+ * @return the bytes per pixel of a ThumbnailFormat, 0 if it isn't one
+ */
+int thumbnail_bytes_per_pixel(int format);
+
+struct ThumbnailCacheStats {
+    int64_t hits;
+    int64_t misses;
+    int64_t entries;
+    int64_t bytes;
+};
+
+/**
+ * Hashes the bytes of a picture. The tracks of an album usually embed the very same cover, which hashes the same
+ * @return never 0
+ */
+uint64_t hash_album_art(const uint8_t* data, size_t size);
+
+/**
+ * Decodes an embedded picture (the attached_pic of a stream) straight to width x height pixels, cropped around its
+ * center to the aspect ratio of the thumbnail. The picture is decoded by BitmapFactory, subsampled by the biggest
+ * power of 2 that keeps it bigger than the thumbnail, so a big cover never gets decoded in full for a small thumbnail.
+ * Thumbnails are cached by the hash of the picture, so a cover shared by many files is only decoded once per size
+ * @param env Of the calling thread, for BitmapFactory
+ * @param pixels Where the thumbnail goes, stride bytes per row
+ * @param format One of the ThumbnailFormat values
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int decode_thumbnail(JNIEnv* env, const AVStream* stream, uint8_t* pixels, int width, int height, int stride, int format);
+
+/**
+ * Copies a thumbnail of the picture with this hash and size out of the cache, without the picture itself
+ * @return false if it isn't cached
+ */
+bool find_cached_thumbnail(uint64_t hash, int size, uint8_t* pixels, int width, int height, int stride, int format);
+
+/**
+ * Sets how many bytes of thumbnails are cached, the least recently used ones go first. 0 turns the cache off
+ */
+void set_thumbnail_cache_size(int64_t bytes);
+
+ThumbnailCacheStats get_thumbnail_cache_stats();
+
+#endif //MP3FY_ALBUMART_H
@@ -0,0 +1,158 @@
+#include "AsyncIo.h"
+#include "WorkerPool.h"
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+#include <android/log.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+
+// Enough to keep a few disks (or one slow one) busy without piling up threads that only wait
+static const int DEFAULT_IO_THREADS = 4;
+
+struct AsyncBlock {
+    int64_t index = 0;
+    std::vector<uint8_t> data;
+    // Bytes read, or a negative AVERROR
+    int length = 0;
+    bool done = false;
+};
+
+/**
+ * Does the reads and writes of every AsyncReader and AsyncWriter
+ */
+static WorkerPool& io_pool() {
+    static WorkerPool pool(DEFAULT_IO_THREADS);
+    return pool;
+}
+
+void set_io_threads(int count) {
+    io_pool().set_concurrency(count);
+}
+
+/**
+ * Reads until size bytes are there or the file ends
+ * @return the bytes read, a negative AVERROR if there was an error before any
+ */
+static int read_fully(int fd, uint8_t* buffer, int size, int64_t position) {
+    int total = 0;
+    while (total < size) {
+        ssize_t count = pread64(fd, buffer + total, size - total, position + total);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return total > 0 ? total : AVERROR(errno);
+        if (count == 0) break;
+        total += (int)count;
+    }
+    return total;
+}
+
+static int write_fully(int fd, const uint8_t* data, int size, int64_t position) {
+    int total = 0;
+    while (total < size) {
+        ssize_t count = pwrite64(fd, data + total, size - total, position + total);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return AVERROR(errno);
+        total += (int)count;
+    }
+    return 0;
+}
+
+AsyncReader::AsyncReader(int fd, int64_t size, int block_size, int depth)
+        : fd(fd), size(size), block_size(block_size), depth(std::max(1, depth)) {}
+
+AsyncReader::~AsyncReader() {
+    std::unique_lock<std::mutex> lock(mutex);
+    completed.wait(lock, [&] { return in_flight == 0; });
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Async input: waited for the disk %lld times", (long long)stalls);
+}
+
+void AsyncReader::request(int64_t index) {
+    std::shared_ptr<AsyncBlock> block = std::make_shared<AsyncBlock>();
+    block->index = index;
+    blocks.push_back(block);
+    in_flight++;
+
+    // The block outlives the window when the reader jumps away, but never the reader itself (see the destructor)
+    io_pool().submit(0, [this, block]() {
+        block->data.resize(block_size);
+        int length = read_fully(fd, block->data.data(), block_size, block->index * block_size);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        block->length = length;
+        block->done = true;
+        in_flight--;
+        completed.notify_all();
+    });
+}
+
+int AsyncReader::read(uint8_t* buffer, int count, int64_t position) {
+    if (position >= size) return AVERROR_EOF;
+    int64_t index = position / block_size;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    // Blocks behind the position are done with, and a jump away from the window makes all of them useless
+    while (!blocks.empty() && blocks.front()->index < index) blocks.pop_front();
+    if (!blocks.empty() && blocks.front()->index != index) blocks.clear();
+
+    int64_t next = blocks.empty() ? index : blocks.back()->index + 1;
+    while (next < index + depth && next * block_size < size) request(next++);
+
+    std::shared_ptr<AsyncBlock> block = blocks.front();
+    if (!block->done) {
+        stalls++;
+        completed.wait(lock, [&] { return block->done; });
+    }
+    if (block->length < 0) return block->length;
+
+    int offset = (int)(position - index * block_size);
+    if (offset >= block->length) return AVERROR_EOF;
+    count = std::min(count, block->length - offset);
+    memcpy(buffer, block->data.data() + offset, count);
+    return count;
+}
+
+AsyncWriter::AsyncWriter(int fd, int depth) : fd(fd), depth(std::max(1, depth)) {}
+
+AsyncWriter::~AsyncWriter() {
+    finish();
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Async output: waited for the disk %lld times", (long long)stalls);
+}
+
+int AsyncWriter::write(const uint8_t* data, int size, int64_t position) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (error < 0) return error;
+
+    if (position != append_position) {
+        // A rewrite, like a header filled in at the end. It must not race the writes it overwrites
+        completed.wait(lock, [&] { return in_flight == 0; });
+    } else if (in_flight >= depth) {
+        stalls++;
+        completed.wait(lock, [&] { return in_flight < depth; });
+    }
+    append_position = position + size;
+    in_flight++;
+    lock.unlock();
+
+    std::shared_ptr<std::vector<uint8_t>> copy = std::make_shared<std::vector<uint8_t>>(data, data + size);
+    io_pool().submit(0, [this, copy, position]() {
+        int ret = write_fully(fd, copy->data(), (int)copy->size(), position);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ret < 0 && error == 0) error = ret;
+        in_flight--;
+        completed.notify_all();
+    });
+    return 0;
+}
+
+int AsyncWriter::finish() {
+    std::unique_lock<std::mutex> lock(mutex);
+    completed.wait(lock, [&] { return in_flight == 0; });
+    return error;
+}
@@ -0,0 +1,102 @@
+#ifndef MP3FY_ASYNCIO_H
+#define MP3FY_ASYNCIO_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+struct AsyncBlock;
+
+/**
+ * Reads a file in blocks on the I/O threads shared by every open file, a few blocks ahead of the reader. The reader
+ * only waits when the disk falls behind the conversion.
+ */
+class AsyncReader {
+public:
+    /**
+     * @param fd Regular file to read, it has to stay open until the reader is gone
+     * @param depth How many blocks are read ahead
+     */
+    AsyncReader(int fd, int64_t size, int block_size, int depth);
+
+    /**
+     * Waits for the reads in flight
+     */
+    ~AsyncReader();
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    /**
+     * Like pread. Reads that jump away from the blocks read ahead start a new window there
+     * @return the bytes read, at most to the end of a block, AVERROR_EOF at the end of the file or another AVERROR
+     */
+    int read(uint8_t* buffer, int size, int64_t position);
+
+private:
+    void request(int64_t index);
+
+    int fd;
+    int64_t size;
+    int block_size;
+    int depth;
+    std::mutex mutex;
+    std::condition_variable completed;
+    // Consecutive blocks from the one being read on
+    std::deque<std::shared_ptr<AsyncBlock>> blocks;
+    int in_flight = 0;
+    // Reads that had to wait for the disk
+    int64_t stalls = 0;
+};
+
+/**
+ * Writes a file on the I/O threads shared by every open file. Writes return once their data is copied, the caller
+ * only waits when depth writes are already pending.
+ */
+class AsyncWriter {
+public:
+    /**
+     * @param fd File to write, it has to stay open until finish() returned
+     */
+    AsyncWriter(int fd, int depth);
+
+    /**
+     * Waits for the writes in flight
+     */
+    ~AsyncWriter();
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    /**
+     * Like pwrite, but the data is written later
+     * @return 0 on success, the AVERROR of a write that failed before otherwise
+     */
+    int write(const uint8_t* data, int size, int64_t position);
+
+    /**
+     * Waits until everything is written
+     * @return 0 on success, the AVERROR of the first write that failed otherwise
+     */
+    int finish();
+
+private:
+    int fd;
+    int depth;
+    std::mutex mutex;
+    std::condition_variable completed;
+    int in_flight = 0;
+    int error = 0;
+    // Where the last queued write ended
+    int64_t append_position = 0;
+    int64_t stalls = 0;
+};
+
+/**
+ * Sets how many threads do the reads and writes of AsyncReader and AsyncWriter, for all of them together
+ */
+void set_io_threads(int count);
+
+#endif //MP3FY_ASYNCIO_H
@@ -0,0 +1,29 @@
+#include "CodecLock.h"
+
+#include <mutex>
+
+static std::mutex& codec_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+int open_codec(AVCodecContext* context, const AVCodec* codec, AVDictionary** options) {
+    std::lock_guard<std::mutex> lock(codec_mutex());
+    return avcodec_open2(context, codec, options);
+}
+
+void free_codec(AVCodecContext** context) {
+    if (!*context) return;
+    std::lock_guard<std::mutex> lock(codec_mutex());
+    avcodec_free_context(context);
+}
+
+int find_stream_info(AVFormatContext* context) {
+    std::lock_guard<std::mutex> lock(codec_mutex());
+    return avformat_find_stream_info(context, nullptr);
+}
+
+void close_format_input(AVFormatContext** context) {
+    std::lock_guard<std::mutex> lock(codec_mutex());
+    avformat_close_input(context);
+}
@@ -0,0 +1,33 @@
+#ifndef MP3FY_CODECLOCK_H
+#define MP3FY_CODECLOCK_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+// FFmpeg is built with --disable-pthreads, which turns the lock it holds around codec init into a no-op. Two threads
+// opening codecs at once then trip its "Insufficient thread locking" check, and one of them fails with EINVAL.
+// Whatever opens or closes codecs goes through these instead, which share one process-wide lock.
+
+/**
+ * avcodec_open2
+ */
+int open_codec(AVCodecContext* context, const AVCodec* codec, AVDictionary** options = nullptr);
+
+/**
+ * avcodec_free_context, does nothing for a null context
+ */
+void free_codec(AVCodecContext** context);
+
+/**
+ * avformat_find_stream_info, which opens a decoder for every stream it has to probe
+ */
+int find_stream_info(AVFormatContext* context);
+
+/**
+ * avformat_close_input, which closes the decoders avformat_find_stream_info left open
+ */
+void close_format_input(AVFormatContext** context);
+
+#endif //MP3FY_CODECLOCK_H
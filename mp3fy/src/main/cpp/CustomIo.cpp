@@ -0,0 +1,258 @@
+#include "CustomIo.h"
+
+#include <android/log.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+
+// Reads and writes through JNI cost a call and a copy into a Java array each, so keep them few
+static const int JAVA_STREAM_BUFFER_SIZE = 64 * 1024;
+
+// Memory inputs are copied straight into the demuxer's buffers, this only serves its small reads
+static const int MEMORY_INPUT_BUFFER_SIZE = 32 * 1024;
+
+static const int MEMORY_OUTPUT_BUFFER_SIZE = 32 * 1024;
+
+static pthread_key_t attached_thread_key;
+static pthread_once_t attached_thread_once = PTHREAD_ONCE_INIT;
+
+static void detach_thread(void* vm) {
+    static_cast<JavaVM*>(vm)->DetachCurrentThread();
+}
+
+static void create_attached_thread_key() {
+    pthread_key_create(&attached_thread_key, detach_thread);
+}
+
+JNIEnv* attach_current_thread(JavaVM* vm) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK) return env;
+
+    if (vm->AttachCurrentThread(&env, nullptr) != JNI_OK) return nullptr;
+    // A thread that exits attached takes the VM down with it
+    pthread_once(&attached_thread_once, create_attached_thread_key);
+    pthread_setspecific(attached_thread_key, vm);
+    return env;
+}
+
+AVIOContext* alloc_custom_io(CustomIo* io, int buffer_size, bool writable,
+                             int (*read_packet)(void*, uint8_t*, int),
+                             int (*write_packet)(void*, uint8_t*, int),
+                             int64_t (*seek)(void*, int64_t, int)) {
+    auto* buffer = (uint8_t*)av_malloc(buffer_size);
+    AVIOContext* io_context = buffer ? avio_alloc_context(buffer, buffer_size, writable, io, read_packet, write_packet, seek) : nullptr;
+    if (!io_context) {
+        av_free(buffer);
+        delete io;
+        return nullptr;
+    }
+    io_context->seekable = seek ? AVIO_SEEKABLE_NORMAL : 0;
+    return io_context;
+}
+
+int free_custom_io(AVIOContext** io_context, bool discard) {
+    if (!*io_context) return 0;
+
+    // Whatever is still buffered has to reach the CustomIo before it goes away
+    int ret = 0;
+    if ((*io_context)->write_flag) {
+        avio_flush(*io_context);
+        ret = (*io_context)->error;
+    }
+    auto* io = static_cast<CustomIo*>((*io_context)->opaque);
+    int finished = io->finish(discard);
+    delete io;
+
+    av_freep(&(*io_context)->buffer);
+    avio_context_free(io_context);
+    return ret < 0 ? ret : finished;
+}
+
+int64_t resolve_seek(int64_t position, int64_t size, int64_t offset, int whence) {
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return size >= 0 ? size : AVERROR(ENOSYS);
+        case SEEK_SET:
+            position = offset;
+            break;
+        case SEEK_CUR:
+            position += offset;
+            break;
+        case SEEK_END:
+            if (size < 0) return AVERROR(ENOSYS);
+            position = size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    return position < 0 ? AVERROR(EINVAL) : position;
+}
+
+struct MemoryReader : CustomIo {
+    const uint8_t* data = nullptr;
+    int64_t size = 0;
+    int64_t position = 0;
+    std::function<void()> release;
+
+    ~MemoryReader() override {
+        if (release) release();
+    }
+};
+
+static int read_memory(void* opaque, uint8_t* buffer, int size) {
+    auto* reader = static_cast<MemoryReader*>(opaque);
+    if (reader->position >= reader->size) return AVERROR_EOF;
+
+    int count = (int)std::min<int64_t>(size, reader->size - reader->position);
+    memcpy(buffer, reader->data + reader->position, count);
+    reader->position += count;
+    return count;
+}
+
+static int64_t seek_memory(void* opaque, int64_t offset, int whence) {
+    auto* reader = static_cast<MemoryReader*>(opaque);
+    int64_t position = resolve_seek(reader->position, reader->size, offset, whence);
+    if (position >= 0 && !(whence & AVSEEK_SIZE)) reader->position = position;
+    return position;
+}
+
+AVIOContext* create_memory_input(const uint8_t* data, int64_t size, std::function<void()> release) {
+    auto* reader = new MemoryReader;
+    reader->data = data;
+    reader->size = size;
+    reader->release = std::move(release);
+
+    AVIOContext* io_context = alloc_custom_io(reader, MEMORY_INPUT_BUFFER_SIZE, false, read_memory, nullptr, seek_memory);
+    // Large reads skip the buffer and get copied from the memory in one go, and seeks only move our position
+    if (io_context) io_context->direct = 1;
+    return io_context;
+}
+
+/**
+ * A Java stream and the array that carries the bytes across JNI
+ */
+struct JavaStream : CustomIo {
+    JavaVM* vm = nullptr;
+    jobject stream = nullptr;
+    jbyteArray array = nullptr;
+    jmethodID transfer = nullptr;
+    jmethodID flush = nullptr;
+
+    ~JavaStream() override {
+        JNIEnv* env = attach_current_thread(vm);
+        if (!env) return;
+        if (flush) {
+            env->CallVoidMethod(stream, flush);
+            if (env->ExceptionCheck()) env->ExceptionClear();
+        }
+        env->DeleteGlobalRef(array);
+        env->DeleteGlobalRef(stream);
+    }
+};
+
+static JavaStream* create_java_stream(JNIEnv* env, jobject stream, const char* method, const char* signature) {
+    jclass stream_class = env->GetObjectClass(stream);
+    jmethodID transfer = env->GetMethodID(stream_class, method, signature);
+    env->DeleteLocalRef(stream_class);
+    jbyteArray array = env->NewByteArray(JAVA_STREAM_BUFFER_SIZE);
+    if (!transfer || !array) {
+        env->ExceptionClear();
+        if (array) env->DeleteLocalRef(array);
+        return nullptr;
+    }
+
+    auto* java_stream = new JavaStream;
+    env->GetJavaVM(&java_stream->vm);
+    java_stream->stream = env->NewGlobalRef(stream);
+    java_stream->array = (jbyteArray)env->NewGlobalRef(array);
+    java_stream->transfer = transfer;
+    env->DeleteLocalRef(array);
+    return java_stream;
+}
+
+static int read_java_stream(void* opaque, uint8_t* buffer, int size) {
+    auto* reader = static_cast<JavaStream*>(opaque);
+    JNIEnv* env = attach_current_thread(reader->vm);
+    if (!env) return AVERROR(EIO);
+
+    jint count = env->CallIntMethod(reader->stream, reader->transfer, reader->array, 0, std::min(size, JAVA_STREAM_BUFFER_SIZE));
+    if (env->ExceptionCheck()) {
+        env->ExceptionClear();
+        return AVERROR(EIO);
+    }
+    if (count < 0) return AVERROR_EOF;
+
+    env->GetByteArrayRegion(reader->array, 0, count, reinterpret_cast<jbyte*>(buffer));
+    return count;
+}
+
+static int write_java_stream(void* opaque, uint8_t* buffer, int size) {
+    auto* writer = static_cast<JavaStream*>(opaque);
+    JNIEnv* env = attach_current_thread(writer->vm);
+    if (!env) return AVERROR(EIO);
+
+    for (int written = 0; written < size;) {
+        int count = std::min(size - written, JAVA_STREAM_BUFFER_SIZE);
+        env->SetByteArrayRegion(writer->array, 0, count, reinterpret_cast<const jbyte*>(buffer + written));
+        env->CallVoidMethod(writer->stream, writer->transfer, writer->array, 0, count);
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            return AVERROR(EIO);
+        }
+        written += count;
+    }
+    return size;
+}
+
+AVIOContext* create_java_input(JNIEnv* env, jobject input_stream) {
+    JavaStream* reader = create_java_stream(env, input_stream, "read", "([BII)I");
+    if (!reader) return nullptr;
+
+    // Streams only go forward, so the demuxer has to make do without seeking
+    return alloc_custom_io(reader, JAVA_STREAM_BUFFER_SIZE, false, read_java_stream, nullptr, nullptr);
+}
+
+AVIOContext* create_java_output(JNIEnv* env, jobject output_stream) {
+    JavaStream* writer = create_java_stream(env, output_stream, "write", "([BII)V");
+    if (!writer) return nullptr;
+
+    jclass stream_class = env->GetObjectClass(output_stream);
+    writer->flush = env->GetMethodID(stream_class, "flush", "()V");
+    env->DeleteLocalRef(stream_class);
+
+    return alloc_custom_io(writer, JAVA_STREAM_BUFFER_SIZE, true, nullptr, write_java_stream, nullptr);
+}
+
+struct MemoryWriter : CustomIo {
+    std::shared_ptr<std::vector<uint8_t>> data;
+    int64_t position = 0;
+};
+
+static int write_memory(void* opaque, uint8_t* buffer, int size) {
+    auto* writer = static_cast<MemoryWriter*>(opaque);
+    std::vector<uint8_t>& data = *writer->data;
+
+    // Muxers go back to fill in headers, so this isn't always an append
+    size_t end = (size_t)writer->position + size;
+    if (end > data.size()) data.resize(end);
+    memcpy(data.data() + writer->position, buffer, size);
+    writer->position = end;
+    return size;
+}
+
+static int64_t seek_memory_output(void* opaque, int64_t offset, int whence) {
+    auto* writer = static_cast<MemoryWriter*>(opaque);
+    int64_t position = resolve_seek(writer->position, (int64_t)writer->data->size(), offset, whence);
+    if (position >= 0 && !(whence & AVSEEK_SIZE)) writer->position = position;
+    return position;
+}
+
+AVIOContext* create_memory_output(std::shared_ptr<std::vector<uint8_t>>* data) {
+    auto* writer = new MemoryWriter;
+    writer->data = std::make_shared<std::vector<uint8_t>>();
+    *data = writer->data;
+
+    return alloc_custom_io(writer, MEMORY_OUTPUT_BUFFER_SIZE, true, nullptr, write_memory, seek_memory_output);
+}
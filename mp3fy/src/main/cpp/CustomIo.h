@@ -0,0 +1,77 @@
+#ifndef MP3FY_CUSTOMIO_H
+#define MP3FY_CUSTOMIO_H
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+#include <jni.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/**
+ * Base of the state behind our own AVIOContexts (their opaque points at one), so that whoever closes a context can
+ * free any of them the same way, see free_custom_io
+ */
+struct CustomIo {
+    virtual ~CustomIo() = default;
+
+    /**
+     * Called once the context is done with, before it's freed. Outputs get their data where it belongs here
+     * @param discard True when the output is of no use (the conversion failed), so it shouldn't replace anything
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    virtual int finish(bool discard) { return 0; }
+};
+
+/**
+ * Creates an AVIOContext over io with a buffer of buffer_size bytes. Takes io over, it is deleted on failure too.
+ * Pass null callbacks for what the context doesn't do
+ */
+AVIOContext* alloc_custom_io(CustomIo* io, int buffer_size, bool writable,
+                             int (*read_packet)(void*, uint8_t*, int),
+                             int (*write_packet)(void*, uint8_t*, int),
+                             int64_t (*seek)(void*, int64_t, int));
+
+/**
+ * Frees a context created with alloc_custom_io, its buffer and its CustomIo
+ * @param discard See CustomIo::finish
+ * @return 0 if everything written to it got through, a negative AVERROR otherwise
+ */
+int free_custom_io(AVIOContext** io_context, bool discard = false);
+
+/**
+ * Resolves an AVIOContext seek against a position and a size, -1 for an unknown size
+ * @return the new position (or the size for AVSEEK_SIZE), a negative AVERROR if it can't be reached
+ */
+int64_t resolve_seek(int64_t position, int64_t size, int64_t offset, int whence);
+
+/**
+ * Reads size bytes at data. Nothing is copied, release is called once the context doesn't need the memory anymore
+ */
+AVIOContext* create_memory_input(const uint8_t* data, int64_t size, std::function<void()> release);
+
+/**
+ * Reads from a java.io.InputStream, in order. The stream is not closed
+ */
+AVIOContext* create_java_input(JNIEnv* env, jobject input_stream);
+
+/**
+ * Writes to a java.io.OutputStream, in order. The stream is flushed when the context is freed, but not closed
+ */
+AVIOContext* create_java_output(JNIEnv* env, jobject output_stream);
+
+/**
+ * Writes into memory that grows as needed. The memory outlives the context, data keeps it alive
+ */
+AVIOContext* create_memory_output(std::shared_ptr<std::vector<uint8_t>>* data);
+
+/**
+ * The JNIEnv of the calling thread, attaching it to the VM if it isn't yet. Threads we attach are detached when they exit
+ */
+JNIEnv* attach_current_thread(JavaVM* vm);
+
+#endif //MP3FY_CUSTOMIO_H
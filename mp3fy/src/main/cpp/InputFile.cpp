@@ -0,0 +1,269 @@
+#include "InputFile.h"
+#include "AsyncIo.h"
+#include "CodecLock.h"
+#include "CustomIo.h"
+
+#include <android/log.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// FFmpeg's own default is 32KB
+static const int DEFAULT_INPUT_BUFFER_SIZE = 256 * 1024;
+static const int MIN_INPUT_BUFFER_SIZE = 4096;
+
+// How many buffers ahead of the reader we ask the kernel to have in the page cache
+static const int READAHEAD_BUFFERS = 4;
+
+// Mapped inputs are copied straight from the mapping into the demuxer's buffers, this only serves its small reads
+static const int MAPPED_INPUT_BUFFER_SIZE = 32 * 1024;
+
+// Parts at the start and the end of a file that probing is likely to touch (headers, moov atoms, ID3v1/APE tags)
+static const size_t PROBE_HEAD_SIZE = 512 * 1024;
+static const size_t PROBE_TAIL_SIZE = 128 * 1024;
+
+// Keep mappings well within a 32 bit address space, bigger files are read with pread there
+static const int64_t MAX_MAPPED_SIZE_32BIT = 512 * 1024 * 1024;
+
+static std::atomic<int> input_buffer_size{DEFAULT_INPUT_BUFFER_SIZE};
+static std::atomic<int> input_backend{INPUT_BACKEND_BUFFERED};
+
+/**
+ * State behind the AVIOContext of an input opened with open_input
+ */
+struct FdReader : CustomIo {
+    int fd = -1;
+    bool owns_fd = false;
+    // Regular files are read with pread and can seek, anything else (pipes, sockets) is read in order
+    bool seekable = false;
+    int64_t position = 0;
+    int64_t size = -1;
+    // End of the range we last asked the kernel to read ahead
+    int64_t advised_until = 0;
+    int buffer_size = 0;
+    int64_t reads = 0;
+    // The whole file when it's read through a mapping, null otherwise
+    const uint8_t* map = nullptr;
+    // Reads ahead on the I/O threads with INPUT_BACKEND_ASYNC, null otherwise
+    std::unique_ptr<AsyncReader> async;
+
+    ~FdReader() override {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Input: %lld %s of up to %d bytes", (long long)reads,
+                            map ? "copies from the mapping" : "reads", buffer_size);
+        async.reset();
+        if (map) munmap(const_cast<uint8_t*>(map), (size_t)size);
+        if (owns_fd) close(fd);
+    }
+};
+
+static void advise_sequential(int fd) {
+#if !defined(__ANDROID_API__) || __ANDROID_API__ >= 21
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+/**
+ * Maps the whole file read only and tells the kernel which parts of it we are going to need.
+ * Meant for local files: truncating a file while it's mapped gets us a SIGBUS instead of a read error
+ */
+static const uint8_t* map_file(int fd, int64_t size, InputAccess access) {
+    if (size <= 0 || (sizeof(void*) < 8 && size > MAX_MAPPED_SIZE_32BIT)) return nullptr;
+
+    void* map = mmap(nullptr, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not map the input (%s), reading it instead", strerror(errno));
+        return nullptr;
+    }
+
+    auto* bytes = static_cast<uint8_t*>(map);
+    if (access == INPUT_ACCESS_SEQUENTIAL) {
+        madvise(map, (size_t)size, MADV_SEQUENTIAL);
+        madvise(map, std::min<size_t>((size_t)size, PROBE_HEAD_SIZE), MADV_WILLNEED);
+    } else {
+        madvise(map, (size_t)size, MADV_RANDOM);
+        madvise(map, std::min<size_t>((size_t)size, PROBE_HEAD_SIZE), MADV_WILLNEED);
+        if ((size_t)size > PROBE_HEAD_SIZE + PROBE_TAIL_SIZE) {
+            // madvise wants a page aligned start
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t tail = ((size_t)size - PROBE_TAIL_SIZE) / page * page;
+            madvise(bytes + tail, (size_t)size - tail, MADV_WILLNEED);
+        }
+    }
+    return bytes;
+}
+
+static void read_ahead(FdReader* reader) {
+    if (!reader->seekable || reader->map || reader->async || reader->position + (int64_t)reader->buffer_size * (READAHEAD_BUFFERS / 2) < reader->advised_until) {
+        return;
+    }
+
+    int64_t from = std::max(reader->position, reader->advised_until);
+    size_t count = (size_t)reader->buffer_size * READAHEAD_BUFFERS;
+    if (reader->size >= 0) {
+        if (from >= reader->size) return;
+        count = (size_t)std::min<int64_t>(count, reader->size - from);
+    }
+    readahead(reader->fd, from, count);
+    reader->advised_until = from + count;
+}
+
+static int read_packet(void* opaque, uint8_t* buffer, int size) {
+    auto* reader = static_cast<FdReader*>(opaque);
+
+    if (reader->map) {
+        if (reader->position >= reader->size) return AVERROR_EOF;
+        int count = (int)std::min<int64_t>(size, reader->size - reader->position);
+        memcpy(buffer, reader->map + reader->position, count);
+        reader->position += count;
+        reader->reads++;
+        return count;
+    }
+
+    if (reader->async) {
+        int count = reader->async->read(buffer, size, reader->position);
+        reader->reads++;
+        if (count > 0) reader->position += count;
+        return count;
+    }
+
+    ssize_t count;
+    do {
+        count = reader->seekable ? pread64(reader->fd, buffer, size, reader->position) : read(reader->fd, buffer, size);
+    } while (count < 0 && errno == EINTR);
+    reader->reads++;
+
+    if (count < 0) return AVERROR(errno);
+    if (count == 0) return AVERROR_EOF;
+
+    reader->position += count;
+    read_ahead(reader);
+    return (int)count;
+}
+
+static int64_t seek(void* opaque, int64_t offset, int whence) {
+    auto* reader = static_cast<FdReader*>(opaque);
+    whence &= ~AVSEEK_FORCE;
+
+    if (whence == AVSEEK_SIZE) return reader->size >= 0 ? reader->size : AVERROR(ENOSYS);
+    if (!reader->seekable) return AVERROR(ESPIPE);
+
+    int64_t position;
+    switch (whence) {
+        case SEEK_SET:
+            position = offset;
+            break;
+        case SEEK_CUR:
+            position = reader->position + offset;
+            break;
+        case SEEK_END:
+            if (reader->size < 0) return AVERROR(ENOSYS);
+            position = reader->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (position < 0) return AVERROR(EINVAL);
+
+    // Whatever was read ahead for the old position is of no use here
+    if (position < reader->position || position > reader->advised_until) reader->advised_until = position;
+    reader->position = position;
+    return position;
+}
+
+static AVIOContext* create_io_context(int fd, bool owns_fd, InputAccess access) {
+    struct stat info;
+    if (fstat(fd, &info) < 0) return nullptr;
+
+    auto* reader = new FdReader;
+    reader->fd = fd;
+    reader->owns_fd = owns_fd;
+    reader->seekable = S_ISREG(info.st_mode);
+    reader->size = reader->seekable ? (int64_t)info.st_size : -1;
+    if (reader->seekable && input_backend.load() == INPUT_BACKEND_MMAP) {
+        reader->map = map_file(fd, reader->size, access);
+    }
+    reader->buffer_size = reader->map ? MAPPED_INPUT_BUFFER_SIZE : std::max(MIN_INPUT_BUFFER_SIZE, input_buffer_size.load());
+    // Probing jumps around too much for reading ahead to pay off
+    if (reader->seekable && access == INPUT_ACCESS_SEQUENTIAL && input_backend.load() == INPUT_BACKEND_ASYNC) {
+        reader->async.reset(new AsyncReader(fd, reader->size, reader->buffer_size, READAHEAD_BUFFERS));
+    }
+
+    // The caller closes the descriptor when this fails
+    reader->owns_fd = false;
+    AVIOContext* io_context = alloc_custom_io(reader, reader->buffer_size, false, read_packet, nullptr, seek);
+    if (!io_context) return nullptr;
+    reader->owns_fd = owns_fd;
+    io_context->seekable = reader->seekable ? AVIO_SEEKABLE_NORMAL : 0;
+
+    if (reader->map) {
+        // Large reads skip the buffer and get copied from the mapping in one go, and seeks only move our position
+        io_context->direct = 1;
+    } else if (reader->seekable && access == INPUT_ACCESS_SEQUENTIAL && !reader->async) {
+        advise_sequential(fd);
+        read_ahead(reader);
+    }
+    return io_context;
+}
+
+int open_input(AVFormatContext** context, const char* url, int fd, InputAccess access, AVDictionary** options) {
+    bool owns_fd = false;
+    if (fd < 0) {
+        fd = url ? open(url, O_RDONLY | O_CLOEXEC) : -1;
+        if (fd < 0) {
+            // Not a local file, or not one we may open. FFmpeg knows more protocols than we do
+            return avformat_open_input(context, url, nullptr, options);
+        }
+        owns_fd = true;
+    }
+
+    AVIOContext* io_context = create_io_context(fd, owns_fd, access);
+    if (!io_context) {
+        if (owns_fd) close(fd);
+        return AVERROR(ENOMEM);
+    }
+
+    return open_input_io(context, io_context, url, options);
+}
+
+int open_input_io(AVFormatContext** context, AVIOContext* io_context, const char* name, AVDictionary** options) {
+    AVFormatContext* format_context = avformat_alloc_context();
+    if (!format_context) {
+        free_custom_io(&io_context);
+        return AVERROR(ENOMEM);
+    }
+    format_context->pb = io_context;
+    format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // Frees the format context on failure, but never a custom AVIOContext
+    int ret = avformat_open_input(&format_context, name ? name : "", nullptr, options);
+    if (ret < 0) {
+        free_custom_io(&io_context);
+        return ret;
+    }
+
+    *context = format_context;
+    return 0;
+}
+
+void close_input(AVFormatContext** context) {
+    if (!*context) return;
+
+    AVIOContext* io_context = ((*context)->flags & AVFMT_FLAG_CUSTOM_IO) ? (*context)->pb : nullptr;
+    close_format_input(context);
+    free_custom_io(&io_context);
+}
+
+void set_input_buffer_size(int bytes) {
+    input_buffer_size = std::max(MIN_INPUT_BUFFER_SIZE, bytes);
+}
+
+void set_input_backend(int backend) {
+    input_backend = backend == INPUT_BACKEND_MMAP || backend == INPUT_BACKEND_ASYNC ? backend : INPUT_BACKEND_BUFFERED;
+}
@@ -0,0 +1,65 @@
+#ifndef MP3FY_INPUTFILE_H
+#define MP3FY_INPUTFILE_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// How local files are read, these have to match the INPUT_BACKEND_* constants in MP3fy.java
+enum InputBackend {
+    // pread into a large buffer with kernel read-ahead
+    INPUT_BACKEND_BUFFERED = 0,
+    // Served straight from a read-only mapping of the whole file, so seeking costs no syscall at all
+    INPUT_BACKEND_MMAP = 1,
+    // Read ahead in blocks by the I/O threads shared by every open file, see AsyncReader
+    INPUT_BACKEND_ASYNC = 2,
+};
+
+// How the input is going to be read, this decides which hints the kernel gets
+enum InputAccess {
+    // Start to end, like a conversion
+    INPUT_ACCESS_SEQUENTIAL,
+    // A few jumps around the header (and the end) of the file, like reading metadata
+    INPUT_ACCESS_PROBE,
+};
+
+/**
+ * Opens an input for demuxing, reading it through a file descriptor with our own AVIOContext instead of FFmpeg's
+ * file protocol: either positional reads into a large buffer, with the kernel told to read ahead of us, or a memory
+ * mapping of the file (see set_input_backend).
+ * Inputs that can't be opened as a local file (other protocols) go through FFmpeg as before.
+ * @param url Path of the input, opened when fd is -1. Also helps probing the format, so pass it when you have it
+ * @param fd Already open descriptor to read the input from, or -1. It stays open, the caller closes it once the
+ * context is closed. Since reads are positional, the same descriptor can back several contexts at once
+ * @param options Demuxer options (probesize...), as for avformat_open_input
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int open_input(AVFormatContext** context, const char* url, int fd, InputAccess access = INPUT_ACCESS_SEQUENTIAL,
+               AVDictionary** options = nullptr);
+
+/**
+ * Opens an input for demuxing from one of our own AVIOContexts (see CustomIo.h), memory or a Java stream
+ * @param io_context Taken over, it is freed along with the context, or right away on failure
+ * @param name Helps probing the format (by its extension), may be null
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int open_input_io(AVFormatContext** context, AVIOContext* io_context, const char* name, AVDictionary** options = nullptr);
+
+/**
+ * Closes a context opened with open_input or open_input_io, along with its AVIOContext and descriptor if we opened it
+ */
+void close_input(AVFormatContext** context);
+
+/**
+ * Sets the read buffer size for inputs opened from now on. Bigger buffers mean fewer read syscalls, which matters a
+ * lot on slow storage (SD cards, FUSE), at the cost of memory per open input
+ */
+void set_input_buffer_size(int bytes);
+
+/**
+ * Sets the InputBackend for inputs opened from now on. Files that can't be mapped (pipes, or too big for the address
+ * space) are read with the buffered backend whatever this says
+ */
+void set_input_backend(int backend);
+
+#endif //MP3FY_INPUTFILE_H
@@ -0,0 +1,450 @@
+#include "MetadataCache.h"
+
+#include <android/log.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+/*
+ * The cache file is a header followed by records, appended as files get probed. A file probed again gets a new
+ * record, the old one stays in the file until it's compacted. Loading it means mapping it and walking the records
+ * once to know where the latest record of every path is, nothing gets parsed until it's looked up.
+ */
+
+static const char CACHE_MAGIC[8] = {'M', 'P', '3', 'F', 'Y', 'M', 'C', 'C'};
+// Bump it whenever the layout of the records changes, caches of other versions are dropped
+static const uint32_t CACHE_VERSION = 2;
+
+// Compacted when it's opened if superseded records take more space than this, and than the live ones
+static const int64_t AUTO_COMPACT_STALE_BYTES = 256 * 1024;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+// Every record starts with this, followed by the path and then the tags, keys and values one after the other. Each
+// string is stored as its uint32_t size followed by its bytes
+struct RecordHeader {
+    // Of the whole record, a multiple of 8
+    uint32_t size;
+    // Of everything after it, so a record torn by a crash while it was appended is recognized
+    uint32_t checksum;
+    uint64_t device;
+    uint64_t inode;
+    int64_t file_size;
+    int64_t modified;
+    int64_t duration;
+    int64_t bit_rate;
+    uint64_t album_art_hash;
+    int32_t probe_level;
+    int32_t audio_stream;
+    int32_t codec_id;
+    int32_t sample_rate;
+    int32_t channels;
+    int32_t album_art_stream;
+    int32_t album_art_size;
+    int32_t reserved;
+    uint32_t tag_count;
+    uint32_t path_size;
+};
+
+struct RecordLocation {
+    int64_t offset;
+    uint32_t size;
+};
+
+struct MetadataCacheFile {
+    std::string path;
+    int fd = -1;
+    // The file as it was when it was opened. Records appended since are read with pread
+    uint8_t* mapping = nullptr;
+    size_t mapped_size = 0;
+    // Where the next record goes
+    int64_t end = 0;
+    // Latest record of every path
+    std::unordered_map<std::string, RecordLocation> index;
+    int64_t live_bytes = 0;
+};
+
+static std::mutex cache_mutex;
+static MetadataCacheFile cache;
+
+// The path size is read as the first string of the record, right after the fixed fields
+static_assert(sizeof(RecordHeader) % 8 == 0 && offsetof(RecordHeader, path_size) == sizeof(RecordHeader) - sizeof(uint32_t),
+              "RecordHeader must not be padded");
+
+static uint32_t checksum(const uint8_t* data, size_t size) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool read_string(const uint8_t* data, size_t size, size_t* position, std::string* string) {
+    uint32_t length;
+    if (size - *position < sizeof(length)) return false;
+    memcpy(&length, data + *position, sizeof(length));
+    *position += sizeof(length);
+    if (size - *position < length) return false;
+    if (string) string->assign(reinterpret_cast<const char*>(data + *position), length);
+    *position += length;
+    return true;
+}
+
+static void write_string(std::vector<uint8_t>* data, const std::string& string) {
+    auto length = (uint32_t)string.size();
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&length);
+    data->insert(data->end(), bytes, bytes + sizeof(length));
+    data->insert(data->end(), string.begin(), string.end());
+}
+
+/**
+ * Checks the record at data and reads its header and path
+ * @param size Bytes available at data, the record may be shorter
+ */
+static bool parse_record(const uint8_t* data, size_t size, RecordHeader* header, std::string* path) {
+    if (size < sizeof(RecordHeader)) return false;
+    memcpy(header, data, sizeof(RecordHeader));
+    if (header->size < sizeof(RecordHeader) || header->size % 8 != 0 || header->size > size) return false;
+
+    size_t checked = sizeof(header->size) + sizeof(header->checksum);
+    if (checksum(data + checked, header->size - checked) != header->checksum) return false;
+
+    size_t position = sizeof(RecordHeader) - sizeof(header->path_size);
+    return read_string(data, header->size, &position, path);
+}
+
+static bool parse_tags(const uint8_t* data, const RecordHeader& header, CachedMetadata* metadata) {
+    size_t position = sizeof(RecordHeader) - sizeof(header.path_size);
+    if (!read_string(data, header.size, &position, nullptr)) return false;
+
+    metadata->tags.clear();
+    for (uint32_t i = 0; i < header.tag_count; i++) {
+        std::string key, value;
+        if (!read_string(data, header.size, &position, &key) || !read_string(data, header.size, &position, &value)) {
+            return false;
+        }
+        metadata->tags.emplace_back(std::move(key), std::move(value));
+    }
+    return true;
+}
+
+/**
+ * @return the record, from the mapping if it's in there, read into buffer otherwise
+ */
+static const uint8_t* read_record(const RecordLocation& location, std::vector<uint8_t>* buffer) {
+    if (location.offset + location.size <= (int64_t)cache.mapped_size) return cache.mapping + location.offset;
+
+    buffer->resize(location.size);
+    for (size_t done = 0; done < location.size;) {
+        ssize_t count = pread64(cache.fd, buffer->data() + done, location.size - done, location.offset + done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return nullptr;
+        done += count;
+    }
+    return buffer->data();
+}
+
+static bool write_fully(int fd, const void* data, size_t size, int64_t offset) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    for (size_t done = 0; done < size;) {
+        ssize_t count = pwrite64(fd, bytes + done, size - done, offset + done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return false;
+        done += count;
+    }
+    return true;
+}
+
+static bool write_cache_header(int fd) {
+    CacheHeader header = {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    return ftruncate64(fd, 0) == 0 && write_fully(fd, &header, sizeof(header), 0);
+}
+
+static void unmap_cache() {
+    if (cache.mapping) munmap(cache.mapping, cache.mapped_size);
+    cache.mapping = nullptr;
+    cache.mapped_size = 0;
+}
+
+static void close_cache() {
+    unmap_cache();
+    if (cache.fd >= 0) close(cache.fd);
+    cache = MetadataCacheFile();
+}
+
+/**
+ * Maps the cache file and indexes its records. A torn record at the end (from a crash) is cut off, along with
+ * whatever follows it
+ */
+static bool load_cache(const std::string& path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+
+    struct stat info;
+    CacheHeader header;
+    bool valid = fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(header) &&
+                 pread64(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 && header.version == CACHE_VERSION;
+    if (!valid) {
+        if (!write_cache_header(fd)) {
+            close(fd);
+            return false;
+        }
+        info.st_size = sizeof(header);
+    }
+
+    cache.path = path;
+    cache.fd = fd;
+    cache.end = sizeof(header);
+    if (info.st_size > (off_t)sizeof(header)) {
+        void* mapping = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+            cache.mapping = static_cast<uint8_t*>(mapping);
+            cache.mapped_size = (size_t)info.st_size;
+        }
+    }
+
+    RecordHeader record;
+    std::string record_path;
+    while (cache.end < (int64_t)cache.mapped_size &&
+           parse_record(cache.mapping + cache.end, cache.mapped_size - cache.end, &record, &record_path)) {
+        auto existing = cache.index.find(record_path);
+        if (existing != cache.index.end()) cache.live_bytes -= existing->second.size;
+        cache.index[record_path] = {cache.end, record.size};
+        cache.live_bytes += record.size;
+        cache.end += record.size;
+    }
+
+    if (cache.end < info.st_size) {
+        // Appends go right after the last good record. The mapping must not reach past the end of the file
+        unmap_cache();
+        if (ftruncate64(fd, cache.end) < 0) {
+            close_cache();
+            return false;
+        }
+        void* mapping = mmap(nullptr, (size_t)cache.end, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+            cache.mapping = static_cast<uint8_t*>(mapping);
+            cache.mapped_size = (size_t)cache.end;
+        }
+    }
+    return true;
+}
+
+static bool get_file_key(const char* path, CachedFileKey* key) {
+    struct stat info;
+    if (stat(path, &info) < 0) return false;
+
+    key->device = info.st_dev;
+    key->inode = info.st_ino;
+    key->size = info.st_size;
+    key->modified = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+static bool matches(const RecordHeader& record, const CachedFileKey& key) {
+    return record.device == key.device && record.inode == key.inode && record.file_size == key.size &&
+           record.modified == key.modified;
+}
+
+// Records of dropped files have an empty key, which no file matches
+static bool is_dropped(const RecordHeader& record) {
+    return record.inode == 0 && record.file_size == 0 && record.modified == 0;
+}
+
+static int compact_cache(bool drop_missing) {
+    std::string temp_path = cache.path + ".XXXXXX";
+    int fd = mkstemp(&temp_path[0]);
+    if (fd < 0) return -1;
+
+    bool written = write_cache_header(fd);
+    int64_t end = sizeof(CacheHeader);
+    int entries = 0;
+    std::vector<uint8_t> buffer;
+    for (const auto& entry : cache.index) {
+        if (!written) break;
+        const uint8_t* data = read_record(entry.second, &buffer);
+        if (!data) continue;
+
+        RecordHeader record;
+        memcpy(&record, data, sizeof(record));
+        if (is_dropped(record)) continue;
+        if (drop_missing) {
+            CachedFileKey key;
+            if (!get_file_key(entry.first.c_str(), &key) || !matches(record, key)) continue;
+        }
+        written = write_fully(fd, data, entry.second.size, end);
+        end += entry.second.size;
+        entries++;
+    }
+    close(fd);
+
+    if (!written || rename(temp_path.c_str(), cache.path.c_str()) < 0) {
+        unlink(temp_path.c_str());
+        return -1;
+    }
+
+    std::string path = cache.path;
+    close_cache();
+    return load_cache(path) ? entries : -1;
+}
+
+bool open_metadata_cache(const char* path) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    close_cache();
+    if (!path || !*path) return true;
+
+    auto started = std::chrono::steady_clock::now();
+    if (!load_cache(path)) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Not able to open the metadata cache at %s", path);
+        return false;
+    }
+
+    int64_t stale_bytes = cache.end - (int64_t)sizeof(CacheHeader) - cache.live_bytes;
+    if (stale_bytes > AUTO_COMPACT_STALE_BYTES && stale_bytes > cache.live_bytes) compact_cache(false);
+
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Metadata cache: %zu entries, %lld bytes, opened in %lld ms",
+                        cache.index.size(), (long long)cache.end,
+                        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count());
+    return cache.fd >= 0;
+}
+
+bool find_cached_metadata(const char* path, int probe_level, CachedMetadata* metadata, CachedFileKey* key) {
+    *key = CachedFileKey();
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cache.fd < 0) return false;
+    }
+    if (!get_file_key(path, key)) return false;
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto entry = cache.index.find(path);
+    if (entry == cache.index.end()) return false;
+
+    std::vector<uint8_t> buffer;
+    const uint8_t* data = read_record(entry->second, &buffer);
+    if (!data) return false;
+
+    RecordHeader record;
+    memcpy(&record, data, sizeof(record));
+    if (!matches(record, *key) || record.probe_level < probe_level) return false;
+
+    metadata->probe_level = record.probe_level;
+    metadata->duration = record.duration;
+    metadata->bit_rate = record.bit_rate;
+    metadata->audio_stream = record.audio_stream;
+    metadata->codec_id = record.codec_id;
+    metadata->sample_rate = record.sample_rate;
+    metadata->channels = record.channels;
+    metadata->album_art_stream = record.album_art_stream;
+    metadata->album_art_size = record.album_art_size;
+    metadata->album_art_hash = record.album_art_hash;
+    return parse_tags(data, record, metadata);
+}
+
+/**
+ * Appends a record for path, which becomes its latest one. record is completed with its size and checksum
+ */
+static void append_record(const char* path, RecordHeader* record, const std::vector<std::pair<std::string, std::string>>& tags) {
+    record->tag_count = (uint32_t)tags.size();
+
+    std::vector<uint8_t> data(sizeof(RecordHeader) - sizeof(record->path_size));
+    write_string(&data, path);
+    for (const auto& tag : tags) {
+        write_string(&data, tag.first);
+        write_string(&data, tag.second);
+    }
+    data.resize((data.size() + 7) / 8 * 8);
+    record->size = (uint32_t)data.size();
+    memcpy(data.data(), record, sizeof(RecordHeader) - sizeof(record->path_size));
+    size_t checked = sizeof(record->size) + sizeof(record->checksum);
+    record->checksum = checksum(data.data() + checked, data.size() - checked);
+    memcpy(data.data() + sizeof(record->size), &record->checksum, sizeof(record->checksum));
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache.fd < 0) return;
+    if (!write_fully(cache.fd, data.data(), data.size(), cache.end)) {
+        // Whatever made it to the file fails its checksum, and gets overwritten by the next record
+        return;
+    }
+
+    auto existing = cache.index.find(path);
+    if (existing != cache.index.end()) cache.live_bytes -= existing->second.size;
+    cache.index[path] = {cache.end, record->size};
+    cache.live_bytes += record->size;
+    cache.end += record->size;
+}
+
+void store_cached_metadata(const char* path, const CachedFileKey& key, const CachedMetadata& metadata) {
+    // No key, the file couldn't be stat'ed before the probe
+    if (key.inode == 0 && key.size == 0 && key.modified == 0) return;
+
+    RecordHeader record = {};
+    record.device = key.device;
+    record.inode = key.inode;
+    record.file_size = key.size;
+    record.modified = key.modified;
+    record.duration = metadata.duration;
+    record.bit_rate = metadata.bit_rate;
+    record.probe_level = metadata.probe_level;
+    record.audio_stream = metadata.audio_stream;
+    record.codec_id = metadata.codec_id;
+    record.sample_rate = metadata.sample_rate;
+    record.channels = metadata.channels;
+    record.album_art_stream = metadata.album_art_stream;
+    record.album_art_size = metadata.album_art_size;
+    record.album_art_hash = metadata.album_art_hash;
+    append_record(path, &record, metadata.tags);
+}
+
+void drop_cached_metadata(const char* path) {
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cache.fd < 0 || cache.index.find(path) == cache.index.end()) return;
+    }
+    // Only taking it out of the index would bring the old record back the next time the cache is loaded
+    RecordHeader record = {};
+    append_record(path, &record, {});
+}
+
+int compact_metadata_cache(bool drop_missing) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache.fd < 0) return -1;
+
+    auto started = std::chrono::steady_clock::now();
+    int entries = compact_cache(drop_missing);
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Metadata cache compacted to %d entries, %lld bytes in %lld ms",
+                        entries, (long long)cache.end,
+                        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count());
+    return entries;
+}
+
+void clear_metadata_cache() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache.fd < 0) return;
+
+    unmap_cache();
+    if (!write_cache_header(cache.fd)) {
+        close_cache();
+        return;
+    }
+    cache.index.clear();
+    cache.live_bytes = 0;
+    cache.end = sizeof(CacheHeader);
+}
@@ -0,0 +1,79 @@
+#ifndef MP3FY_METADATACACHE_H
+#define MP3FY_METADATACACHE_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * What a probe found out about a file, as kept in the metadata cache
+ */
+struct CachedMetadata {
+    // ProbeLevel the file was probed at, the entry only answers probes up to this level
+    int probe_level = 0;
+    int64_t duration = 0;
+    int64_t bit_rate = 0;
+    // Index of the audio stream, -1 if the file has none
+    int audio_stream = -1;
+    int codec_id = 0;
+    int sample_rate = 0;
+    int channels = 0;
+    // Where the album art is in the file, -1 if there's none
+    int album_art_stream = -1;
+    int album_art_size = 0;
+    // Of the album art bytes (see hash_album_art), 0 if there's none
+    uint64_t album_art_hash = 0;
+    std::vector<std::pair<std::string, std::string>> tags;
+};
+
+/**
+ * Identifies one version of a file: if any of these changed, the file did too
+ */
+struct CachedFileKey {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    int64_t size = 0;
+    // Nanoseconds
+    int64_t modified = 0;
+};
+
+/**
+ * Opens (or creates) the cache file at path and maps it, replacing the cache that was open. Null closes it.
+ * The cache only ever belongs to one process at a time
+ * @return false if it couldn't be opened, there's no cache then
+ */
+bool open_metadata_cache(const char* path);
+
+/**
+ * Looks path up. The entry is only good if the file still has the same key, which costs a stat
+ * @param key Filled in with the current key of the file, to store the probe under on a miss
+ * @return false on a miss, if there's no cache, or if the file can't be stat'ed (key is left empty then)
+ */
+bool find_cached_metadata(const char* path, int probe_level, CachedMetadata* metadata, CachedFileKey* key);
+
+/**
+ * Stores what a probe found out about path. Take the key before probing, so a file that changes during the probe
+ * is probed again next time
+ */
+void store_cached_metadata(const char* path, const CachedFileKey& key, const CachedMetadata& metadata);
+
+/**
+ * Forgets path, for when the file was changed in a way its key might not show: an in-place edit keeps the inode and
+ * the size, and the modification time of some file systems (vfat) only has a 2 second granularity
+ */
+void drop_cached_metadata(const char* path);
+
+/**
+ * Rewrites the cache file with one entry per file, dropping the ones superseded since
+ * @param drop_missing Also drops the entries of files that changed or don't exist anymore, which costs a stat each
+ * @return how many entries are left, -1 on error (or if there's no cache)
+ */
+int compact_metadata_cache(bool drop_missing);
+
+/**
+ * Drops every entry
+ */
+void clear_metadata_cache();
+
+#endif //MP3FY_METADATACACHE_H
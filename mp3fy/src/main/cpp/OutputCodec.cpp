@@ -0,0 +1,26 @@
+#include "OutputCodec.h"
+
+#include <cstring>
+#include <strings.h>
+
+// The bundled FFmpeg is built with libmp3lame and the mp3 muxer only, a codec needs both its encoder and its muxer
+// in the prebuilts before it can get a row here. MP3 levels are the LAME -q setting (lower is slower)
+static const OutputCodec OUTPUT_CODECS[] = {
+        {"mp3", "mp3", AV_CODEC_ID_MP3, "libmp3lame", 0, {2, 5, 7}, true},
+};
+
+const OutputCodec* find_output_codec(const char* url, bool* matched) {
+    const char* extension = strrchr(url, '.');
+    if (extension) {
+        extension++;
+        for (const OutputCodec& codec : OUTPUT_CODECS) {
+            if (strcasecmp(codec.extension, extension) == 0) {
+                if (matched) *matched = true;
+                return &codec;
+            }
+        }
+    }
+
+    if (matched) *matched = false;
+    return &OUTPUT_CODECS[0];
+}
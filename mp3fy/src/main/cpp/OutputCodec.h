@@ -0,0 +1,34 @@
+#ifndef MP3FY_OUTPUTCODEC_H
+#define MP3FY_OUTPUTCODEC_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/**
+ * How audio gets encoded for one kind of output file. The output file extension picks the entry.
+ */
+struct OutputCodec {
+    // Output file extension, without the dot
+    const char* extension;
+    // Muxer to use for it
+    const char* format_name;
+    AVCodecID codec_id;
+    // Preferred encoder implementation, the default encoder for codec_id is used when it's null or not built in
+    const char* encoder_name;
+    // Bitrate when the profile doesn't set one, 0 leaves it to the encoder
+    int default_bitrate;
+    // Compression level for the best, standard and fast speed tiers, -1 if the encoder has no such setting
+    int speed_levels[3];
+    // Whether the encoded frames of independent encoders can be joined (see the segmented conversion)
+    bool can_segment;
+};
+
+/**
+ * Looks the output codec up from the extension of url. Unknown extensions get MP3 in whatever container FFmpeg
+ * guesses from the file name, which is what every output used to get.
+ * @param matched Set to whether the extension was found in the table, can be null
+ */
+const OutputCodec* find_output_codec(const char* url, bool* matched);
+
+#endif //MP3FY_OUTPUTCODEC_H
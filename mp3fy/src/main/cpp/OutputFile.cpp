@@ -0,0 +1,363 @@
+#include "OutputFile.h"
+#include "AsyncIo.h"
+#include "CustomIo.h"
+
+#include <android/log.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <memory>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
+
+// FFmpeg's file protocol writes 32KB at a time, which is a lot of syscalls for a long file
+static const int DEFAULT_OUTPUT_BUFFER_SIZE = 256 * 1024;
+static const int MIN_OUTPUT_BUFFER_SIZE = 4096;
+
+// Writes one output may have pending on the I/O threads
+static const int WRITE_BEHIND_BUFFERS = 8;
+
+// Ranges the kernel can't copy go through memory this many bytes at a time
+static const int COPY_BUFFER_SIZE = 1024 * 1024;
+
+// sendfile copies at most this much per call
+static const int64_t MAX_SENDFILE_SIZE = 0x7FFFF000;
+
+static std::atomic<int> output_backend{OUTPUT_BACKEND_BUFFERED};
+static std::atomic<int> output_buffer_size{DEFAULT_OUTPUT_BUFFER_SIZE};
+static std::atomic<int64_t> output_sync_interval{OUTPUT_SYNC_NEVER};
+
+/**
+ * State behind the AVIOContext of an output opened with open_output_io
+ */
+struct FdWriter : CustomIo {
+    int fd = -1;
+    // Written into temp_path, which replaces path once the output is complete
+    std::string path;
+    std::string temp_path;
+    bool finished = false;
+    int64_t position = 0;
+    // Furthest anything was written
+    int64_t size = 0;
+    int64_t preallocated = 0;
+    int64_t writes = 0;
+    // See set_output_sync_interval
+    int64_t sync_interval = OUTPUT_SYNC_NEVER;
+    int64_t synced_size = 0;
+    int syncs = 0;
+    std::chrono::steady_clock::duration sync_time{0};
+    std::unique_ptr<AsyncWriter> async;
+
+    /**
+     * Gets everything written so far to the disk
+     */
+    int sync() {
+        int ret = async ? async->finish() : 0;
+        if (ret < 0) return ret;
+
+        auto started = std::chrono::steady_clock::now();
+        ret = fdatasync(fd) < 0 ? AVERROR(errno) : 0;
+        sync_time += std::chrono::steady_clock::now() - started;
+        syncs++;
+        synced_size = size;
+        return ret;
+    }
+
+    int finish(bool discard) override {
+        finished = true;
+        int ret = async ? async->finish() : 0;
+        if (discard || ret < 0) {
+            // Whatever was at the path before stays there
+            unlink(temp_path.c_str());
+            return ret;
+        }
+
+        // The estimate was too big, give back what wasn't used
+        if (preallocated > size && ftruncate64(fd, size) < 0) ret = AVERROR(errno);
+        if (ret == 0 && sync_interval >= 0) ret = sync();
+        if (ret == 0 && rename(temp_path.c_str(), path.c_str()) < 0) ret = AVERROR(errno);
+        if (ret < 0) {
+            unlink(temp_path.c_str());
+            return ret;
+        }
+
+        if (sync_interval >= 0) {
+            // The rename itself is only durable once the directory is
+            size_t slash = path.rfind('/');
+            std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+            int directory_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (directory_fd >= 0) {
+                fsync(directory_fd);
+                close(directory_fd);
+            }
+        }
+        return 0;
+    }
+
+    ~FdWriter() override {
+        async.reset();
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Output: %lld writes, %lld bytes (%lld preallocated), %d syncs in %lld ms",
+                            (long long)writes, (long long)size, (long long)preallocated, syncs,
+                            (long long)std::chrono::duration_cast<std::chrono::milliseconds>(sync_time).count());
+        close(fd);
+        if (!finished) unlink(temp_path.c_str());
+    }
+};
+
+static int write_packet(void* opaque, uint8_t* buffer, int size) {
+    auto* writer = static_cast<FdWriter*>(opaque);
+    writer->writes++;
+
+    int ret = 0;
+    if (writer->async) {
+        ret = writer->async->write(buffer, size, writer->position);
+    } else {
+        for (int written = 0; written < size;) {
+            ssize_t count = pwrite64(writer->fd, buffer + written, size - written, writer->position + written);
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0) {
+                ret = AVERROR(errno);
+                break;
+            }
+            written += (int)count;
+        }
+    }
+    if (ret < 0) return ret;
+
+    writer->position += size;
+    writer->size = std::max(writer->size, writer->position);
+    if (writer->sync_interval > 0 && writer->size - writer->synced_size >= writer->sync_interval) {
+        ret = writer->sync();
+        if (ret < 0) return ret;
+    }
+    return size;
+}
+
+static int64_t seek(void* opaque, int64_t offset, int whence) {
+    auto* writer = static_cast<FdWriter*>(opaque);
+    int64_t position = resolve_seek(writer->position, writer->size, offset, whence);
+    if (position >= 0 && !(whence & AVSEEK_SIZE)) writer->position = position;
+    return position;
+}
+
+/**
+ * Reserves the blocks of the whole output at once, so the file system can lay it out in a few extents instead of
+ * growing it write by write. Not every file system supports it (FAT on SD cards doesn't), that's fine
+ */
+static int64_t preallocate(int fd, int64_t size) {
+#if !defined(__ANDROID_API__) || __ANDROID_API__ >= 21
+    if (size > 0 && fallocate64(fd, 0, 0, size) == 0) return size;
+#elif defined(__NR_fallocate)
+    // No fallocate64 before API 21, which only leaves the 32-bit ABIs: the syscall takes the 64-bit offset and length
+    // as low and high halves there
+    if (size > 0 && syscall(__NR_fallocate, fd, 0, 0, 0, (uint32_t)size, (uint32_t)(size >> 32)) == 0) return size;
+#endif
+    return 0;
+}
+
+AVIOContext* open_output_io(const char* path, int64_t expected_size) {
+    std::string temp_path = std::string(path) + ".XXXXXX";
+    int fd = mkstemp(&temp_path[0]);
+    if (fd < 0) return nullptr;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    // mkstemp makes it private to us
+    fchmod(fd, 0644);
+
+    auto* writer = new FdWriter;
+    writer->fd = fd;
+    writer->path = path;
+    writer->temp_path = temp_path;
+    writer->sync_interval = output_sync_interval.load();
+    writer->preallocated = preallocate(fd, expected_size);
+    if (output_backend.load() == OUTPUT_BACKEND_ASYNC) {
+        writer->async.reset(new AsyncWriter(fd, WRITE_BEHIND_BUFFERS));
+    }
+    return alloc_custom_io(writer, output_buffer_size.load(), true, nullptr, write_packet, seek);
+}
+
+/**
+ * Muxers that read their output back (MP4 with faststart) reopen it by its url. Until it's complete, it's in the
+ * temp file, and some of it might still be on its way there
+ */
+static int open_for_muxer(AVFormatContext* context, AVIOContext** io_context, const char* url, int flags, AVDictionary** options) {
+    auto* writer = static_cast<FdWriter*>(context->pb->opaque);
+    if (url && context->url && strcmp(url, context->url) == 0 && !(flags & AVIO_FLAG_WRITE)) {
+        if (writer->async) writer->async->finish();
+        url = writer->temp_path.c_str();
+    }
+    return avio_open2(io_context, url, flags, &context->interrupt_callback, options);
+}
+
+void attach_output_io(AVFormatContext* context, AVIOContext* io_context) {
+    context->pb = io_context;
+    context->flags |= AVFMT_FLAG_CUSTOM_IO;
+    context->io_open = open_for_muxer;
+}
+
+void set_output_backend(int backend) {
+    output_backend = backend == OUTPUT_BACKEND_ASYNC ? OUTPUT_BACKEND_ASYNC : OUTPUT_BACKEND_BUFFERED;
+}
+
+void set_output_buffer_size(int bytes) {
+    output_buffer_size = std::max(MIN_OUTPUT_BUFFER_SIZE, bytes);
+}
+
+void set_output_sync_interval(int64_t bytes) {
+    output_sync_interval = std::max<int64_t>(OUTPUT_SYNC_NEVER, bytes);
+}
+
+/**
+ * Before Android 14 the seccomp filter of apps doesn't allow copy_file_range, and a syscall it doesn't allow kills the
+ * process rather than failing
+ */
+static bool can_copy_file_range() {
+#ifdef __ANDROID__
+    static const bool allowed = [] {
+        char sdk[PROP_VALUE_MAX] = {};
+        __system_property_get("ro.build.version.sdk", sdk);
+        return atoi(sdk) >= 34;
+    }();
+    return allowed;
+#else
+    return true;
+#endif
+}
+
+/**
+ * Shares the blocks of the range between the files instead of copying them, on file systems with reflinks (btrfs,
+ * XFS, f2fs...). Both offsets and the size have to be whole blocks
+ * @return whether it was cloned
+ */
+static bool clone_range(int in_fd, int64_t in_offset, int out_fd, int64_t out_offset, int64_t size) {
+#ifdef FICLONERANGE
+    file_clone_range range = {};
+    range.src_fd = in_fd;
+    range.src_offset = (uint64_t)in_offset;
+    range.src_length = (uint64_t)size;
+    range.dest_offset = (uint64_t)out_offset;
+    return ioctl(out_fd, FICLONERANGE, &range) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * sendfile64, which bionic only has from API 21 on. The 32-bit ABIs below that still have the syscall
+ */
+static ssize_t sendfile_from(int out_fd, int in_fd, off64_t* in_offset, size_t count) {
+#if !defined(__ANDROID_API__) || __ANDROID_API__ >= 21
+    return sendfile64(out_fd, in_fd, in_offset, count);
+#elif defined(__NR_sendfile64)
+    return syscall(__NR_sendfile64, out_fd, in_fd, in_offset, count);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Copies a range between the files without it going through our memory: copy_file_range, or sendfile where that's not
+ * available. Either can stop short (other file systems, old kernels), the rest is up to the caller
+ * @return how many bytes from the start of the range were copied
+ */
+static int64_t copy_in_kernel(int in_fd, int64_t in_offset, int out_fd, int64_t out_offset, int64_t size) {
+    int64_t done = 0;
+#ifdef __NR_copy_file_range
+    while (done < size && can_copy_file_range()) {
+        loff_t in_position = in_offset + done, out_position = out_offset + done;
+        long count = syscall(__NR_copy_file_range, in_fd, &in_position, out_fd, &out_position, (size_t)(size - done), 0u);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;
+        done += count;
+    }
+#endif
+    // sendfile writes where the output's file offset is
+    if (done < size && lseek64(out_fd, out_offset + done, SEEK_SET) >= 0) {
+        while (done < size) {
+            off64_t in_position = in_offset + done;
+            ssize_t count = sendfile_from(out_fd, in_fd, &in_position, (size_t)std::min(size - done, MAX_SENDFILE_SIZE));
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) break;
+            done += count;
+        }
+    }
+    return done;
+}
+
+static int copy_through_memory(int in_fd, int64_t in_offset, int out_fd, int64_t out_offset, int64_t size) {
+    std::vector<uint8_t> buffer((size_t)std::min<int64_t>(size, COPY_BUFFER_SIZE));
+    for (int64_t done = 0; done < size;) {
+        ssize_t count = pread64(in_fd, buffer.data(), (size_t)std::min<int64_t>(size - done, buffer.size()), in_offset + done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return count < 0 ? AVERROR(errno) : AVERROR(EIO);
+        for (ssize_t written = 0; written < count;) {
+            ssize_t result = pwrite64(out_fd, buffer.data() + written, count - written, out_offset + done + written);
+            if (result < 0 && errno == EINTR) continue;
+            if (result < 0) return AVERROR(errno);
+            written += result;
+        }
+        done += count;
+    }
+    return 0;
+}
+
+int copy_to_output_io(AVIOContext* io_context, int fd, int64_t offset, int64_t size) {
+    if (size <= 0) return 0;
+    // What's buffered or still on its way comes first
+    avio_flush(io_context);
+    if (io_context->error < 0) return io_context->error;
+    auto* writer = static_cast<FdWriter*>(io_context->opaque);
+    int ret = writer->async ? writer->async->finish() : 0;
+    if (ret < 0) return ret;
+
+    int64_t position = avio_tell(io_context);
+    struct stat info;
+    int64_t block = fstat(writer->fd, &info) == 0 && info.st_blksize > 0 ? info.st_blksize : 4096;
+
+    // The blocks can only be shared if the range sits at the same place within a block in both files. The whole
+    // blocks in the middle are, what's around them is copied
+    int64_t head = std::min(size, (block - offset % block) % block);
+    int64_t cloned = 0;
+    if ((position - offset) % block == 0 && size - head >= block) {
+        cloned = (size - head) / block * block;
+        if (!clone_range(fd, offset + head, writer->fd, position + head, cloned)) cloned = 0;
+    }
+
+    int64_t in_kernel = 0, through_memory = 0;
+    // Before the cloned blocks, then after them
+    const int64_t ranges[2][2] = {{0, cloned ? head : size}, {head + cloned, cloned ? size - head - cloned : 0}};
+    for (const auto& range : ranges) {
+        if (range[1] == 0) continue;
+        int64_t copied = copy_in_kernel(fd, offset + range[0], writer->fd, position + range[0], range[1]);
+        in_kernel += copied;
+        through_memory += range[1] - copied;
+        ret = copy_through_memory(fd, offset + range[0] + copied, writer->fd, position + range[0] + copied, range[1] - copied);
+        if (ret < 0) return ret;
+    }
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Copied %lld bytes into the output: %lld shared, %lld in the kernel, %lld through memory",
+                        (long long)size, (long long)cloned, (long long)in_kernel, (long long)through_memory);
+
+    writer->size = std::max(writer->size, position + size);
+    if (writer->sync_interval > 0 && writer->size - writer->synced_size >= writer->sync_interval) {
+        ret = writer->sync();
+        if (ret < 0) return ret;
+    }
+    // Later writes go after the copy
+    int64_t seeked = avio_seek(io_context, position + size, SEEK_SET);
+    return seeked < 0 ? (int)seeked : 0;
+}
@@ -0,0 +1,64 @@
+#ifndef MP3FY_OUTPUTFILE_H
+#define MP3FY_OUTPUTFILE_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include <cstdint>
+
+// How output files are written, these have to match the OUTPUT_BACKEND_* constants in MP3fy.java
+enum OutputBackend {
+    // pwrite on the converting thread
+    OUTPUT_BACKEND_BUFFERED = 0,
+    // Written behind the conversion by the shared I/O threads, see AsyncWriter
+    OUTPUT_BACKEND_ASYNC = 1,
+};
+
+// Special sync intervals, these have to match the OUTPUT_SYNC_* constants in MP3fy.java
+enum OutputSync {
+    // Leave it to the kernel to write the output back whenever it likes
+    OUTPUT_SYNC_NEVER = -1,
+    // Once, when the output is complete
+    OUTPUT_SYNC_ON_CLOSE = 0,
+};
+
+/**
+ * Opens a local file for writing through our own AVIOContext (see CustomIo.h). The output is written into a temp file
+ * next to path, which replaces path only once the output is complete: free the context with free_custom_io, discarding
+ * it if the conversion failed, and whatever was at path before stays there.
+ * @param expected_size Estimated size of the output, preallocated up front. 0 if unknown
+ * @return null if the file can't be created. FFmpeg's avio_open might still manage (other protocols)
+ */
+AVIOContext* open_output_io(const char* path, int64_t expected_size);
+
+/**
+ * Makes a context opened with open_output_io the output of a muxer
+ */
+void attach_output_io(AVFormatContext* context, AVIOContext* io_context);
+
+/**
+ * Copies size bytes of fd, from offset, into an output opened with open_output_io where it's at. They don't go through
+ * our memory if the kernel can help it: the blocks are shared with a reflink where the file system has them, otherwise
+ * copied with copy_file_range or sendfile, read and written only as a last resort
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+int copy_to_output_io(AVIOContext* io_context, int fd, int64_t offset, int64_t size);
+
+/**
+ * Sets the OutputBackend for outputs opened from now on
+ */
+void set_output_backend(int backend);
+
+/**
+ * Sets the write buffer size for outputs opened from now on, each buffer fill is one write
+ */
+void set_output_buffer_size(int bytes);
+
+/**
+ * Sets how often outputs opened from now on are synced to the disk: every this many bytes (and once complete), or
+ * one of the OutputSync values
+ */
+void set_output_sync_interval(int64_t bytes);
+
+#endif //MP3FY_OUTPUTFILE_H
@@ -0,0 +1,242 @@
+#include "Resampler.h"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
+}
+
+#include <algorithm>
+#include <cmath>
+
+struct FilterSettings {
+    // Taps on each side of the output position, at the input rate when upsampling and the output rate otherwise
+    int half_length;
+    // Passband edge, as a fraction of the lower of the two Nyquist frequencies
+    double cutoff;
+    // Output positions between two input samples get the filter of the closest of this many phases
+    int max_phases;
+};
+
+// Indexed by ResampleQuality. Roughly what libswresample does with the same filter_size/cutoff/phase_shift
+static const FilterSettings FILTER_SETTINGS[] = {
+        {4, 0.85, 64},
+        {16, 0.95, 1024},
+        {32, 0.97, 4096},
+};
+
+// Heavy downsampling (192kHz to 8kHz) would otherwise need hundreds of taps per sample
+static const int MAX_FILTER_STRETCH = 8;
+
+// Level of a channel that is mixed into both sides (center) or into a side it only partly belongs to (surround), -3dB
+static const float MIX_LEVEL = 0.7071f;
+
+static float read_sample(const uint8_t* data, AVSampleFormat format, int index) {
+    switch (format) {
+        case AV_SAMPLE_FMT_U8: return (data[index] - 128) / 128.0f;
+        case AV_SAMPLE_FMT_S16: return reinterpret_cast<const int16_t*>(data)[index] / 32768.0f;
+        case AV_SAMPLE_FMT_S32: return (float)(reinterpret_cast<const int32_t*>(data)[index] / 2147483648.0);
+        case AV_SAMPLE_FMT_S64: return (float)(reinterpret_cast<const int64_t*>(data)[index] / 9223372036854775808.0);
+        case AV_SAMPLE_FMT_FLT: return reinterpret_cast<const float*>(data)[index];
+        case AV_SAMPLE_FMT_DBL: return (float)reinterpret_cast<const double*>(data)[index];
+        default: return 0;
+    }
+}
+
+Resampler::Resampler(AVSampleFormat input_format, uint64_t input_layout, int input_channels, int input_rate,
+                     AVSampleFormat output_format, int output_channels, int output_rate, int quality)
+        : input_format(av_get_packed_sample_fmt(input_format)), input_planar(av_sample_fmt_is_planar(input_format)),
+          input_channels(input_channels), output_format(av_get_packed_sample_fmt(output_format)),
+          output_planar(av_sample_fmt_is_planar(output_format)), output_channels(output_channels) {
+    build_mix(input_layout ? input_layout : av_get_default_channel_layout(input_channels));
+
+    int64_t divisor = av_gcd(input_rate, output_rate);
+    step_in = (int)(input_rate / divisor);
+    step_out = (int)(output_rate / divisor);
+    direct = step_in == step_out;
+    if (!direct) build_filter(quality);
+
+    // The filter reaches back before the first sample, which is silence
+    pending.assign(output_channels, std::vector<float>(history, 0.0f));
+    position = history;
+    input_end = history;
+}
+
+/**
+ * Standard downmix: to stereo, center and surround channels go into both sides at -3dB and LFE is dropped, to mono
+ * everything but LFE is averaged. Rows are scaled down so a full scale input can't clip. Other channel counts keep
+ * the first channels of the input and leave the rest silent
+ */
+void Resampler::build_mix(uint64_t input_layout) {
+    mix.assign((size_t)output_channels * input_channels, 0.0f);
+
+    if (output_channels == 2 && input_channels != 2) {
+        for (int i = 0; i < input_channels; i++) {
+            uint64_t channel = input_channels == 1 ? 0 : av_channel_layout_extract_channel(input_layout, i);
+            float left, right;
+            if (input_channels == 1) {
+                left = right = 1;
+            } else if (channel & (AV_CH_FRONT_LEFT | AV_CH_TOP_FRONT_LEFT)) {
+                left = 1, right = 0;
+            } else if (channel & (AV_CH_FRONT_RIGHT | AV_CH_TOP_FRONT_RIGHT)) {
+                left = 0, right = 1;
+            } else if (channel & (AV_CH_FRONT_LEFT_OF_CENTER | AV_CH_SIDE_LEFT | AV_CH_BACK_LEFT | AV_CH_WIDE_LEFT |
+                                  AV_CH_SURROUND_DIRECT_LEFT | AV_CH_TOP_BACK_LEFT | AV_CH_STEREO_LEFT)) {
+                left = MIX_LEVEL, right = 0;
+            } else if (channel & (AV_CH_FRONT_RIGHT_OF_CENTER | AV_CH_SIDE_RIGHT | AV_CH_BACK_RIGHT | AV_CH_WIDE_RIGHT |
+                                  AV_CH_SURROUND_DIRECT_RIGHT | AV_CH_TOP_BACK_RIGHT | AV_CH_STEREO_RIGHT)) {
+                left = 0, right = MIX_LEVEL;
+            } else if (channel & (AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2)) {
+                left = right = 0;
+            } else {
+                left = right = MIX_LEVEL;
+            }
+            mix[i] = left;
+            mix[input_channels + i] = right;
+        }
+    } else if (output_channels == 1 && input_channels != 1) {
+        int mixed = 0;
+        for (int i = 0; i < input_channels; i++) {
+            if (!(av_channel_layout_extract_channel(input_layout, i) & (AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2))) mixed++;
+        }
+        for (int i = 0; i < input_channels; i++) {
+            if (!(av_channel_layout_extract_channel(input_layout, i) & (AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2))) {
+                mix[i] = 1.0f / std::max(mixed, 1);
+            }
+        }
+    } else {
+        for (int i = 0; i < std::min(input_channels, output_channels); i++) mix[(size_t)i * input_channels + i] = 1;
+    }
+
+    for (int o = 0; o < output_channels; o++) {
+        float* row = &mix[(size_t)o * input_channels];
+        float sum = 0;
+        for (int i = 0; i < input_channels; i++) sum += row[i];
+        if (sum > 1) {
+            for (int i = 0; i < input_channels; i++) row[i] /= sum;
+        }
+    }
+}
+
+/**
+ * Blackman windowed sinc, one set of taps per phase, each normalized so it doesn't change the level
+ */
+void Resampler::build_filter(int quality) {
+    const FilterSettings& settings = FILTER_SETTINGS[quality >= RESAMPLE_QUALITY_FAST && quality <= RESAMPLE_QUALITY_HIGH ? quality : RESAMPLE_QUALITY_DEFAULT];
+
+    // When downsampling, the filter cuts below the output Nyquist frequency and gets longer to match
+    double ratio = std::min(1.0, (double)step_out / step_in);
+    double cutoff = settings.cutoff * ratio;
+    int half_length = (int)std::ceil(settings.half_length / std::max(ratio, 1.0 / MAX_FILTER_STRETCH));
+
+    history = half_length - 1;
+    lookahead = half_length;
+    phases = std::min(step_out, settings.max_phases);
+
+    int taps = history + lookahead + 1;
+    coefficients.resize((size_t)phases * taps);
+    for (int phase = 0; phase < phases; phase++) {
+        float* row = &coefficients[(size_t)phase * taps];
+        double sum = 0;
+        for (int tap = 0; tap < taps; tap++) {
+            double distance = tap - history - (double)phase / phases;
+            double x = distance / half_length;
+            double window = std::abs(x) >= 1 ? 0 : 0.42 + 0.5 * std::cos(M_PI * x) + 0.08 * std::cos(2 * M_PI * x);
+            double sinc = distance == 0 ? 1 : std::sin(M_PI * cutoff * distance) / (M_PI * cutoff * distance);
+            row[tap] = (float)(sinc * window);
+            sum += row[tap];
+        }
+        for (int tap = 0; tap < taps; tap++) row[tap] = (float)(row[tap] / sum);
+    }
+}
+
+void Resampler::append(const uint8_t** input, int count) {
+    std::vector<float> samples((size_t)input_channels);
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; c < input_channels; c++) {
+            samples[c] = input_planar ? read_sample(input[c], input_format, i) : read_sample(input[0], input_format, i * input_channels + c);
+        }
+        for (int o = 0; o < output_channels; o++) {
+            const float* row = &mix[(size_t)o * input_channels];
+            float value = 0;
+            for (int c = 0; c < input_channels; c++) value += row[c] * samples[c];
+            pending[o].push_back(value);
+        }
+    }
+    input_end += count;
+}
+
+float Resampler::filter(const float* samples, int phase) const {
+    int taps = history + lookahead + 1;
+    const float* row = &coefficients[(size_t)phase * taps];
+    float value = 0;
+    for (int tap = 0; tap < taps; tap++) value += row[tap] * samples[tap];
+    return value;
+}
+
+void Resampler::store(uint8_t** output, int index, int channel, float value) const {
+    uint8_t* data = output_planar ? output[channel] : output[0];
+    if (!output_planar) index = index * output_channels + channel;
+
+    switch (output_format) {
+        case AV_SAMPLE_FMT_U8:
+            data[index] = (uint8_t)std::max(0L, std::min(255L, lrintf(value * 128) + 128));
+            break;
+        case AV_SAMPLE_FMT_S16:
+            reinterpret_cast<int16_t*>(data)[index] = (int16_t)std::max(-32768L, std::min(32767L, lrintf(value * 32768)));
+            break;
+        case AV_SAMPLE_FMT_S32:
+            reinterpret_cast<int32_t*>(data)[index] = (int32_t)std::max(-2147483648.0, std::min(2147483647.0, std::round(value * 2147483648.0)));
+            break;
+        case AV_SAMPLE_FMT_S64:
+            reinterpret_cast<int64_t*>(data)[index] = (int64_t)std::max(-9223372036854775808.0, std::min(9223372036854774784.0, std::round(value * 9223372036854775808.0)));
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            reinterpret_cast<float*>(data)[index] = value;
+            break;
+        case AV_SAMPLE_FMT_DBL:
+            reinterpret_cast<double*>(data)[index] = value;
+            break;
+        default:
+            break;
+    }
+}
+
+int Resampler::get_out_samples(int count) const {
+    // Output positions left before the end of the input
+    int64_t end = (int64_t)input_end + count;
+    if (position >= end) return 0;
+    return (int)(((end - position) * step_out - fraction + step_in - 1) / step_in);
+}
+
+int Resampler::convert(uint8_t** output, int output_count, const uint8_t** input, int count) {
+    if (input) {
+        append(input, count);
+    } else if (!flushed) {
+        // Silence after the end, for the filter to reach into
+        flushed = true;
+        for (std::vector<float>& channel : pending) channel.insert(channel.end(), lookahead, 0.0f);
+    }
+
+    int available = (int)pending[0].size();
+    int written = 0;
+    while (written < output_count && position < input_end && position + lookahead < available) {
+        int phase = direct ? 0 : (int)((int64_t)fraction * phases / step_out);
+        for (int c = 0; c < output_channels; c++) {
+            const float* samples = pending[c].data() + position - history;
+            store(output, written, c, direct ? samples[0] : filter(samples, phase));
+        }
+        written++;
+        fraction += step_in;
+        position += fraction / step_out;
+        fraction %= step_out;
+    }
+
+    // Drop what the filter can't reach anymore
+    int consumed = std::min(position - history, available);
+    if (consumed > 0) {
+        for (std::vector<float>& channel : pending) channel.erase(channel.begin(), channel.begin() + consumed);
+        position -= consumed;
+        input_end -= consumed;
+    }
+    return written;
+}
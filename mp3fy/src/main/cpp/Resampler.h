@@ -0,0 +1,89 @@
+#ifndef MP3FY_RESAMPLER_H
+#define MP3FY_RESAMPLER_H
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+#include <cstdint>
+#include <vector>
+
+// Resampler speed/quality tiers, these have to match the RESAMPLE_QUALITY_* constants in EncodingProfile.java
+enum ResampleQuality {
+    RESAMPLE_QUALITY_FAST = 0,
+    RESAMPLE_QUALITY_DEFAULT = 1,
+    RESAMPLE_QUALITY_HIGH = 2,
+};
+
+/**
+ * Converts decoded samples to the format, channel layout and sample rate of the encoder. The bundled FFmpeg is built
+ * without libswresample, this does the part of it we need.
+ *
+ * Channels are mixed first (a standard downmix to stereo or mono, anything else keeps the first channels), then the
+ * rate is changed with a windowed sinc filter whose length and cutoff depend on the ResampleQuality. Works like
+ * swr_convert: every input sample is taken, what doesn't fit the output stays inside until the next call.
+ */
+class Resampler {
+public:
+    /**
+     * @param input_layout Channel layout of the input, 0 for the default layout of input_channels
+     */
+    Resampler(AVSampleFormat input_format, uint64_t input_layout, int input_channels, int input_rate,
+              AVSampleFormat output_format, int output_channels, int output_rate, int quality);
+
+    Resampler(const Resampler&) = delete;
+    Resampler& operator=(const Resampler&) = delete;
+
+    /**
+     * At most how many samples convert() puts out with count more input samples, including what is held inside
+     */
+    int get_out_samples(int count) const;
+
+    /**
+     * Takes count input samples (planar or packed, like AVFrame::extended_data) and writes at most output_count
+     * samples. A null input flushes: the samples the filter still holds on to come out.
+     * @return the number of samples written
+     */
+    int convert(uint8_t** output, int output_count, const uint8_t** input, int count);
+
+private:
+    void build_mix(uint64_t input_layout);
+    void build_filter(int quality);
+    void append(const uint8_t** input, int count);
+    float filter(const float* samples, int phase) const;
+    void store(uint8_t** output, int index, int channel, float value) const;
+
+    // Formats are kept packed, the planar flags say where the channels are
+    AVSampleFormat input_format;
+    bool input_planar;
+    int input_channels;
+    AVSampleFormat output_format;
+    bool output_planar;
+    int output_channels;
+
+    // output_channels rows of input_channels weights
+    std::vector<float> mix;
+
+    // The rate ratio in lowest terms: every output sample moves step_in / step_out input samples further
+    int step_in;
+    int step_out;
+    // Same rate, samples are only converted and mixed
+    bool direct;
+    // Samples the filter reaches on either side of the output position
+    int history = 0;
+    int lookahead = 0;
+    int phases = 1;
+    // phases rows of history + lookahead + 1 taps
+    std::vector<float> coefficients;
+
+    // Mixed input samples per output channel, starting history samples before the next output position
+    std::vector<std::vector<float>> pending;
+    int position = 0;
+    // In 1 / step_out of an input sample
+    int fraction = 0;
+    // Samples in pending that came from the input, the silence added at the flush isn't
+    int input_end = 0;
+    bool flushed = false;
+};
+
+#endif //MP3FY_RESAMPLER_H
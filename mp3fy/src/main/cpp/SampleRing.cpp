@@ -0,0 +1,182 @@
+#include "SampleRing.h"
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/mem.h>
+}
+
+#include <algorithm>
+#include <cstring>
+
+/**
+ * The memory behind the ring. The ring and every frame handed out hold a reference, so growing the ring while the
+ * encoder still has frames from the old storage is fine, it goes away with the last of them.
+ */
+struct SampleRing::Storage {
+    std::vector<uint8_t*> planes;
+    std::atomic<int> references{1};
+    // Position up to which read frames have been given back
+    std::atomic<int64_t> released{0};
+
+    ~Storage() {
+        for (uint8_t* plane : planes) av_free(plane);
+    }
+
+    void unref() {
+        if (references.fetch_sub(1) == 1) delete this;
+    }
+};
+
+struct SampleRing::RingFrame {
+    Storage* storage;
+    // Position the ring can reuse up to once this frame is released
+    int64_t end;
+};
+
+SampleRing::SampleRing(AVSampleFormat format, int channels, int frame_size, int capacity)
+        : format(format), channels(channels), frame_size(frame_size) {
+    bool planar = av_sample_fmt_is_planar(format);
+    planes = planar ? channels : 1;
+    stride = av_get_bytes_per_sample(format) * (planar ? 1 : channels);
+    allocate(capacity);
+}
+
+SampleRing::~SampleRing() {
+    if (storage) storage->unref();
+}
+
+bool SampleRing::allocate(int new_capacity) {
+    // Whole frames only, so that reads never wrap
+    new_capacity = std::max(new_capacity, frame_size * 2);
+    new_capacity = (new_capacity + frame_size - 1) / frame_size * frame_size;
+
+    auto* new_storage = new Storage;
+    new_storage->planes.resize(planes);
+    for (int i = 0; i < planes; i++) {
+        new_storage->planes[i] = (uint8_t*)av_malloc((size_t)new_capacity * stride);
+        if (!new_storage->planes[i]) {
+            new_storage->unref();
+            return false;
+        }
+    }
+
+    // Move what hasn't been read yet to the start of the new storage. Reads are frame aligned from there on again
+    int buffered = size();
+    for (int i = 0; i < planes && storage; i++) {
+        for (int copied_samples = 0; copied_samples < buffered;) {
+            int index = index_of(read_position + copied_samples);
+            int count = std::min(buffered - copied_samples, capacity - index);
+            memcpy(new_storage->planes[i] + (size_t)copied_samples * stride, storage->planes[i] + (size_t)index * stride, (size_t)count * stride);
+            copied_samples += count;
+        }
+    }
+    copied += (int64_t)buffered * stride * planes;
+
+    if (storage) storage->unref();
+    storage = new_storage;
+    storage->released.store(read_position);
+    capacity = new_capacity;
+    origin = read_position;
+    return true;
+}
+
+int SampleRing::free_space() const {
+    return capacity - (int)(write_position - storage->released.load(std::memory_order_acquire));
+}
+
+bool SampleRing::reserve(int count) {
+    if (count <= free_space()) return true;
+    return allocate((size() + count) * 2);
+}
+
+int SampleRing::writable(uint8_t** data) {
+    int index = index_of(write_position);
+    int count = std::min(free_space(), capacity - index);
+    for (int i = 0; i < planes; i++) data[i] = storage->planes[i] + (size_t)index * stride;
+    return count;
+}
+
+void SampleRing::commit(int count) {
+    write_position += count;
+    copied += (int64_t)count * stride * planes;
+}
+
+bool SampleRing::resample(Resampler* resampler, const uint8_t** input, int count) {
+    int out_count = resampler->get_out_samples(count);
+    if (out_count < 0 || !reserve(out_count)) return false;
+
+    // The free space might wrap around the end of the ring, in which case the resampler gets a second go. That one
+    // passes no new samples, but still the same input pointer since a null one would flush the resampler
+    std::vector<uint8_t*> destination(planes);
+    for (;;) {
+        int space = writable(destination.data());
+        int converted = resampler->convert(destination.data(), space, input, count);
+        if (converted < 0) return false;
+        commit(converted);
+        // Output that exactly fills the free space leaves none for another go, and the resampler has nothing left
+        if (converted == 0 || converted < space) return true;
+        count = 0;
+    }
+}
+
+bool SampleRing::write(const uint8_t* const* data, int offset, int count) {
+    if (!reserve(count)) return false;
+
+    std::vector<uint8_t*> destination(planes);
+    for (int written = 0; written < count;) {
+        int chunk = std::min(count - written, writable(destination.data()));
+        for (int i = 0; i < planes; i++) {
+            memcpy(destination[i], data[i] + (size_t)(offset + written) * stride, (size_t)chunk * stride);
+        }
+        commit(chunk);
+        written += chunk;
+    }
+
+    return true;
+}
+
+void SampleRing::release(void* opaque, uint8_t* data) {
+    auto* frame = static_cast<RingFrame*>(opaque);
+    frame->storage->released.store(frame->end, std::memory_order_release);
+    frame->storage->unref();
+    delete frame;
+}
+
+bool SampleRing::read(AVFrame* frame, int count) {
+    count = std::min(std::min(count, size()), frame_size);
+    if (count <= 0) return false;
+
+    uint8_t** extended_data = nullptr;
+    if (planes > AV_NUM_DATA_POINTERS) {
+        extended_data = (uint8_t**)av_mallocz_array(planes, sizeof(uint8_t*));
+        if (!extended_data) return false;
+    }
+
+    int index = index_of(read_position);
+    auto* ring_frame = new RingFrame{storage, read_position + count};
+    storage->references.fetch_add(1);
+
+    AVBufferRef* buffer = av_buffer_create(storage->planes[0] + (size_t)index * stride, count * stride, release, ring_frame, 0);
+    if (!buffer) {
+        storage->unref();
+        delete ring_frame;
+        av_free(extended_data);
+        return false;
+    }
+
+    av_frame_unref(frame);
+    frame->buf[0] = buffer;
+    frame->format = format;
+    frame->channels = channels;
+    frame->nb_samples = count;
+    frame->linesize[0] = count * stride;
+    frame->extended_data = extended_data ? extended_data : frame->data;
+
+    for (int i = 0; i < planes; i++) {
+        frame->extended_data[i] = storage->planes[i] + (size_t)index * stride;
+        if (i < AV_NUM_DATA_POINTERS) frame->data[i] = frame->extended_data[i];
+    }
+
+    read_position += count;
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef MP3FY_SAMPLERING_H
+#define MP3FY_SAMPLERING_H
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+}
+
+#include "Resampler.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Ring buffer of encoder-ready samples sitting between the decoder (or resampler) and the encoder.
+ *
+ * Unlike AVAudioFifo, reading does not copy: read() hands out a frame whose data points straight into the ring and
+ * whose buffer reference gives the space back once the encoder lets go of it. Frames are always read at multiples of
+ * the frame size and the capacity is a multiple of it too, so a frame never wraps around the end of the ring.
+ *
+ * Only the writer copies, and the resampler can write its output in place through writable()/commit().
+ * Not thread safe, except for the buffer release callbacks.
+ */
+class SampleRing {
+public:
+    SampleRing(AVSampleFormat format, int channels, int frame_size, int capacity);
+    ~SampleRing();
+
+    SampleRing(const SampleRing&) = delete;
+    SampleRing& operator=(const SampleRing&) = delete;
+
+    /**
+     * Number of samples written but not read yet
+     */
+    int size() const { return (int)(write_position - read_position); }
+
+    /**
+     * Makes sure count more samples can be written, growing the ring if the encoder still holds on to too much of it
+     */
+    bool reserve(int count);
+
+    /**
+     * Copies count samples from data (planar or packed, like AVFrame::extended_data) starting at offset into the ring
+     */
+    bool write(const uint8_t* const* data, int offset, int count);
+
+    /**
+     * Fills planes with where the next samples go and returns how many can be written there contiguously.
+     * Call reserve() first, then commit() with the number of samples actually written.
+     */
+    int writable(uint8_t** planes);
+    void commit(int count);
+
+    /**
+     * Runs count samples through the resampler straight into the ring, in place. A null input flushes the resampler
+     */
+    bool resample(Resampler* resampler, const uint8_t** input, int count);
+
+    /**
+     * Sets frame up to reference the next count samples (at most the frame size) without copying them
+     */
+    bool read(AVFrame* frame, int count);
+
+    /**
+     * Total number of sample bytes copied into the ring so far, for measuring memory traffic
+     */
+    int64_t bytes_copied() const { return copied; }
+
+    /**
+     * Total number of samples written into the ring so far
+     */
+    int64_t samples_written() const { return write_position; }
+
+private:
+    struct Storage;
+    struct RingFrame;
+
+    bool allocate(int new_capacity);
+    int index_of(int64_t position) const { return (int)((position - origin) % capacity); }
+    int free_space() const;
+
+    static void release(void* opaque, uint8_t* data);
+
+    AVSampleFormat format;
+    int channels;
+    int frame_size;
+    int planes;
+    // Bytes per sample in one plane, i.e. including all channels for packed formats
+    int stride;
+
+    Storage* storage = nullptr;
+    int capacity = 0;
+    // Positions are counted in samples since the ring was created, origin is the position stored at index 0
+    int64_t origin = 0;
+    int64_t write_position = 0;
+    int64_t read_position = 0;
+    int64_t copied = 0;
+};
+
+#endif //MP3FY_SAMPLERING_H
@@ -0,0 +1,130 @@
+#ifndef MP3FY_SPSCQUEUE_H
+#define MP3FY_SPSCQUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/**
+ * Bounded single-producer/single-consumer queue used to connect the stages of the pipelined conversion.
+ * Push and pop are lock free while the queue is neither full nor empty. A stage only falls back to sleeping on
+ * a condition variable when it has to wait for its neighbour, which is what gives us backpressure.
+ *
+ * close() is called by the producer when there is nothing more to send, pop() keeps returning items until the queue
+ * is drained and only then reports false. abort() wakes both sides up and makes every further push/pop fail, the owner
+ * is responsible for freeing whatever is still inside with try_pop().
+ */
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    bool push(T item) {
+        size_t head = write_index.load(std::memory_order_relaxed);
+        for (;;) {
+            if (aborted.load(std::memory_order_acquire)) return false;
+            if (head - read_index.load(std::memory_order_acquire) <= mask) break;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            producer_waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            not_full.wait(lock, [&] {
+                return aborted.load(std::memory_order_acquire) ||
+                       head - read_index.load(std::memory_order_acquire) <= mask;
+            });
+            producer_waiting.store(false, std::memory_order_relaxed);
+        }
+
+        slots[head & mask] = std::move(item);
+        write_index.store(head + 1, std::memory_order_release);
+        wake(consumer_waiting, not_empty);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t tail = read_index.load(std::memory_order_relaxed);
+        for (;;) {
+            if (aborted.load(std::memory_order_acquire)) return false;
+            if (write_index.load(std::memory_order_acquire) != tail) break;
+            if (closed.load(std::memory_order_acquire)) {
+                // The producer might have pushed right before closing
+                if (write_index.load(std::memory_order_acquire) != tail) break;
+                return false;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            consumer_waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            not_empty.wait(lock, [&] {
+                return aborted.load(std::memory_order_acquire) || closed.load(std::memory_order_acquire) ||
+                       write_index.load(std::memory_order_acquire) != tail;
+            });
+            consumer_waiting.store(false, std::memory_order_relaxed);
+        }
+
+        item = std::move(slots[tail & mask]);
+        read_index.store(tail + 1, std::memory_order_release);
+        wake(producer_waiting, not_full);
+        return true;
+    }
+
+    /**
+     * Non blocking pop that ignores the aborted flag. Only meant for cleaning up once both ends have stopped.
+     */
+    bool try_pop(T& item) {
+        size_t tail = read_index.load(std::memory_order_relaxed);
+        if (write_index.load(std::memory_order_acquire) == tail) return false;
+        item = std::move(slots[tail & mask]);
+        read_index.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mutex);
+        not_empty.notify_all();
+    }
+
+    void abort() {
+        aborted.store(true, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mutex);
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    void wake(std::atomic<bool>& waiting, std::condition_variable& condition) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            condition.notify_one();
+        }
+    }
+
+    std::vector<T> slots;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> write_index{0};
+    alignas(64) std::atomic<size_t> read_index{0};
+
+    std::atomic<bool> closed{false};
+    std::atomic<bool> aborted{false};
+    std::atomic<bool> producer_waiting{false};
+    std::atomic<bool> consumer_waiting{false};
+
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+#endif //MP3FY_SPSCQUEUE_H
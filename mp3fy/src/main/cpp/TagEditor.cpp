@@ -0,0 +1,1157 @@
+#include "TagEditor.h"
+#include "CustomIo.h"
+#include "OutputFile.h"
+
+extern "C" {
+#include <libavformat/version.h>
+#include <libavutil/avutil.h>
+#include <libavutil/base64.h>
+#include <libavutil/crc.h>
+#include <libavutil/intreadwrite.h>
+}
+
+#include <android/log.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static const int DEFAULT_TAG_PADDING = 4096;
+
+// Bytes looked at to tell the formats apart
+static const int SNIFF_SIZE = 12;
+
+// Tags bigger than this (a lot of album art) aren't edited natively
+static const int64_t MAX_TAG_REGION_SIZE = 64 * 1024 * 1024;
+
+static std::atomic<int> padding{DEFAULT_TAG_PADDING};
+
+static bool read_fully(int fd, uint8_t* data, size_t size, int64_t offset) {
+    for (size_t done = 0; done < size;) {
+        ssize_t count = pread64(fd, data + done, size - done, offset + done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        done += count;
+    }
+    return true;
+}
+
+/**
+ * Writes the bytes of updated that differ from original, which are the same size, at offset
+ * @return how many bytes were written, a negative AVERROR on failure
+ */
+static int64_t write_changes(int fd, const std::vector<uint8_t>& original, const std::vector<uint8_t>& updated, int64_t offset) {
+    size_t first = 0;
+    while (first < updated.size() && original[first] == updated[first]) first++;
+    if (first == updated.size()) return 0;
+    size_t last = updated.size();
+    while (original[last - 1] == updated[last - 1]) last--;
+
+    for (size_t done = first; done < last;) {
+        ssize_t count = pwrite64(fd, updated.data() + done, last - done, offset + done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return AVERROR(errno);
+        done += count;
+    }
+    return (int64_t)(last - first);
+}
+
+static void append_be32(std::vector<uint8_t>* data, uint32_t value) {
+    data->insert(data->end(), {(uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value});
+}
+
+static void append_le32(std::vector<uint8_t>* data, uint32_t value) {
+    data->insert(data->end(), {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)});
+}
+
+static bool is_png(const uint8_t* data, int size) {
+    return size >= 4 && memcmp(data, "\x89PNG", 4) == 0;
+}
+
+/**
+ * The part of a file its tags are in, their padding included
+ */
+struct TagRegion {
+    int64_t offset = 0;
+    std::vector<uint8_t> original;
+    // Nothing comes after it, so it can grow where it is
+    bool at_end = false;
+};
+
+/**
+ * How the tags of one format are found and laid out
+ */
+struct TagFormat {
+    const char* name;
+    bool (*sniff)(const uint8_t* header);
+    // AVERROR(ENOTSUP) if the file has no tags this can edit
+    int (*read)(int fd, int64_t file_size, TagRegion* region);
+    // Lays the edited tags out, without padding
+    int (*build)(const TagRegion& region, const TagEdit& edit, std::vector<uint8_t>* tags);
+    // Pads built tags to exactly size bytes, false if they can't be
+    bool (*pad)(std::vector<uint8_t>* tags, size_t size);
+    // Whether the tags can grow by rewriting the file around them, see rewrite_tags
+    bool rewritable;
+    // Shifts the offsets in the tags that point past end (the end of the region) by delta bytes, for a rewrite. Null if
+    // nothing in them points into the file
+    int (*move)(std::vector<uint8_t>* tags, int64_t end, int64_t delta);
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+
+//                                  ID3v2                                       //
+
+/////////////////////////////////////////////////////////////////////////////////
+
+static const int ID3V2_HEADER_SIZE = 10;
+
+enum Id3v2Encoding {
+    ID3V2_ENCODING_ISO8859 = 0,
+    ID3V2_ENCODING_UTF16BOM = 1,
+    ID3V2_ENCODING_UTF8 = 3,
+};
+
+// FFmpeg's keys of the text frames, as FFmpeg reads and writes them
+static const char* const ID3V2_TEXT_FRAMES[][2] = {
+    {"album", "TALB"}, {"composer", "TCOM"}, {"genre", "TCON"}, {"copyright", "TCOP"}, {"encoded_by", "TENC"},
+    {"title", "TIT2"}, {"language", "TLAN"}, {"artist", "TPE1"}, {"album_artist", "TPE2"}, {"performer", "TPE3"},
+    {"disc", "TPOS"}, {"publisher", "TPUB"}, {"track", "TRCK"}, {"encoder", "TSSE"}, {"compilation", "TCMP"},
+    {"album-sort", "TSOA"}, {"artist-sort", "TSOP"}, {"title-sort", "TSOT"}, {"grouping", "TIT1"},
+};
+
+static bool is_frame_id(const uint8_t* id) {
+    for (int i = 0; i < 4; i++) {
+        if (!((id[i] >= 'A' && id[i] <= 'Z') || (id[i] >= '0' && id[i] <= '9'))) return false;
+    }
+    return true;
+}
+
+/**
+ * Frames made from FFmpeg's metadata keys, which an edit replaces. Everything else (album art, private frames...) stays
+ */
+static bool is_tag_frame(const uint8_t* id) {
+    return id[0] == 'T' || memcmp(id, "COMM", 4) == 0 || memcmp(id, "USLT", 4) == 0;
+}
+
+static uint32_t read_syncsafe(const uint8_t* data) {
+    return (data[0] & 0x7F) << 21 | (data[1] & 0x7F) << 14 | (data[2] & 0x7F) << 7 | (data[3] & 0x7F);
+}
+
+static void write_syncsafe(uint8_t* data, uint32_t value) {
+    data[0] = (value >> 21) & 0x7F;
+    data[1] = (value >> 14) & 0x7F;
+    data[2] = (value >> 7) & 0x7F;
+    data[3] = value & 0x7F;
+}
+
+static bool is_ascii(const std::string& string) {
+    return std::all_of(string.begin(), string.end(), [](char c) { return (unsigned char)c < 0x80; });
+}
+
+/**
+ * ID3v2.3 has no UTF-8, its text is either Latin-1 or UTF-16
+ */
+static void append_utf16(std::vector<uint8_t>* data, const std::string& string) {
+    data->push_back(0xFF);
+    data->push_back(0xFE);
+    for (size_t i = 0; i < string.size();) {
+        auto c = (uint8_t)string[i];
+        uint32_t code_point;
+        int length = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 1;
+        code_point = length == 1 ? c : c & (0xFF >> (length + 1));
+        for (int j = 1; j < length && i + j < string.size(); j++) {
+            code_point = code_point << 6 | ((uint8_t)string[i + j] & 0x3F);
+        }
+        i += length;
+
+        if (code_point >= 0x10000) {
+            code_point -= 0x10000;
+            uint16_t high = 0xD800 | (code_point >> 10), low = 0xDC00 | (code_point & 0x3FF);
+            data->insert(data->end(), {(uint8_t)high, (uint8_t)(high >> 8), (uint8_t)low, (uint8_t)(low >> 8)});
+        } else {
+            data->insert(data->end(), {(uint8_t)code_point, (uint8_t)(code_point >> 8)});
+        }
+    }
+}
+
+static int text_encoding(int version, const std::string& text) {
+    if (version >= 4) return ID3V2_ENCODING_UTF8;
+    return is_ascii(text) ? ID3V2_ENCODING_ISO8859 : ID3V2_ENCODING_UTF16BOM;
+}
+
+static void append_text(std::vector<uint8_t>* data, int encoding, const std::string& text, bool terminated) {
+    if (encoding == ID3V2_ENCODING_UTF16BOM) {
+        append_utf16(data, text);
+        if (terminated) data->insert(data->end(), {0, 0});
+    } else {
+        data->insert(data->end(), text.begin(), text.end());
+        if (terminated) data->push_back(0);
+    }
+}
+
+static void append_frame(std::vector<uint8_t>* tag, int version, const char* id, const std::vector<uint8_t>& body) {
+    uint8_t header[ID3V2_HEADER_SIZE] = {};
+    memcpy(header, id, 4);
+    if (version >= 4) {
+        write_syncsafe(header + 4, (uint32_t)body.size());
+    } else {
+        AV_WB32(header + 4, (uint32_t)body.size());
+    }
+    tag->insert(tag->end(), header, header + sizeof(header));
+    tag->insert(tag->end(), body.begin(), body.end());
+}
+
+/**
+ * Adds the frame FFmpeg would read back as this key and value
+ */
+static void append_tag(std::vector<uint8_t>* tag, int version, const std::string& key, const std::string& value) {
+    std::vector<uint8_t> body;
+    int encoding = text_encoding(version, key + value);
+    body.push_back((uint8_t)encoding);
+
+    if (strcasecmp(key.c_str(), "comment") == 0 || strncasecmp(key.c_str(), "lyrics", 6) == 0) {
+        // Both have a language and a description. FFmpeg reads lyrics as lyrics-[description-]language
+        std::string language = "XXX", description;
+        if (key.size() > 7 && key[6] == '-') {
+            std::string rest = key.substr(7);
+            if (rest.size() >= 3 && (rest.size() == 3 || rest[rest.size() - 4] == '-')) {
+                language = rest.substr(rest.size() - 3);
+                description = rest.size() > 3 ? rest.substr(0, rest.size() - 4) : "";
+            } else {
+                description = rest;
+            }
+        }
+        body.insert(body.end(), language.begin(), language.end());
+        append_text(&body, encoding, description, true);
+        append_text(&body, encoding, value, false);
+        append_frame(tag, version, key[0] == 'c' || key[0] == 'C' ? "COMM" : "USLT", body);
+        return;
+    }
+
+    std::string id;
+    for (const auto& frame : ID3V2_TEXT_FRAMES) {
+        if (strcasecmp(key.c_str(), frame[0]) == 0) id = frame[1];
+    }
+    if (strcasecmp(key.c_str(), "date") == 0) id = version >= 4 ? "TDRC" : "TYER";
+    if (strcasecmp(key.c_str(), "creation_time") == 0 && version >= 4) id = "TDEN";
+    // Text frames FFmpeg doesn't know come back by their id
+    if (id.empty() && key.size() == 4 && key[0] == 'T' && key != "TXXX" && is_frame_id(reinterpret_cast<const uint8_t*>(key.data()))) {
+        id = key;
+    }
+
+    if (id.empty()) {
+        append_text(&body, encoding, key, true);
+        append_text(&body, encoding, value, false);
+        append_frame(tag, version, "TXXX", body);
+    } else {
+        append_text(&body, encoding, id == "TYER" ? value.substr(0, 4) : value, false);
+        append_frame(tag, version, id.c_str(), body);
+    }
+}
+
+static void append_album_art(std::vector<uint8_t>* tag, int version, const uint8_t* data, int size) {
+    std::string mime_type = is_png(data, size) ? "image/png" : "image/jpeg";
+
+    std::vector<uint8_t> body;
+    body.push_back(ID3V2_ENCODING_ISO8859);
+    append_text(&body, ID3V2_ENCODING_ISO8859, mime_type, true);
+    // Front cover, no description
+    body.push_back(0x03);
+    body.push_back(0);
+    body.insert(body.end(), data, data + size);
+    append_frame(tag, version, "APIC", body);
+}
+
+static bool sniff_id3v2(const uint8_t* header) {
+    return memcmp(header, "ID3", 3) == 0;
+}
+
+static int read_id3v2(int fd, int64_t file_size, TagRegion* region) {
+    uint8_t header[ID3V2_HEADER_SIZE];
+    if (!read_fully(fd, header, sizeof(header), 0)) return AVERROR(EIO);
+    int version = header[3];
+    int flags = header[5];
+    // ID3v2.2 has other frame ids. Unsynchronised tags, extended headers and footers are rare enough to be rewritten
+    if (version < 3 || version > 4 || (flags & 0xF0)) return AVERROR(ENOTSUP);
+
+    int64_t size = ID3V2_HEADER_SIZE + (int64_t)read_syncsafe(header + 6);
+    if (size > std::min(file_size, MAX_TAG_REGION_SIZE)) return AVERROR(ENOTSUP);
+
+    region->original.resize(size);
+    if (!read_fully(fd, region->original.data(), region->original.size(), 0)) return AVERROR(EIO);
+    return 0;
+}
+
+/**
+ * Lays the edited tag out: the frames that stay, in their order, then the new ones.
+ * Frames that stay come first so they don't move on the next edit, which then only rewrites the text
+ */
+static int build_id3v2(const TagRegion& region, const TagEdit& edit, std::vector<uint8_t>* tag) {
+    const auto& original = region.original;
+    int version = original[3];
+    tag->assign(original.begin(), original.begin() + ID3V2_HEADER_SIZE);
+
+    for (size_t position = ID3V2_HEADER_SIZE; position + ID3V2_HEADER_SIZE <= original.size();) {
+        const uint8_t* frame = original.data() + position;
+        // Padding
+        if (frame[0] == 0) break;
+        if (!is_frame_id(frame)) return AVERROR(ENOTSUP);
+
+        uint32_t size = version >= 4 ? read_syncsafe(frame + 4) : AV_RB32(frame + 4);
+        if (position + ID3V2_HEADER_SIZE + size > original.size()) return AVERROR(ENOTSUP);
+
+        bool replaced = is_tag_frame(frame) || (edit.album_art && memcmp(frame, "APIC", 4) == 0);
+        if (!replaced) tag->insert(tag->end(), frame, frame + ID3V2_HEADER_SIZE + size);
+        position += ID3V2_HEADER_SIZE + size;
+    }
+
+    for (const auto& entry : edit.tags) {
+        append_tag(tag, version, entry.first, entry.second);
+    }
+    if (edit.album_art) append_album_art(tag, version, edit.album_art, edit.album_art_size);
+    return 0;
+}
+
+static bool pad_id3v2(std::vector<uint8_t>* tag, size_t size) {
+    if (size < tag->size()) return false;
+    tag->resize(size, 0);
+    write_syncsafe(tag->data() + 6, (uint32_t)(size - ID3V2_HEADER_SIZE));
+    return true;
+}
+
+static const TagFormat ID3V2_FORMAT = {"ID3v2", sniff_id3v2, read_id3v2, build_id3v2, pad_id3v2, true, nullptr};
+
+/////////////////////////////////////////////////////////////////////////////////
+
+//                              VORBIS COMMENTS                                 //
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// The tags of FLAC, Ogg Vorbis and Opus. FFmpeg renames these keys, everything else is its key in upper case
+static const char* const VORBIS_COMMENT_KEYS[][2] = {
+    {"album_artist", "ALBUMARTIST"}, {"track", "TRACKNUMBER"}, {"disc", "DISCNUMBER"}, {"comment", "DESCRIPTION"},
+};
+
+// Album art in Ogg, a base64 FLAC picture block
+static const char* const VORBIS_PICTURE_KEY = "METADATA_BLOCK_PICTURE=";
+
+static bool parse_vorbis_comment(const uint8_t* data, size_t size, std::string* vendor, std::vector<std::string>* comments) {
+    if (size < 4 || AV_RL32(data) > size - 4) return false;
+    size_t position = 4 + AV_RL32(data);
+    vendor->assign(reinterpret_cast<const char*>(data) + 4, position - 4);
+
+    if (position + 4 > size) return false;
+    uint32_t count = AV_RL32(data + position);
+    position += 4;
+    for (uint32_t i = 0; i < count; i++) {
+        if (position + 4 > size || AV_RL32(data + position) > size - position - 4) return false;
+        uint32_t length = AV_RL32(data + position);
+        comments->emplace_back(reinterpret_cast<const char*>(data) + position + 4, length);
+        position += 4 + length;
+    }
+    return true;
+}
+
+static std::vector<uint8_t> build_vorbis_comment(const std::string& vendor, const std::vector<std::string>& comments) {
+    std::vector<uint8_t> data;
+    append_le32(&data, (uint32_t)vendor.size());
+    data.insert(data.end(), vendor.begin(), vendor.end());
+    append_le32(&data, (uint32_t)comments.size());
+    for (const auto& comment : comments) {
+        append_le32(&data, (uint32_t)comment.size());
+        data.insert(data.end(), comment.begin(), comment.end());
+    }
+    return data;
+}
+
+static std::vector<std::string> vorbis_comments(const TagEdit& edit) {
+    std::vector<std::string> comments;
+    for (const auto& entry : edit.tags) {
+        std::string key = entry.first;
+        for (const auto& name : VORBIS_COMMENT_KEYS) {
+            if (strcasecmp(key.c_str(), name[0]) == 0) key = name[1];
+        }
+        std::transform(key.begin(), key.end(), key.begin(), [](char c) { return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c; });
+        comments.push_back(key + "=" + entry.second);
+    }
+    return comments;
+}
+
+/**
+ * The body of a FLAC picture block with the album art as the front cover, sizes left out
+ */
+static std::vector<uint8_t> build_flac_picture(const uint8_t* data, int size) {
+    std::string mime_type = is_png(data, size) ? "image/png" : "image/jpeg";
+    std::vector<uint8_t> picture;
+    append_be32(&picture, 3);
+    append_be32(&picture, (uint32_t)mime_type.size());
+    picture.insert(picture.end(), mime_type.begin(), mime_type.end());
+    // Description, width, height, depth and colors
+    for (int i = 0; i < 5; i++) append_be32(&picture, 0);
+    append_be32(&picture, (uint32_t)size);
+    picture.insert(picture.end(), data, data + size);
+    return picture;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+//                                   FLAC                                       //
+
+/////////////////////////////////////////////////////////////////////////////////
+
+static const int FLAC_BLOCK_HEADER_SIZE = 4;
+static const uint32_t FLAC_MAX_BLOCK_SIZE = 0xFFFFFF;
+
+enum FlacBlockType {
+    FLAC_PADDING = 1,
+    FLAC_VORBIS_COMMENT = 4,
+    FLAC_PICTURE = 6,
+};
+
+static bool sniff_flac(const uint8_t* header) {
+    return memcmp(header, "fLaC", 4) == 0;
+}
+
+/**
+ * The region is the whole metadata: "fLaC" and every block up to the last one
+ */
+static int read_flac(int fd, int64_t file_size, TagRegion* region) {
+    int64_t position = 4;
+    for (bool last = false; !last;) {
+        uint8_t header[FLAC_BLOCK_HEADER_SIZE];
+        if (!read_fully(fd, header, sizeof(header), position)) return AVERROR(ENOTSUP);
+        last = header[0] & 0x80;
+        position += FLAC_BLOCK_HEADER_SIZE + AV_RB24(header + 1);
+        if (position > std::min(file_size, MAX_TAG_REGION_SIZE)) return AVERROR(ENOTSUP);
+    }
+
+    region->original.resize(position);
+    if (!read_fully(fd, region->original.data(), region->original.size(), 0)) return AVERROR(EIO);
+    return 0;
+}
+
+static int append_flac_block(std::vector<uint8_t>* tags, int type, const std::vector<uint8_t>& body) {
+    if (body.size() > FLAC_MAX_BLOCK_SIZE) return AVERROR(ENOTSUP);
+    tags->push_back((uint8_t)type);
+    tags->insert(tags->end(), {(uint8_t)(body.size() >> 16), (uint8_t)(body.size() >> 8), (uint8_t)body.size()});
+    tags->insert(tags->end(), body.begin(), body.end());
+    return 0;
+}
+
+/**
+ * The blocks that stay (stream info, seek table, cue sheet, pictures unless there's new art...) in their order, then
+ * the comments and the new art
+ */
+static int build_flac(const TagRegion& region, const TagEdit& edit, std::vector<uint8_t>* tags) {
+    const auto& original = region.original;
+    tags->assign(original.begin(), original.begin() + 4);
+
+    std::string vendor = LIBAVFORMAT_IDENT;
+    for (size_t position = 4; position < original.size();) {
+        const uint8_t* block = original.data() + position;
+        int type = block[0] & 0x7F;
+        size_t size = FLAC_BLOCK_HEADER_SIZE + AV_RB24(block + 1);
+
+        if (type == FLAC_VORBIS_COMMENT) {
+            std::vector<std::string> comments;
+            parse_vorbis_comment(block + FLAC_BLOCK_HEADER_SIZE, size - FLAC_BLOCK_HEADER_SIZE, &vendor, &comments);
+        } else if (type != FLAC_PADDING && !(type == FLAC_PICTURE && edit.album_art)) {
+            tags->insert(tags->end(), block, block + size);
+            // Only the last block says so, see pad_flac
+            (*tags)[tags->size() - size] &= 0x7F;
+        }
+        position += size;
+    }
+
+    int ret = append_flac_block(tags, FLAC_VORBIS_COMMENT, build_vorbis_comment(vendor, vorbis_comments(edit)));
+    if (ret == 0 && edit.album_art) {
+        ret = append_flac_block(tags, FLAC_PICTURE, build_flac_picture(edit.album_art, edit.album_art_size));
+    }
+    return ret;
+}
+
+static bool pad_flac(std::vector<uint8_t>* tags, size_t size) {
+    if (size != tags->size()) {
+        // A padding block is at least its header
+        if (size < tags->size() + FLAC_BLOCK_HEADER_SIZE) return false;
+        if (append_flac_block(tags, FLAC_PADDING, std::vector<uint8_t>(size - tags->size() - FLAC_BLOCK_HEADER_SIZE)) < 0) return false;
+    }
+
+    size_t last = 4;
+    for (size_t position = 4; position < tags->size(); position += FLAC_BLOCK_HEADER_SIZE + AV_RB24(tags->data() + position + 1)) {
+        last = position;
+    }
+    (*tags)[last] |= 0x80;
+    return true;
+}
+
+static const TagFormat FLAC_FORMAT = {"FLAC", sniff_flac, read_flac, build_flac, pad_flac, true, nullptr};
+
+/////////////////////////////////////////////////////////////////////////////////
+
+//                                   OGG                                        //
+
+/////////////////////////////////////////////////////////////////////////////////
+
+static const int OGG_PAGE_HEADER_SIZE = 27;
+
+enum OggPageFlags {
+    OGG_CONTINUED = 0x01,
+    OGG_FIRST_PAGE = 0x02,
+};
+
+struct OggPage {
+    uint8_t flags;
+    uint32_t serial;
+    int segments;
+    // Lacing values included
+    size_t header_size;
+    size_t size;
+};
+
+/**
+ * @param data At least the page header and its lacing values
+ */
+static bool parse_ogg_page(const uint8_t* data, size_t size, OggPage* page) {
+    if (size < OGG_PAGE_HEADER_SIZE || memcmp(data, "OggS", 4) != 0 || data[4] != 0) return false;
+    page->flags = data[5];
+    page->serial = AV_RL32(data + 14);
+    page->segments = data[26];
+    page->header_size = OGG_PAGE_HEADER_SIZE + page->segments;
+    if (size < page->header_size) return false;
+
+    page->size = page->header_size;
+    for (int i = 0; i < page->segments; i++) page->size += data[OGG_PAGE_HEADER_SIZE + i];
+    return true;
+}
+
+static bool read_ogg_page(int fd, int64_t offset, std::vector<uint8_t>* header, OggPage* page) {
+    header->resize(OGG_PAGE_HEADER_SIZE + 255);
+    if (!read_fully(fd, header->data(), OGG_PAGE_HEADER_SIZE, offset)) return false;
+    int segments = (*header)[26];
+    if (!read_fully(fd, header->data() + OGG_PAGE_HEADER_SIZE, segments, offset + OGG_PAGE_HEADER_SIZE)) return false;
+    return parse_ogg_page(header->data(), OGG_PAGE_HEADER_SIZE + segments, page);
+}
+
+static bool sniff_ogg(const uint8_t* header) {
+    return memcmp(header, "OggS", 4) == 0;
+}
+
+/**
+ * The region is the pages the comment header (the second packet of the first stream) is in. Vorbis and Opus only
+ */
+static int read_ogg(int fd, int64_t file_size, TagRegion* region) {
+    std::vector<uint8_t> header;
+    OggPage page;
+    if (!read_ogg_page(fd, 0, &header, &page) || !(page.flags & OGG_FIRST_PAGE)) return AVERROR(ENOTSUP);
+    uint8_t codec[8];
+    if (page.size < page.header_size + sizeof(codec) || !read_fully(fd, codec, sizeof(codec), page.header_size)) return AVERROR(ENOTSUP);
+    if (memcmp(codec, "\x01vorbis", 7) != 0 && memcmp(codec, "OpusHead", 8) != 0) return AVERROR(ENOTSUP);
+    uint32_t serial = page.serial;
+
+    int64_t start = -1, position = page.size;
+    for (bool complete = false; !complete;) {
+        if (position >= std::min(file_size, MAX_TAG_REGION_SIZE) || !read_ogg_page(fd, position, &header, &page)) {
+            return AVERROR(ENOTSUP);
+        }
+        if (page.serial == serial) {
+            // The identification header is alone on the first page, so the comments start a page
+            if (start < 0 && (page.flags & OGG_CONTINUED)) return AVERROR(ENOTSUP);
+            if (start < 0) start = position;
+            for (int i = 0; i < page.segments; i++) {
+                if (header[OGG_PAGE_HEADER_SIZE + i] < 255) complete = true;
+            }
+        }
+        position += page.size;
+    }
+
+    region->offset = start;
+    region->original.resize(position - start);
+    if (!read_fully(fd, region->original.data(), region->original.size(), start)) return AVERROR(EIO);
+    return 0;
+}
+
+/**
+ * Ogg has no padding for the comments to grow into, but the comment packet can take zeros after the comments. So the
+ * edited packet is padded to the size of the old one, and every page keeps its layout: only the packet's bytes and the
+ * checksums of its pages change
+ */
+static int build_ogg(const TagRegion& region, const TagEdit& edit, std::vector<uint8_t>* tags) {
+    *tags = region.original;
+    uint8_t* data = tags->data();
+    uint32_t serial = AV_RL32(data + 14);
+
+    // Where the bytes of the comment packet are, and the pages they're in
+    std::vector<std::pair<size_t, size_t>> fragments;
+    std::vector<size_t> pages;
+    bool complete = false;
+    for (size_t position = 0; position < tags->size() && !complete;) {
+        OggPage page;
+        if (!parse_ogg_page(data + position, tags->size() - position, &page)) return AVERROR(ENOTSUP);
+        if (page.serial == serial) {
+            pages.push_back(position);
+            size_t offset = position + page.header_size;
+            for (int i = 0; i < page.segments && !complete; i++) {
+                int lacing = data[position + OGG_PAGE_HEADER_SIZE + i];
+                fragments.emplace_back(offset, lacing);
+                offset += lacing;
+                complete = lacing < 255;
+            }
+        }
+        position += page.size;
+    }
+
+    std::vector<uint8_t> packet;
+    for (const auto& fragment : fragments) {
+        packet.insert(packet.end(), data + fragment.first, data + fragment.first + fragment.second);
+    }
+    size_t prefix_size = packet.size() >= 7 && memcmp(packet.data(), "\x03vorbis", 7) == 0 ? 7
+        : packet.size() >= 8 && memcmp(packet.data(), "OpusTags", 8) == 0 ? 8 : 0;
+    if (prefix_size == 0) return AVERROR(ENOTSUP);
+
+    std::string vendor;
+    std::vector<std::string> old_comments;
+    if (!parse_vorbis_comment(packet.data() + prefix_size, packet.size() - prefix_size, &vendor, &old_comments)) {
+        return AVERROR(ENOTSUP);
+    }
+
+    std::vector<std::string> comments = vorbis_comments(edit);
+    if (edit.album_art) {
+        std::vector<uint8_t> picture = build_flac_picture(edit.album_art, edit.album_art_size);
+        std::string encoded(AV_BASE64_SIZE(picture.size()), '\0');
+        av_base64_encode(&encoded[0], (int)encoded.size(), picture.data(), (int)picture.size());
+        encoded.resize(strlen(encoded.c_str()));
+        comments.push_back(VORBIS_PICTURE_KEY + encoded);
+    } else {
+        for (const auto& comment : old_comments) {
+            if (strncasecmp(comment.c_str(), VORBIS_PICTURE_KEY, strlen(VORBIS_PICTURE_KEY)) == 0) comments.push_back(comment);
+        }
+    }
+
+    std::vector<uint8_t> updated(packet.begin(), packet.begin() + prefix_size);
+    std::vector<uint8_t> comment = build_vorbis_comment(vendor, comments);
+    updated.insert(updated.end(), comment.begin(), comment.end());
+    // Vorbis ends its headers with a framing bit
+    if (prefix_size == 7) updated.push_back(1);
+    if (updated.size() > packet.size()) return AVERROR(ENOSPC);
+    updated.resize(packet.size(), 0);
+
+    size_t done = 0;
+    for (const auto& fragment : fragments) {
+        memcpy(data + fragment.first, updated.data() + done, fragment.second);
+        done += fragment.second;
+    }
+    for (size_t position : pages) {
+        OggPage page;
+        parse_ogg_page(data + position, tags->size() - position, &page);
+        AV_WL32(data + position + 22, 0);
+        AV_WL32(data + position + 22, av_crc(av_crc_get_table(AV_CRC_32_IEEE), 0, data + position, page.size));
+    }
+    return 0;
+}
+
+static bool pad_ogg(std::vector<uint8_t>* tags, size_t size) {
+    return tags->size() == size;
+}
+
+static const TagFormat OGG_FORMAT = {"Ogg", sniff_ogg, read_ogg, build_ogg, pad_ogg, false, nullptr};
+
+/////////////////////////////////////////////////////////////////////////////////
+
+//                                   MP4                                        //
+
+/////////////////////////////////////////////////////////////////////////////////
+
+static const int MP4_ATOM_HEADER_SIZE = 8;
+
+enum Mp4ItemKind {
+    MP4_TEXT,
+    // A byte
+    MP4_INT8,
+    MP4_INT32,
+    // Number and total, track and disc
+    MP4_NUMBER_PAIR,
+};
+
+// Well-known types of the data atoms of items
+enum Mp4DataType {
+    MP4_DATA_IMPLICIT = 0,
+    MP4_DATA_UTF8 = 1,
+    MP4_DATA_JPEG = 13,
+    MP4_DATA_PNG = 14,
+    MP4_DATA_INTEGER = 21,
+};
+
+struct Mp4Item {
+    const char* key;
+    // \251 is the © that starts most of them
+    const char* type;
+    int kind;
+};
+
+// FFmpeg's keys of the ilst items, as FFmpeg reads and writes them
+static const Mp4Item MP4_ITEMS[] = {
+    {"title", "\251nam", MP4_TEXT}, {"artist", "\251ART", MP4_TEXT}, {"album_artist", "aART", MP4_TEXT},
+    {"album", "\251alb", MP4_TEXT}, {"composer", "\251wrt", MP4_TEXT}, {"date", "\251day", MP4_TEXT},
+    {"encoder", "\251too", MP4_TEXT}, {"comment", "\251cmt", MP4_TEXT}, {"genre", "\251gen", MP4_TEXT},
+    {"copyright", "cprt", MP4_TEXT}, {"grouping", "\251grp", MP4_TEXT}, {"lyrics", "\251lyr", MP4_TEXT},
+    {"description", "desc", MP4_TEXT}, {"synopsis", "ldes", MP4_TEXT}, {"show", "tvsh", MP4_TEXT},
+    {"episode_id", "tven", MP4_TEXT}, {"network", "tvnn", MP4_TEXT}, {"keywords", "keyw", MP4_TEXT},
+    {"sort_name", "sonm", MP4_TEXT}, {"sort_artist", "soar", MP4_TEXT}, {"sort_album_artist", "soaa", MP4_TEXT},
+    {"sort_album", "soal", MP4_TEXT}, {"sort_composer", "soco", MP4_TEXT}, {"sort_show", "sosn", MP4_TEXT},
+    {"purchase_date", "purd", MP4_TEXT}, {"track", "trkn", MP4_NUMBER_PAIR}, {"disc", "disk", MP4_NUMBER_PAIR},
+    {"compilation", "cpil", MP4_INT8}, {"gapless_playback", "pgap", MP4_INT8}, {"podcast", "pcst", MP4_INT8},
+    {"media_type", "stik", MP4_INT8}, {"hd_video", "hdvd", MP4_INT8}, {"rating", "rtng", MP4_INT8},
+    {"season_number", "tvsn", MP4_INT32}, {"episode_sort", "tves", MP4_INT32},
+};
+
+// Other items FFmpeg reads into its metadata, so an edit replaces them too
+static const char* const MP4_READ_ITEMS[] = {"gnre", "egid", "FIRM", "manu", "modl", "----"};
+
+// What FFmpeg reports of the file itself (ftyp, mvhd) rather than its tags
+static const char* const MP4_FILE_KEYS[] = {"major_brand", "minor_version", "compatible_brands", "creation_time"};
+
+struct Mp4Atom {
+    const uint8_t* type;
+    size_t offset;
+    size_t header_size;
+    size_t size;
+};
+
+static bool parse_mp4_atoms(const uint8_t* data, size_t size, std::vector<Mp4Atom>* atoms) {
+    for (size_t position = 0; position < size;) {
+        if (size - position < MP4_ATOM_HEADER_SIZE) return false;
+        Mp4Atom atom = {data + position + 4, position, MP4_ATOM_HEADER_SIZE, AV_RB32(data + position)};
+        if (atom.size == 1) {
+            if (size - position < 16) return false;
+            atom.header_size = 16;
+            atom.size = AV_RB64(data + position + 8);
+        } else if (atom.size == 0) {
+            atom.size = size - position;
+        }
+        if (atom.size < atom.header_size || atom.size > size - position) return false;
+        atoms->push_back(atom);
+        position += atom.size;
+    }
+    return true;
+}
+
+static void append_atom(std::vector<uint8_t>* data, const char* type, const std::vector<uint8_t>& body) {
+    append_be32(data, (uint32_t)(MP4_ATOM_HEADER_SIZE + body.size()));
+    data->insert(data->end(), type, type + 4);
+    data->insert(data->end(), body.begin(), body.end());
+}
+
+static void append_data_atom(std::vector<uint8_t>* item, uint32_t type, const uint8_t* value, size_t size) {
+    std::vector<uint8_t> body;
+    append_be32(&body, type);
+    // Locale
+    append_be32(&body, 0);
+    body.insert(body.end(), value, value + size);
+    append_atom(item, "data", body);
+}
+
+/**
+ * Adds the item FFmpeg would read back as this key and value, a freeform one for keys that have none
+ */
+static void append_item(std::vector<uint8_t>* ilst, const std::string& key, const std::string& value) {
+    for (const char* file_key : MP4_FILE_KEYS) {
+        if (strcasecmp(key.c_str(), file_key) == 0) return;
+    }
+
+    const Mp4Item* known = nullptr;
+    for (const auto& item : MP4_ITEMS) {
+        if (strcasecmp(key.c_str(), item.key) == 0) known = &item;
+    }
+
+    std::vector<uint8_t> item;
+    if (!known) {
+        std::vector<uint8_t> mean = {0, 0, 0, 0}, name = {0, 0, 0, 0};
+        const std::string domain = "com.apple.iTunes";
+        mean.insert(mean.end(), domain.begin(), domain.end());
+        name.insert(name.end(), key.begin(), key.end());
+        append_atom(&item, "mean", mean);
+        append_atom(&item, "name", name);
+        append_data_atom(&item, MP4_DATA_UTF8, reinterpret_cast<const uint8_t*>(value.data()), value.size());
+        append_atom(ilst, "----", item);
+        return;
+    }
+
+    std::vector<uint8_t> number;
+    switch (known->kind) {
+        case MP4_TEXT:
+            append_data_atom(&item, MP4_DATA_UTF8, reinterpret_cast<const uint8_t*>(value.data()), value.size());
+            break;
+        case MP4_INT8:
+            number.push_back((uint8_t)atoi(value.c_str()));
+            append_data_atom(&item, MP4_DATA_INTEGER, number.data(), number.size());
+            break;
+        case MP4_INT32:
+            append_be32(&number, (uint32_t)atoi(value.c_str()));
+            append_data_atom(&item, MP4_DATA_INTEGER, number.data(), number.size());
+            break;
+        case MP4_NUMBER_PAIR: {
+            int current = 0, total = 0;
+            sscanf(value.c_str(), "%d/%d", &current, &total);
+            number = {0, 0, (uint8_t)(current >> 8), (uint8_t)current, (uint8_t)(total >> 8), (uint8_t)total};
+            // trkn has two more bytes than disk
+            if (strcmp(known->type, "trkn") == 0) number.insert(number.end(), {0, 0});
+            append_data_atom(&item, MP4_DATA_IMPLICIT, number.data(), number.size());
+            break;
+        }
+        default:
+            break;
+    }
+    append_atom(ilst, known->type, item);
+}
+
+/**
+ * Items FFmpeg reads into its metadata, which an edit replaces. Everything else (album art, store ids...) stays
+ */
+static bool is_tag_item(const uint8_t* type) {
+    if (type[0] == 0xA9) return true;
+    for (const auto& item : MP4_ITEMS) {
+        if (memcmp(type, item.type, 4) == 0) return true;
+    }
+    for (const char* item : MP4_READ_ITEMS) {
+        if (memcmp(type, item, 4) == 0) return true;
+    }
+    return false;
+}
+
+static bool build_ilst(const uint8_t* data, size_t size, const TagEdit& edit, std::vector<uint8_t>* ilst) {
+    std::vector<Mp4Atom> items;
+    if (!parse_mp4_atoms(data, size, &items)) return false;
+    for (const auto& item : items) {
+        bool replaced = is_tag_item(item.type) || (edit.album_art && memcmp(item.type, "covr", 4) == 0);
+        if (!replaced) ilst->insert(ilst->end(), data + item.offset, data + item.offset + item.size);
+    }
+
+    for (const auto& entry : edit.tags) {
+        append_item(ilst, entry.first, entry.second);
+    }
+    if (edit.album_art) {
+        std::vector<uint8_t> item;
+        append_data_atom(&item, is_png(edit.album_art, edit.album_art_size) ? MP4_DATA_PNG : MP4_DATA_JPEG,
+                         edit.album_art, edit.album_art_size);
+        append_atom(ilst, "covr", item);
+    }
+    return true;
+}
+
+/**
+ * The meta atom of iTunes-style tags: a handler, then the ilst. Free atoms in it go, the padding is after the moov
+ */
+static bool build_meta(const uint8_t* data, size_t size, const TagEdit& edit, std::vector<uint8_t>* meta) {
+    // A new one, version and flags only
+    static const uint8_t EMPTY_META[4] = {};
+    if (!data) {
+        data = EMPTY_META;
+        size = sizeof(EMPTY_META);
+    }
+    // It's a full atom, with a version and flags. QuickTime's isn't
+    size_t header_size = size >= 8 && memcmp(data + 4, "hdlr", 4) == 0 ? 0 : 4;
+    if (size < header_size) return false;
+    meta->assign(data, data + header_size);
+
+    std::vector<Mp4Atom> children;
+    if (!parse_mp4_atoms(data + header_size, size - header_size, &children)) return false;
+    bool has_handler = false, has_ilst = false;
+    for (const auto& child : children) {
+        const uint8_t* atom = data + header_size + child.offset;
+        if (memcmp(child.type, "hdlr", 4) == 0) has_handler = true;
+        if (memcmp(child.type, "ilst", 4) == 0) {
+            std::vector<uint8_t> ilst;
+            if (!build_ilst(atom + child.header_size, child.size - child.header_size, edit, &ilst)) return false;
+            append_atom(meta, "ilst", ilst);
+            has_ilst = true;
+        } else if (memcmp(child.type, "free", 4) != 0 && memcmp(child.type, "skip", 4) != 0) {
+            meta->insert(meta->end(), atom, atom + child.size);
+        }
+    }
+
+    if (!has_handler) {
+        // Version and flags, pre-defined, "mdir" handler from "appl", reserved, empty name
+        std::vector<uint8_t> handler(8, 0);
+        const char* type = "mdirappl";
+        handler.insert(handler.end(), type, type + 8);
+        handler.resize(handler.size() + 9, 0);
+        std::vector<uint8_t> atom;
+        append_atom(&atom, "hdlr", handler);
+        meta->insert(meta->begin() + header_size, atom.begin(), atom.end());
+    }
+    if (!has_ilst) {
+        std::vector<uint8_t> ilst;
+        build_ilst(nullptr, 0, edit, &ilst);
+        append_atom(meta, "ilst", ilst);
+    }
+    return true;
+}
+
+static bool build_udta(const uint8_t* data, size_t size, const TagEdit& edit, std::vector<uint8_t>* udta) {
+    std::vector<Mp4Atom> children;
+    if (!parse_mp4_atoms(data, size, &children)) return false;
+    bool has_meta = false;
+    for (const auto& child : children) {
+        const uint8_t* atom = data + child.offset;
+        if (memcmp(child.type, "meta", 4) == 0 && !has_meta) {
+            std::vector<uint8_t> meta;
+            if (!build_meta(atom + child.header_size, child.size - child.header_size, edit, &meta)) return false;
+            append_atom(udta, "meta", meta);
+            has_meta = true;
+        } else if (memcmp(child.type, "free", 4) != 0 && memcmp(child.type, "skip", 4) != 0) {
+            udta->insert(udta->end(), atom, atom + child.size);
+        }
+    }
+
+    if (!has_meta) {
+        std::vector<uint8_t> meta;
+        build_meta(nullptr, 0, edit, &meta);
+        append_atom(udta, "meta", meta);
+    }
+    return true;
+}
+
+static bool sniff_mp4(const uint8_t* header) {
+    return memcmp(header + 4, "ftyp", 4) == 0;
+}
+
+static bool is_free_atom(const uint8_t* type) {
+    return memcmp(type, "free", 4) == 0 || memcmp(type, "skip", 4) == 0;
+}
+
+/**
+ * The region is the moov atom and the free atoms right after it
+ */
+static int read_mp4(int fd, int64_t file_size, TagRegion* region) {
+    int64_t start = -1, end = -1;
+    for (int64_t position = 0; position + MP4_ATOM_HEADER_SIZE <= file_size;) {
+        uint8_t header[16];
+        if (!read_fully(fd, header, MP4_ATOM_HEADER_SIZE, position)) return AVERROR(EIO);
+        uint64_t size = AV_RB32(header);
+        if (size == 1) {
+            if (!read_fully(fd, header + 8, 8, position + 8)) return AVERROR(ENOTSUP);
+            size = AV_RB64(header + 8);
+        } else if (size == 0) {
+            size = file_size - position;
+        }
+        if (size < MP4_ATOM_HEADER_SIZE || size > (uint64_t)(file_size - position)) return AVERROR(ENOTSUP);
+
+        if (start < 0 && memcmp(header + 4, "moov", 4) == 0) {
+            // A moov with a 64 bit size would be a very odd one
+            if (AV_RB32(header) == 1) return AVERROR(ENOTSUP);
+            start = position;
+            end = position + size;
+        } else if (start >= 0 && position == end && is_free_atom(header + 4)) {
+            end += size;
+        } else if (start >= 0) {
+            break;
+        }
+        position += size;
+    }
+    if (start < 0 || end - start > MAX_TAG_REGION_SIZE) return AVERROR(ENOTSUP);
+
+    region->offset = start;
+    region->at_end = end == file_size;
+    region->original.resize(end - start);
+    if (!read_fully(fd, region->original.data(), region->original.size(), start)) return AVERROR(EIO);
+    return 0;
+}
+
+/**
+ * The moov with its udta/meta/ilst rebuilt, everything else in it (tracks, sample tables...) as it was
+ */
+static int build_mp4(const TagRegion& region, const TagEdit& edit, std::vector<uint8_t>* tags) {
+    const uint8_t* moov = region.original.data();
+    size_t moov_size = AV_RB32(moov);
+
+    std::vector<Mp4Atom> children;
+    if (!parse_mp4_atoms(moov + MP4_ATOM_HEADER_SIZE, moov_size - MP4_ATOM_HEADER_SIZE, &children)) return AVERROR(ENOTSUP);
+    std::vector<uint8_t> body;
+    bool has_udta = false;
+    for (const auto& child : children) {
+        const uint8_t* atom = moov + MP4_ATOM_HEADER_SIZE + child.offset;
+        if (memcmp(child.type, "udta", 4) == 0 && !has_udta) {
+            std::vector<uint8_t> udta;
+            if (!build_udta(atom + child.header_size, child.size - child.header_size, edit, &udta)) return AVERROR(ENOTSUP);
+            append_atom(&body, "udta", udta);
+            has_udta = true;
+        } else {
+            body.insert(body.end(), atom, atom + child.size);
+        }
+    }
+    if (!has_udta) {
+        std::vector<uint8_t> udta;
+        build_udta(nullptr, 0, edit, &udta);
+        append_atom(&body, "udta", udta);
+    }
+
+    tags->clear();
+    append_atom(tags, "moov", body);
+    return 0;
+}
+
+static bool pad_mp4(std::vector<uint8_t>* tags, size_t size) {
+    if (size == tags->size()) return true;
+    if (size < tags->size() + MP4_ATOM_HEADER_SIZE) return false;
+    append_atom(tags, "free", std::vector<uint8_t>(size - tags->size() - MP4_ATOM_HEADER_SIZE));
+    return true;
+}
+
+/**
+ * Patches the chunk offsets (stco, co64) of every track
+ */
+static int move_chunks(uint8_t* data, size_t size, int64_t end, int64_t delta) {
+    std::vector<Mp4Atom> children;
+    if (!parse_mp4_atoms(data, size, &children)) return AVERROR(ENOTSUP);
+    for (const auto& child : children) {
+        uint8_t* atom = data + child.offset + child.header_size;
+        size_t atom_size = child.size - child.header_size;
+        // Fragments have offsets of their own
+        if (memcmp(child.type, "mvex", 4) == 0) return AVERROR(ENOTSUP);
+
+        if (memcmp(child.type, "trak", 4) == 0 || memcmp(child.type, "mdia", 4) == 0 ||
+            memcmp(child.type, "minf", 4) == 0 || memcmp(child.type, "stbl", 4) == 0) {
+            int ret = move_chunks(atom, atom_size, end, delta);
+            if (ret < 0) return ret;
+        } else if (memcmp(child.type, "stco", 4) == 0 || memcmp(child.type, "co64", 4) == 0) {
+            int entry_size = child.type[1] == 't' ? 4 : 8;
+            // Version and flags, then the count
+            if (atom_size < 8 || AV_RB32(atom + 4) > (atom_size - 8) / entry_size) return AVERROR(ENOTSUP);
+            uint32_t count = AV_RB32(atom + 4);
+            for (uint32_t i = 0; i < count; i++) {
+                uint8_t* entry = atom + 8 + (size_t)i * entry_size;
+                int64_t offset = entry_size == 4 ? AV_RB32(entry) : (int64_t)AV_RB64(entry);
+                if (offset < end) continue;
+                offset += delta;
+                // It would take turning the stco into a co64
+                if (entry_size == 4 && offset > UINT32_MAX) return AVERROR(ENOTSUP);
+                if (entry_size == 4) AV_WB32(entry, (uint32_t)offset); else AV_WB64(entry, (uint64_t)offset);
+            }
+        }
+    }
+    return 0;
+}
+
+static int move_mp4(std::vector<uint8_t>* tags, int64_t end, int64_t delta) {
+    size_t moov_size = AV_RB32(tags->data());
+    return move_chunks(tags->data() + MP4_ATOM_HEADER_SIZE, moov_size - MP4_ATOM_HEADER_SIZE, end, delta);
+}
+
+static const TagFormat MP4_FORMAT = {"MP4", sniff_mp4, read_mp4, build_mp4, pad_mp4, true, move_mp4};
+
+/////////////////////////////////////////////////////////////////////////////////
+
+static const TagFormat* const TAG_FORMATS[] = {&ID3V2_FORMAT, &FLAC_FORMAT, &OGG_FORMAT, &MP4_FORMAT};
+
+static const TagFormat* find_tag_format(int fd) {
+    uint8_t header[SNIFF_SIZE];
+    if (!read_fully(fd, header, sizeof(header), 0)) return nullptr;
+    for (const TagFormat* format : TAG_FORMATS) {
+        if (format->sniff(header)) return format;
+    }
+    return nullptr;
+}
+
+static int64_t file_size(int fd) {
+    struct stat info;
+    return fstat(fd, &info) < 0 ? AVERROR(errno) : (int64_t)info.st_size;
+}
+
+int edit_tags_in_place(const char* path, const TagEdit& edit) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return AVERROR(errno);
+
+    const TagFormat* format = find_tag_format(fd);
+    int64_t size = file_size(fd);
+    TagRegion region;
+    std::vector<uint8_t> tags;
+    int64_t written = 0;
+    int ret = !format ? AVERROR(ENOTSUP) : size < 0 ? (int)size : format->read(fd, size, &region);
+    if (ret == 0) ret = format->build(region, edit, &tags);
+
+    if (ret == 0 && tags.size() <= region.original.size() && format->pad(&tags, region.original.size())) {
+        written = write_changes(fd, region.original, tags, region.offset);
+    } else if (ret == 0 && region.at_end) {
+        // Nothing after the tags to move out of the way, they grow into the end of the file
+        if (!format->pad(&tags, tags.size() + tag_padding())) format->pad(&tags, tags.size());
+        written = (int64_t)tags.size();
+        for (size_t done = 0; done < tags.size() && written >= 0;) {
+            ssize_t count = pwrite64(fd, tags.data() + done, tags.size() - done, region.offset + done);
+            if (count < 0 && errno != EINTR) written = AVERROR(errno);
+            if (count > 0) done += count;
+        }
+        if (written >= 0 && ftruncate64(fd, region.offset + tags.size()) < 0) written = AVERROR(errno);
+    } else if (ret == 0) {
+        ret = AVERROR(ENOSPC);
+    }
+    if (written < 0) ret = (int)written;
+    close(fd);
+
+    if (ret == 0) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Edited the %s tags of %s in place, %lld bytes written", format->name, path, (long long)written);
+    }
+    return ret;
+}
+
+int rewrite_tags(const char* path, const TagEdit& edit) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return AVERROR(errno);
+
+    const TagFormat* format = find_tag_format(fd);
+    struct stat info;
+    int64_t size = fstat(fd, &info) < 0 ? AVERROR(errno) : (int64_t)info.st_size;
+    TagRegion region;
+    std::vector<uint8_t> tags;
+    int ret = !format || !format->rewritable ? AVERROR(ENOTSUP) : size < 0 ? (int)size : format->read(fd, size, &region);
+    if (ret == 0) ret = format->build(region, edit, &tags);
+
+    if (ret == 0) {
+        // Padding that moves the rest of the file by whole blocks, so copy_to_output_io can share them rather than copy
+        int64_t block = info.st_blksize > 0 ? info.st_blksize : 4096;
+        int64_t padded = (int64_t)tags.size() + tag_padding();
+        padded += (((int64_t)region.original.size() - padded) % block + block) % block;
+        if (!format->pad(&tags, padded) && !format->pad(&tags, padded + block)) format->pad(&tags, tags.size());
+    }
+
+    int64_t end = region.offset + (int64_t)region.original.size();
+    int64_t delta = (int64_t)tags.size() - (int64_t)region.original.size();
+    if (ret == 0 && format->move) ret = format->move(&tags, end, delta);
+
+    AVIOContext* output = ret == 0 ? open_output_io(path, size + delta) : nullptr;
+    if (ret == 0 && !output) ret = AVERROR(EIO);
+    if (ret == 0) {
+        // What's before the tags, the tags, then everything after them as it is
+        ret = copy_to_output_io(output, fd, 0, region.offset);
+        if (ret == 0) {
+            avio_write(output, tags.data(), (int)tags.size());
+            ret = output->error;
+        }
+        if (ret == 0) ret = copy_to_output_io(output, fd, end, size - end);
+        int closed = free_custom_io(&output, ret < 0);
+        if (ret == 0) ret = closed;
+    }
+    close(fd);
+
+    if (ret == 0) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Rewrote %s around its %s tags, %lld bytes of them, the rest of the file moved by %lld",
+                            path, format->name, (long long)tags.size(), (long long)delta);
+    }
+    return ret;
+}
+
+void set_tag_padding(int bytes) {
+    padding = std::max(0, bytes);
+}
+
+int tag_padding() {
+    return padding.load();
+}
@@ -0,0 +1,47 @@
+#ifndef MP3FY_TAGEDITOR_H
+#define MP3FY_TAGEDITOR_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+/**
+ * New tags for a file, see edit_tags_in_place
+ */
+struct TagEdit {
+    // With FFmpeg's keys (title, artist, track...), they replace every tag the file has
+    std::map<std::string, std::string> tags;
+    // New front cover (JPEG or PNG), null to keep the album art there is
+    const uint8_t* album_art = nullptr;
+    int album_art_size = 0;
+};
+
+/**
+ * Rewrites the tags of a file where they are, without touching the audio: ID3v2 (MP3), FLAC metadata blocks, the
+ * comment header of Ogg Vorbis and Opus, and the ilst of MP4/M4A. This works when the new tags fit in the space the old
+ * ones take, padding included (free atoms after the moov for MP4), and only the bytes that changed are written. The moov
+ * of an MP4 can also grow where it is when it's last in the file
+ * @return 0 on success, AVERROR(ENOSPC) if the new tags don't fit, AVERROR(ENOTSUP) if the file has no tags this can
+ * edit, another negative AVERROR on failure. The file is left as it was unless it's 0 or a write failed
+ */
+int edit_tags_in_place(const char* path, const TagEdit& edit);
+
+/**
+ * For tags that don't fit in place: writes the file again with the new tags (and padding for the next edit), the rest
+ * of it copied byte for byte by the kernel (see copy_to_output_io) rather than remuxed. MP3 (ID3v2), FLAC and MP4: the
+ * moov of an MP4 grows where it is and the chunk offsets of its tracks move along with the media after it. The padding
+ * moves the rest of the file by whole blocks, so file systems with reflinks share it instead of copying it.
+ * The new file replaces the old once complete, see open_output_io
+ * @return 0 on success, AVERROR(ENOTSUP) if the file can't be rewritten this way, another negative AVERROR on failure
+ */
+int rewrite_tags(const char* path, const TagEdit& edit);
+
+/**
+ * Sets how many bytes of padding MP3 and FLAC outputs get after their tags (4KB by default), so later edits fit in
+ * place. Rewritten tags get at least as much
+ */
+void set_tag_padding(int bytes);
+
+int tag_padding();
+
+#endif //MP3FY_TAGEDITOR_H
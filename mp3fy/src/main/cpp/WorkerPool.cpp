@@ -0,0 +1,73 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <thread>
+
+WorkerPool::WorkerPool(int concurrency) : limit(std::max(1, concurrency)) {}
+
+WorkerPool::~WorkerPool() {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+    tasks.clear();
+    available.notify_all();
+    stopped.wait(lock, [&] { return threads == 0; });
+}
+
+void WorkerPool::submit(int64_t id, std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.emplace_back(id, std::move(task));
+
+    // Idle threads pick the task up, start a new one only when all of them are busy
+    if (threads - busy < (int)tasks.size() && threads < limit) {
+        threads++;
+        std::thread(&WorkerPool::work, this).detach();
+    } else {
+        available.notify_one();
+    }
+}
+
+bool WorkerPool::cancel(int64_t id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto task = std::find_if(tasks.begin(), tasks.end(), [&](const std::pair<int64_t, std::function<void()>>& queued) {
+        return queued.first == id;
+    });
+    if (task == tasks.end()) return false;
+    tasks.erase(task);
+    return true;
+}
+
+void WorkerPool::set_concurrency(int concurrency) {
+    std::lock_guard<std::mutex> lock(mutex);
+    limit = std::max(1, concurrency);
+
+    // Raising the limit has to get the queued tasks going right away
+    while (threads - busy < (int)tasks.size() && threads < limit) {
+        threads++;
+        std::thread(&WorkerPool::work, this).detach();
+    }
+    available.notify_all();
+}
+
+int WorkerPool::concurrency() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return limit;
+}
+
+void WorkerPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        available.wait(lock, [&] { return stopping || threads > limit || !tasks.empty(); });
+        if (stopping || threads > limit) break;
+
+        std::function<void()> task = std::move(tasks.front().second);
+        tasks.pop_front();
+        busy++;
+        lock.unlock();
+        task();
+        lock.lock();
+        busy--;
+    }
+
+    threads--;
+    if (threads == 0) stopped.notify_all();
+}
@@ -0,0 +1,55 @@
+#ifndef MP3FY_WORKERPOOL_H
+#define MP3FY_WORKERPOOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+/**
+ * Runs queued tasks on at most concurrency() threads at a time, in the order they were submitted.
+ *
+ * Threads are started when there is work for them and stay around waiting for more, so the pool never holds more
+ * threads than the limit. Lowering the limit lets the extra threads finish their current task and then exit.
+ * Every task carries an id, which lets a task still waiting in the queue be cancelled.
+ */
+class WorkerPool {
+public:
+    explicit WorkerPool(int concurrency);
+
+    /**
+     * Drops the tasks that have not started yet and waits for the running ones
+     */
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void submit(int64_t id, std::function<void()> task);
+
+    /**
+     * Removes the task with this id from the queue
+     * @return false if the task has already started (or never was submitted)
+     */
+    bool cancel(int64_t id);
+
+    void set_concurrency(int concurrency);
+    int concurrency();
+
+private:
+    void work();
+
+    std::mutex mutex;
+    std::condition_variable available;
+    std::condition_variable stopped;
+    std::deque<std::pair<int64_t, std::function<void()>>> tasks;
+    int limit;
+    // Threads alive, and how many of them are running a task
+    int threads = 0;
+    int busy = 0;
+    bool stopping = false;
+};
+
+#endif //MP3FY_WORKERPOOL_H
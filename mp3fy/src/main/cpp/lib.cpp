@@ -1,26 +1,81 @@
 #include <jni.h>
 #include <string>
+#include <android/bitmap.h>
 #include <android/log.h>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavutil/avutil.h>
 #include <libavformat/avformat.h>
-#include <libavutil/audio_fifo.h>
+#include <libavutil/intreadwrite.h>
 }
 
 #include <iostream>
 #include <map>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
 #include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 
+#include "CustomIo.h"
+#include "AlbumArt.h"
+#include "CodecLock.h"
+#include "AsyncIo.h"
+#include "InputFile.h"
+#include "MetadataCache.h"
+#include "OutputCodec.h"
+#include "OutputFile.h"
+#include "Resampler.h"
+#include "SampleRing.h"
+#include "SpscQueue.h"
+#include "TagEditor.h"
+#include "WorkerPool.h"
+
+// Bitrate modes, these have to match the BITRATE_MODE_* constants in EncodingProfile.java
+enum BitrateMode {
+    BITRATE_MODE_CBR = 0,
+    BITRATE_MODE_VBR = 1,
+    BITRATE_MODE_ABR = 2,
+};
+
+// Encoder speed tiers, these have to match the SPEED_TIER_* constants in EncodingProfile.java.
+// Every output codec maps them to its own compression level, see OutputCodec::speed_levels
+enum SpeedTier {
+    SPEED_TIER_DEFAULT = -1,
+    SPEED_TIER_BEST = 0,
+    SPEED_TIER_STANDARD = 1,
+    SPEED_TIER_FAST = 2,
+};
+
+/**
+ * What the output audio should look like. Zero values keep whatever the input (or the encoder) defaults to
+ */
+struct EncodingProfile {
+    int sample_rate = 0;
+    int channels = 0;
+    int resample_quality = RESAMPLE_QUALITY_DEFAULT;
+    int bitrate_mode = BITRATE_MODE_CBR;
+    // In bits per second, the target for CBR and the average for ABR
+    int bitrate = 0;
+    // 0 (best) to 9 (smallest), only used for VBR
+    int vbr_quality = 4;
+    int speed_tier = SPEED_TIER_DEFAULT;
+};
+
 struct Media {
     AVPacket* encoder_packet = av_packet_alloc();
     AVPacket* decoder_packet = av_packet_alloc();
     AVFrame* frame = av_frame_alloc();
-    AVAudioFifo* buffer;
+    SampleRing* buffer = nullptr;
+    // A decoded frame that goes to the encoder as it is, see push_samples
+    AVFrame* passthrough_frame = av_frame_alloc();
     AVFrame* output_frame = nullptr;
     AVFormatContext* input_format_context = nullptr;
     AVFormatContext* output_format_context = nullptr;
@@ -31,50 +86,111 @@ struct Media {
     int audio_stream_index;
     AVCodec* encoder = nullptr;
     AVCodecContext* encoder_context = nullptr;
-    int percentage = 0;
+    // Read from other threads while converting, see getPercentageNative
+    std::atomic<int> percentage{0};
+    std::string input_url;
+    // Descriptor the input is read from when it wasn't opened by path, -1 otherwise. Owned by the Java side
+    int input_fd = -1;
+    // Path of the output, empty when it goes to memory or a stream
+    std::string output_url;
+    // What the output was written into when it goes to memory, see ConversionSession.getOutput()
+    std::shared_ptr<std::vector<uint8_t>> output_memory;
+    // True when the input audio goes into the output untouched, there is no encoder then
+    bool stream_copy = false;
+    EncodingProfile profile;
+    const OutputCodec* output_codec = nullptr;
+    // Timestamp of the next frame going into the encoder, in samples
+    int64_t next_pts = 0;
+    // Converts decoded samples to the encoder format, rate and layout. Null when the decoder output already fits
+    Resampler* resampler = nullptr;
+    // Most threads this conversion should keep busy, 0 for as many as there are cores
+    unsigned thread_budget = 0;
+    // Part of the input to convert, in AV_TIME_BASE units from the start of the file. AV_NOPTS_VALUE for no limit
+    int64_t range_start = AV_NOPTS_VALUE;
+    int64_t range_end = AV_NOPTS_VALUE;
+    // The same range in decoded samples, and the position of the next decoded sample. Set up by seek_to_range
+    int64_t trim_start = 0;
+    int64_t trim_end = -1;
+    int64_t decoded_position = AV_NOPTS_VALUE;
+    // Set once the decoder got past the end of the range, read by the demuxer thread in the pipelined mode
+    std::atomic<bool> range_done{false};
 };
 
-static Media* open_input_file(const char* url) {
+// Conversion modes, these have to match the CONVERSION_MODE_* constants in MP3fy.java
+enum ConversionMode {
+    CONVERSION_MODE_SERIAL = 0,
+    CONVERSION_MODE_PIPELINED = 1,
+    CONVERSION_MODE_SEGMENTED = 2,
+};
+
+/**
+ * Tells the demuxer to skip every stream we are not going to use, so containers that support it (MP4, MKV, ...)
+ * don't even read those samples from disk.
+ * @param audio_stream_index The audio stream to keep
+ * @param keep_attached_pic Whether the attached picture (album art) stream should be kept as well
+ */
+static void discard_unused_streams(AVFormatContext* context, int audio_stream_index, bool keep_attached_pic) {
+    for (unsigned int i = 0; i < context->nb_streams; i++) {
+        AVStream* stream = context->streams[i];
+        if (i == (unsigned int)audio_stream_index) continue;
+        if (keep_attached_pic && (stream->disposition & AV_DISPOSITION_ATTACHED_PIC)) continue;
+        stream->discard = AVDISCARD_ALL;
+    }
+}
+
+/**
+ * Opens the input, from url or from fd if it isn't -1 (see open_input), and its decoder.
+ * With an io_context, the input is read from it instead and url only helps probing (see open_input_io)
+ */
+static Media* open_input_file(const char* url, int fd = -1, AVIOContext* io_context = nullptr) {
     AVFormatContext* context = nullptr;
-    if (avformat_open_input(&context, url, nullptr, nullptr) < 0)
+    if ((io_context ? open_input_io(&context, io_context, url) : open_input(&context, url, fd)) < 0)
         return nullptr;
 
-    if (avformat_find_stream_info(context, nullptr) < 0)
+    if (find_stream_info(context) < 0) {
+        close_input(&context);
         return nullptr;
+    }
 
     // Find the audio stream here
     int audio_stream_index = av_find_best_stream(context, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
 
     if (audio_stream_index < 0) {
-        av_free(context);
+        close_input(&context);
         return nullptr;
     }
 
     AVStream* audio_stream = context->streams[audio_stream_index];
 
+    discard_unused_streams(context, audio_stream_index, false);
+
     // Find the decoder
     AVCodec* decoder = avcodec_find_decoder(audio_stream->codecpar->codec_id);
     if (!decoder) {
-        avformat_close_input(&context);
+        close_input(&context);
         return nullptr;
     }
     AVCodecContext* decoder_context = avcodec_alloc_context3(decoder);
     if (!decoder_context) {
-        avformat_close_input(&context);
+        close_input(&context);
         return nullptr;
     }
 
     // Copy the codec parameters to the decoder context
     if (avcodec_parameters_to_context(decoder_context, audio_stream->codecpar) < 0) {
+        free_codec(&decoder_context);
+        close_input(&context);
         return nullptr;
     }
 
     // Open the codec
-    if (avcodec_open2(decoder_context, decoder, nullptr) < 0) {
+    if (open_codec(decoder_context, decoder, nullptr) < 0) {
+        free_codec(&decoder_context);
+        close_input(&context);
         return nullptr;
     }
 
-    av_dump_format(context, audio_stream_index, url, false);
+    av_dump_format(context, audio_stream_index, url ? url : "", false);
 
     Media* media = new Media;
     media->input_format_context = context;
@@ -82,18 +198,36 @@ static Media* open_input_file(const char* url) {
     media->decoder_context = decoder_context;
     media->decoder = decoder;
     media->input_stream = audio_stream;
-
-    media->buffer = av_audio_fifo_alloc(decoder_context->sample_fmt, decoder_context->channels, 1);
+    // Segment workers reopen the input from these, which memory and streams can't be
+    media->input_url = url && !io_context ? url : "";
+    media->input_fd = io_context ? -1 : fd;
 
     std::cout << "Decoder context sample rate: " << decoder_context->sample_rate << std::endl;
 
     return media;
 }
 
-static bool write_frame(Media* media) {
-    media->encoder_packet->stream_index = media->output_stream->index;
-    return av_interleaved_write_frame(media->output_format_context, media->encoder_packet) >= 0;
+/**
+ * Hands a packet to the muxer. Interleaving only matters with several streams, a single one goes straight through
+ * instead of being queued (and referenced again) by the muxer first. The packet is left for the caller to unref
+ */
+static bool mux_packet(AVFormatContext* context, AVPacket* packet) {
+    if (context->nb_streams == 1) return av_write_frame(context, packet) >= 0;
+    return av_interleaved_write_frame(context, packet) >= 0;
+}
 
+/**
+ * Writes an encoded packet to the output. The muxer may have changed the stream time base when writing the header, so
+ * timestamps are rescaled from the encoder's
+ */
+static bool write_packet(Media* media, AVPacket* packet) {
+    packet->stream_index = media->output_stream->index;
+    av_packet_rescale_ts(packet, media->encoder_context->time_base, media->output_stream->time_base);
+    return mux_packet(media->output_format_context, packet);
+}
+
+static bool write_frame(Media* media) {
+    return write_packet(media, media->encoder_packet);
 }
 
 static AVFrame* allocate_audio_frame(AVSampleFormat format, uint64_t channel_layout, int sample_rate, int nb_samples) {
@@ -118,70 +252,439 @@ static AVFrame* allocate_audio_frame(AVSampleFormat format, uint64_t channel_lay
     return frame;
 }
 
-static bool open_output_file(Media* media, const char* url) {
-    AVStream* output_stream;
-    AVCodecContext* encoder_context;
-    AVCodec* encoder;
-    AVFormatContext* output_format_context;
+static uint64_t get_channel_layout(const AVCodecContext* context) {
+    return context->channel_layout ? context->channel_layout : av_get_default_channel_layout(context->channels);
+}
 
-    if (int ret = avformat_alloc_output_context2(&output_format_context, nullptr, nullptr, url) < 0) {
-        std::cout << "Could not allocate output context" << std::endl;
-        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not create output context");
-        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Reason: %s", av_err2str(ret));
-        return false;
+/**
+ * Picks the encoder sample format, the decoder format if the encoder takes it and the encoder's preferred one otherwise
+ */
+static AVSampleFormat choose_sample_format(const AVCodec* encoder, AVSampleFormat wanted) {
+    if (!encoder->sample_fmts) return wanted;
+    for (const AVSampleFormat* format = encoder->sample_fmts; *format != AV_SAMPLE_FMT_NONE; format++) {
+        if (*format == wanted) return wanted;
+    }
+    return encoder->sample_fmts[0];
+}
+
+/**
+ * Picks the supported sample rate closest to the wanted one, preferring the higher rate on ties so we don't lose bandwidth
+ */
+static int choose_sample_rate(const AVCodec* encoder, int wanted) {
+    if (!encoder->supported_samplerates) return wanted;
+    int best = encoder->supported_samplerates[0];
+    for (const int* rate = encoder->supported_samplerates; *rate; rate++) {
+        int distance = std::abs(*rate - wanted);
+        int best_distance = std::abs(best - wanted);
+        if (distance < best_distance || (distance == best_distance && *rate > best)) best = *rate;
+    }
+    return best;
+}
+
+/**
+ * Picks the layout with the wanted number of channels, or the one with the most channels below that (5.1 ends up as stereo for MP3)
+ */
+static uint64_t choose_channel_layout(const AVCodec* encoder, int wanted_channels) {
+    uint64_t wanted = av_get_default_channel_layout(wanted_channels);
+    if (!encoder->channel_layouts) return wanted;
+
+    uint64_t best = 0;
+    for (const uint64_t* layout = encoder->channel_layouts; *layout; layout++) {
+        if (*layout == wanted) return wanted;
+        int channels = av_get_channel_layout_nb_channels(*layout);
+        if (channels <= wanted_channels && (!best || channels > av_get_channel_layout_nb_channels(best))) best = *layout;
+    }
+    return best ? best : encoder->channel_layouts[0];
+}
+
+/**
+ * Sets the bitrate mode, bitrate/quality and speed of the profile on an encoder that is about to be opened.
+ */
+static void apply_encoding_profile(const EncodingProfile* profile, const OutputCodec* codec, AVCodecContext* encoder_context, AVDictionary** options) {
+    int bitrate = profile->bitrate > 0 ? profile->bitrate : codec->default_bitrate;
+
+    switch (codec->codec_id) {
+        case AV_CODEC_ID_MP3:
+            switch (profile->bitrate_mode) {
+                case BITRATE_MODE_VBR:
+                    encoder_context->flags |= AV_CODEC_FLAG_QSCALE;
+                    encoder_context->global_quality = av_clip(profile->vbr_quality, 0, 9) * FF_QP2LAMBDA;
+                    break;
+                case BITRATE_MODE_ABR:
+                    av_dict_set(options, "abr", "1", 0);
+                    // Fall through, ABR targets the bitrate as an average
+                default:
+                    if (bitrate > 0) encoder_context->bit_rate = bitrate;
+                    break;
+            }
+            break;
+        default:
+            break;
     }
 
+    if (profile->speed_tier >= SPEED_TIER_BEST && profile->speed_tier <= SPEED_TIER_FAST &&
+        codec->speed_levels[profile->speed_tier] >= 0) {
+        encoder_context->compression_level = codec->speed_levels[profile->speed_tier];
+    }
+}
+
+static AVCodec* find_encoder(const OutputCodec* codec) {
+    AVCodec* encoder = codec->encoder_name ? avcodec_find_encoder_by_name(codec->encoder_name) : nullptr;
+    return encoder ? encoder : avcodec_find_encoder(codec->codec_id);
+}
+
+/**
+ * Creates and opens the encoder of media->output_codec for the decoded audio of this media.
+ * Everything that needs an encoder for a job (the output file and the segment workers) goes through here, so that all
+ * of them end up configured the same way.
+ * @param global_header Whether the output format wants the codec headers out of band
+ * @param options Extra encoder options, can be null
+ * @return the opened encoder context or null on error
+ */
+static AVCodecContext* open_encoder(Media* media, bool global_header, AVDictionary** options) {
     std::cout << "Finding encoder..." << std::endl;
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Finding encoder...");
-    encoder = avcodec_find_encoder(AV_CODEC_ID_MP3);
+    const OutputCodec* codec = media->output_codec;
+    AVCodec* encoder = find_encoder(codec);
     if (!encoder) {
         std::cout << "No encoder found!" << std::endl;
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "No encoder found!");
-        return false;
+        return nullptr;
     }
 
-    output_stream = avformat_new_stream(output_format_context, encoder);
-    encoder_context = avcodec_alloc_context3(encoder);
+    AVCodecContext* encoder_context = avcodec_alloc_context3(encoder);
     if (!encoder_context) {
         std::cout << "Could not allocate encoder context" << std::endl;
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not allocate encoder context");
-        return false;
+        return nullptr;
     }
 
-    encoder_context->sample_rate = media->decoder_context->sample_rate;
-    encoder_context->channel_layout = media->decoder_context->channel_layout;
+    encoder_context->sample_rate = choose_sample_rate(encoder, media->profile.sample_rate ? media->profile.sample_rate : media->decoder_context->sample_rate);
+    encoder_context->channel_layout = choose_channel_layout(encoder, media->profile.channels ? media->profile.channels : media->decoder_context->channels);
     encoder_context->channels = av_get_channel_layout_nb_channels(encoder_context->channel_layout);
-    encoder_context->sample_fmt = media->decoder_context->sample_fmt;
-    encoder_context->time_base = media->decoder_context->time_base;
+    encoder_context->sample_fmt = choose_sample_format(encoder, media->decoder_context->sample_fmt);
+    encoder_context->time_base = (AVRational){1, encoder_context->sample_rate};
 
-    if (output_format_context->oformat->flags & AVFMT_GLOBALHEADER) {
+    if (global_header) {
         encoder_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
 
-    if (avcodec_open2(encoder_context, encoder, nullptr) < 0) {
+    AVDictionary* encoder_options = nullptr;
+    if (options) av_dict_copy(&encoder_options, *options, 0);
+    apply_encoding_profile(&media->profile, codec, encoder_context, &encoder_options);
+
+    int ret = open_codec(encoder_context, encoder, &encoder_options);
+    av_dict_free(&encoder_options);
+    if (ret < 0) {
         std::cout << "Could not open encoder" << std::endl;
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not open encoder!");
+        free_codec(&encoder_context);
+        return nullptr;
+    }
+
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Encoder: %s, %dHz, %d channels, mode %d, %lld bps, quality %d, level %d",
+                        encoder->name, encoder_context->sample_rate, encoder_context->channels, media->profile.bitrate_mode,
+                        (long long)encoder_context->bit_rate, media->profile.vbr_quality, encoder_context->compression_level);
+
+    return encoder_context;
+}
+
+/**
+ * Sets up the path from decoded samples to the encoder: the resampler (only if the decoder output doesn't already
+ * match the encoder) and the ring holding encoder-ready samples until there is a full frame.
+ * Must be called once both media->decoder_context and media->encoder_context are open.
+ */
+static bool open_resampler(Media* media) {
+    AVCodecContext* decoder_context = media->decoder_context;
+    AVCodecContext* encoder_context = media->encoder_context;
+
+    // Room for a partial encoder frame plus one decoded frame after resampling, so the ring never has to grow
+    int decoded_frame_size = decoder_context->frame_size > 0 ? decoder_context->frame_size : 4096;
+    int resampled_frame_size = (int)av_rescale_rnd(decoded_frame_size, encoder_context->sample_rate, decoder_context->sample_rate, AV_ROUND_UP) + 64;
+    media->buffer = new SampleRing(encoder_context->sample_fmt, encoder_context->channels, encoder_context->frame_size,
+                                   encoder_context->frame_size * 2 + resampled_frame_size);
+
+    uint64_t input_layout = get_channel_layout(decoder_context);
+    if (decoder_context->sample_fmt == encoder_context->sample_fmt &&
+        decoder_context->sample_rate == encoder_context->sample_rate &&
+        input_layout == encoder_context->channel_layout) {
+        return true;
+    }
+
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Resampling %s %dHz %d channels to %s %dHz %d channels",
+                        av_get_sample_fmt_name(decoder_context->sample_fmt), decoder_context->sample_rate, decoder_context->channels,
+                        av_get_sample_fmt_name(encoder_context->sample_fmt), encoder_context->sample_rate, encoder_context->channels);
+
+    if (decoder_context->sample_rate <= 0 || decoder_context->channels <= 0) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not initialize the resampler");
         return false;
     }
+    media->resampler = new Resampler(decoder_context->sample_fmt, input_layout, decoder_context->channels, decoder_context->sample_rate,
+                                     encoder_context->sample_fmt, encoder_context->channels, encoder_context->sample_rate,
+                                     media->profile.resample_quality);
 
-    if (avcodec_parameters_from_context(output_stream->codecpar, encoder_context) < 0) {
-        std::cout << "Could not copy params from encoder context" << std::endl;
-        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not copy params from encoder context");
+    return true;
+}
+
+static void close_resampler(Media* media) {
+    delete media->resampler;
+    media->resampler = nullptr;
+    if (media->buffer) {
+        if (media->encoder_context && media->buffer->samples_written() > 0) {
+            double seconds = (double)media->buffer->samples_written() / media->encoder_context->sample_rate;
+            __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Copied %lld sample bytes for %.1f seconds of audio (%.0f bytes per second)",
+                                (long long)media->buffer->bytes_copied(), seconds, media->buffer->bytes_copied() / seconds);
+        }
+        delete media->buffer;
+        media->buffer = nullptr;
     }
+    av_frame_unref(media->passthrough_frame);
+}
+
+/**
+ * Runs samples through the resampler, straight into the ring. A null input flushes the resampler
+ */
+static bool write_resampled(Media* media, const uint8_t** input, int count) {
+    return media->buffer->resample(media->resampler, input, count);
+}
 
-    output_format_context->metadata = media->input_format_context->metadata;
+/**
+ * Whether a decoded frame can go to the encoder as it is: nothing is buffered in front of it, no conversion is needed
+ * and it is exactly one encoder frame long (e.g. MP3 to MP3, 1152 samples on both sides)
+ */
+static bool can_pass_through(Media* media, const AVFrame* frame) {
+    return !media->resampler && media->buffer->size() == 0 && !media->passthrough_frame->buf[0] &&
+           frame->nb_samples == media->encoder_context->frame_size &&
+           frame->format == media->encoder_context->sample_fmt &&
+           frame->channels == media->encoder_context->channels &&
+           frame->buf[0];
+}
 
-    output_stream->time_base = encoder_context->time_base;
-    int ret;
-    if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&output_format_context->pb, url, AVIO_FLAG_WRITE);
-        if (ret < 0) {
+/**
+ * Converts count samples of frame, starting at offset, to the encoder format and queues them up for encoding
+ */
+static bool push_samples(Media* media, const AVFrame* frame, int offset, int count) {
+    if (offset == 0 && count == frame->nb_samples && can_pass_through(media, frame)) {
+        return av_frame_ref(media->passthrough_frame, frame) >= 0;
+    }
+
+    auto format = (AVSampleFormat)frame->format;
+    bool planar = av_sample_fmt_is_planar(format);
+    int planes = planar ? frame->channels : 1;
+    int stride = av_get_bytes_per_sample(format) * (planar ? 1 : frame->channels);
+
+    std::vector<const uint8_t*> data(planes);
+    for (int i = 0; i < planes; i++) data[i] = frame->extended_data[i] + offset * stride;
+
+    if (!media->resampler) {
+        return media->buffer->write(data.data(), 0, count);
+    }
+    return write_resampled(media, data.data(), count);
+}
+
+static bool has_range(const Media* media) {
+    return media->range_start != AV_NOPTS_VALUE || media->range_end != AV_NOPTS_VALUE;
+}
+
+static void update_percentage(Media* media, const AVPacket* packet) {
+    if (packet->pts == AV_NOPTS_VALUE || media->input_format_context->duration <= 0) return;
+    auto time_in_seconds = packet->pts * ((double)media->input_stream->time_base.num / media->input_stream->time_base.den);
+    if (has_range(media)) {
+        double start = media->range_start != AV_NOPTS_VALUE ? media->range_start / (double)AV_TIME_BASE : 0;
+        double end = (media->range_end != AV_NOPTS_VALUE ? media->range_end : media->input_format_context->duration) / (double)AV_TIME_BASE;
+        if (end <= start) return;
+        media->percentage = av_clip((int)((time_in_seconds - start) / (end - start) * 100), 0, 100);
+        return;
+    }
+    media->percentage = (time_in_seconds / (media->input_format_context->duration / AV_TIME_BASE)) * 100;
+}
+
+// How far before the wanted start we seek, so the decoder has its own state (and bit reservoir) back before we use its output
+static const int DECODER_PREROLL_SECONDS = 1;
+
+/**
+ * Seeks the input to just before the start of the conversion range, if there is one, and sets up the sample
+ * positions push_decoded_frame trims the decoded audio to
+ */
+static bool seek_to_range(Media* media) {
+    if (!has_range(media)) return true;
+
+    int sample_rate = media->decoder_context->sample_rate;
+    int64_t start = media->range_start != AV_NOPTS_VALUE ? std::max<int64_t>(0, media->range_start) : 0;
+    media->trim_start = av_rescale(start, sample_rate, AV_TIME_BASE);
+    media->trim_end = media->range_end != AV_NOPTS_VALUE ? av_rescale(media->range_end, sample_rate, AV_TIME_BASE) : -1;
+    if (media->trim_end >= 0 && media->trim_end <= media->trim_start) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Empty conversion range");
+        return false;
+    }
+
+    if (start <= (int64_t)DECODER_PREROLL_SECONDS * AV_TIME_BASE) {
+        // Close enough to the beginning to just decode from there
+        media->decoded_position = 0;
+        return true;
+    }
+
+    AVStream* stream = media->input_stream;
+    int64_t stream_start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    int64_t seek_ts = stream_start + av_rescale_q(start - (int64_t)DECODER_PREROLL_SECONDS * AV_TIME_BASE, AV_TIME_BASE_Q, stream->time_base);
+    if (av_seek_frame(media->input_format_context, media->audio_stream_index, seek_ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not seek to the start of the range");
+        return false;
+    }
+    avcodec_flush_buffers(media->decoder_context);
+    // Known from the first decoded frame on
+    media->decoded_position = AV_NOPTS_VALUE;
+    return true;
+}
+
+/**
+ * Queues a decoded frame up for encoding. With a conversion range only the samples inside the range go through, which
+ * makes the output start and end on the exact sample whatever the packet boundaries of the input
+ */
+static bool push_decoded_frame(Media* media, const AVFrame* frame) {
+    if (!has_range(media)) return push_samples(media, frame, 0, frame->nb_samples);
+    if (media->range_done) return true;
+
+    if (media->decoded_position == AV_NOPTS_VALUE) {
+        int64_t timestamp = frame->best_effort_timestamp;
+        int64_t stream_start = media->input_stream->start_time != AV_NOPTS_VALUE ? media->input_stream->start_time : 0;
+        media->decoded_position = timestamp == AV_NOPTS_VALUE ? 0 :
+                av_rescale_q(timestamp - stream_start, media->input_stream->time_base, {1, media->decoder_context->sample_rate});
+    }
+
+    int64_t frame_start = media->decoded_position;
+    int64_t frame_end = frame_start + frame->nb_samples;
+    media->decoded_position = frame_end;
+
+    int64_t from = std::max(frame_start, media->trim_start);
+    int64_t to = media->trim_end < 0 ? frame_end : std::min(frame_end, media->trim_end);
+    if (media->trim_end >= 0 && frame_end >= media->trim_end) media->range_done = true;
+    if (to <= from) return true;
+
+    return push_samples(media, frame, (int)(from - frame_start), (int)(to - from));
+}
+
+/**
+ * Gets the samples the resampler is still holding on to into the ring. Call at the end of the input.
+ */
+static bool flush_resampler(Media* media) {
+    if (!media->resampler) return true;
+    return write_resampled(media, nullptr, 0);
+}
+
+/**
+ * Whether the input audio can be written into this output format as it is, without decoding and encoding it again.
+ * With the bundled FFmpeg, whose only muxer is mp3, this is the case for MP3 audio going into an .mp3 file
+ */
+static bool can_stream_copy(Media* media, AVOutputFormat* output_format) {
+    AVCodecID codec_id = media->input_stream->codecpar->codec_id;
+    return avformat_query_codec(output_format, codec_id, FF_COMPLIANCE_NORMAL) == 1;
+}
+
+/**
+ * Rough size of the output from its bitrate and the input duration, 0 when the bitrate isn't known up front (VBR)
+ */
+static int64_t estimate_output_size(Media* media) {
+    int64_t bit_rate = media->encoder_context ? media->encoder_context->bit_rate : media->input_stream->codecpar->bit_rate;
+    int64_t duration = media->input_format_context->duration;
+    if (bit_rate <= 0 || duration <= 0) return 0;
+    return av_rescale(duration, bit_rate, AV_TIME_BASE * 8LL);
+}
+
+/**
+ * Opens the output and its encoder, and writes the header. Whatever was opened stays in the media on failure,
+ * free it with discard_output_file then.
+ * @param url Path of the output. With an io_context, the output is written into it instead (see CustomIo.h) and
+ * url only has to carry the extension that picks the format
+ * @param io_context Taken over, it is freed along with the output
+ */
+static bool open_output_file(Media* media, const char* url, bool allow_stream_copy, AVIOContext* io_context = nullptr) {
+    AVStream* output_stream;
+    AVCodecContext* encoder_context = nullptr;
+    AVCodec* encoder = nullptr;
+    AVFormatContext* output_format_context;
+
+    bool known_extension;
+    media->output_codec = find_output_codec(url, &known_extension);
+
+    if (int ret = avformat_alloc_output_context2(&output_format_context, nullptr, known_extension ? media->output_codec->format_name : nullptr, url) < 0) {
+        std::cout << "Could not allocate output context" << std::endl;
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not create output context");
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Reason: %s", av_err2str(ret));
+        free_custom_io(&io_context);
+        return false;
+    }
+    media->output_format_context = output_format_context;
+    if (io_context) {
+        output_format_context->pb = io_context;
+        output_format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    // The extension asks for a codec, only copy input audio that already is in it
+    media->stream_copy = allow_stream_copy && can_stream_copy(media, output_format_context->oformat) &&
+                         (!known_extension || media->input_stream->codecpar->codec_id == media->output_codec->codec_id);
+
+    if (media->stream_copy) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Input audio fits the output, copying it without encoding");
+        output_stream = avformat_new_stream(output_format_context, nullptr);
+        if (avcodec_parameters_copy(output_stream->codecpar, media->input_stream->codecpar) < 0) {
+            __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not copy params from the input stream");
+            return false;
+        }
+        // The tag belongs to the input container, let the muxer pick its own
+        output_stream->codecpar->codec_tag = 0;
+        output_stream->time_base = media->input_stream->time_base;
+    } else {
+        encoder_context = open_encoder(media, output_format_context->oformat->flags & AVFMT_GLOBALHEADER, nullptr);
+        if (!encoder_context) {
             return false;
         }
+        encoder = const_cast<AVCodec*>(encoder_context->codec);
+
+        output_stream = avformat_new_stream(output_format_context, encoder);
+
+        if (avcodec_parameters_from_context(output_stream->codecpar, encoder_context) < 0) {
+            std::cout << "Could not copy params from encoder context" << std::endl;
+            __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not copy params from encoder context");
+        }
+
+        output_stream->time_base = encoder_context->time_base;
+    }
+
+    // A copy, the input context frees its own
+    av_dict_copy(&output_format_context->metadata, media->input_format_context->metadata, 0);
+
+    int ret;
+    if (!io_context && !(output_format_context->oformat->flags & AVFMT_NOFILE)) {
+        // Local files get our own writer, anything else goes through FFmpeg's protocols
+        media->encoder_context = encoder_context;
+        const char* protocol = avio_find_protocol_name(url);
+        AVIOContext* file_io = protocol && strcmp(protocol, "file") == 0 ? open_output_io(url, estimate_output_size(media)) : nullptr;
+        if (file_io) {
+            attach_output_io(output_format_context, file_io);
+        } else {
+            ret = avio_open(&output_format_context->pb, url, AVIO_FLAG_WRITE);
+            if (ret < 0) {
+                return false;
+            }
+        }
     }
     av_dump_format(output_format_context, 0, url, true);
 
-    ret = avformat_write_header(output_format_context, nullptr);
+    AVDictionary* muxer_options = nullptr;
+    if (strcmp(output_format_context->oformat->name, "mp3") == 0) {
+        // The Xing/LAME frame with the frame and byte counts, a 100 entry seek TOC and the encoder delay and padding
+        // (from the packets' skip samples). The muxer writes a placeholder here and fills it in with the trailer
+        av_dict_set(&muxer_options, "write_xing", "1", 0);
+        if (output_format_context->pb && !(output_format_context->pb->seekable & AVIO_SEEKABLE_NORMAL)) {
+            __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Output is not seekable, it won't have a Xing header");
+        }
+        // Room after the ID3v2 tag, so editing the tags later doesn't mean rewriting the whole file
+        output_format_context->metadata_header_padding = tag_padding();
+    }
+
+    ret = avformat_write_header(output_format_context, &muxer_options);
+    av_dict_free(&muxer_options);
     if (ret < 0) {
         std::cout << "Could not write header" << std::endl;
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not write header");
@@ -191,26 +694,68 @@ static bool open_output_file(Media* media, const char* url) {
     media->output_stream = output_stream;
     media->encoder = encoder;
     media->encoder_context = encoder_context;
-    media->output_format_context = output_format_context;
-    media->output_frame = allocate_audio_frame(media->decoder_context->sample_fmt, output_stream->codecpar->channel_layout, media->decoder_context->sample_rate, encoder_context->frame_size);
+    if (!io_context) media->output_url = url;
+    if (!media->stream_copy) {
+        // Its data comes from the sample ring, see fill_output_frame
+        media->output_frame = av_frame_alloc();
+        if (!open_resampler(media)) return false;
+    }
+
+    return true;
+}
 
+/**
+ * Closes the AVIOContext of the output, ours or the one avio_open gave us
+ * @param discard Whether the output is of no use, see CustomIo::finish
+ * @return false if some of the output didn't make it
+ */
+static bool close_output_io(AVFormatContext* context, bool discard) {
+    if (context->flags & AVFMT_FLAG_CUSTOM_IO) {
+        return free_custom_io(&context->pb, discard) >= 0;
+    } else if (!(context->oformat->flags & AVFMT_NOFILE)) {
+        return avio_closep(&context->pb) >= 0;
+    }
     return true;
 }
 
+/**
+ * Frees an output that open_output_file couldn't finish opening, without writing anything more into it
+ */
+static void discard_output_file(Media* media) {
+    if (!media->output_format_context) return;
+    free_codec(&media->encoder_context);
+    close_output_io(media->output_format_context, true);
+    avformat_free_context(media->output_format_context);
+    media->output_format_context = nullptr;
+}
+
 static bool close_input_file(Media* media) {
-//    avformat_close_input(&media->input_format_context);
-    av_free(media->input_format_context);
+    if (media->input_format_context->pb) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Read %lld bytes from the input", (long long)media->input_format_context->pb->bytes_read);
+    }
+    free_codec(&media->decoder_context);
+    close_input(&media->input_format_context);
     return true;
 }
 
-static bool close_output_file(Media* media) {
+/**
+ * Finishes the output and frees everything the conversion used
+ * @param discard Whether the conversion failed. Local files are written into a temp file that only replaces the output
+ * file once complete, this throws it away instead
+ */
+static bool close_output_file(Media* media, bool discard = false) {
     bool completed = true;
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Closing output file...");
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Writing trailer...");
     completed = av_write_trailer(media->output_format_context) >= 0;
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Wrote trailer!!!");
-    avcodec_free_context(&media->encoder_context);
+    close_resampler(media);
+    free_codec(&media->encoder_context);
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Freed encoder context");
+    if (!close_output_io(media->output_format_context, discard || !completed)) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not write all of the output");
+        completed = false;
+    }
     avformat_free_context(media->output_format_context);
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Freed the output format context");
 
@@ -218,6 +763,7 @@ static bool close_output_file(Media* media) {
     av_packet_free(&media->encoder_packet);
     av_frame_free(&media->output_frame);
     av_frame_free(&media->frame);
+    av_frame_free(&media->passthrough_frame);
 
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Finished closing output file");
     return completed;
@@ -232,7 +778,7 @@ static bool receive_frame(Media* media) {
         return false;
     }
 
-    int written = av_audio_fifo_write(media->buffer, (void**)media->frame->data, media->frame->nb_samples);
+    bool written = push_decoded_frame(media, media->frame);
 
     std::cout << "Samples written: " << written << std::endl;
 
@@ -257,178 +803,1373 @@ static bool receive_packet(Media* media) {
     return avcodec_receive_packet(media->encoder_context, media->encoder_packet) >= 0;
 }
 
+static int buffered_samples(Media* media) {
+    int passthrough = media->passthrough_frame->buf[0] ? media->passthrough_frame->nb_samples : 0;
+    return media->buffer->size() + passthrough;
+}
+
+/**
+ * Points the output frame at the next encoder frame worth of samples. Nothing is copied, the frame either is a decoded
+ * frame passed through or references the sample ring directly.
+ * @param forced Take whatever is left even if it's less than a full frame
+ */
 static bool fill_output_frame(Media* media, bool forced = false) {
-    if (!forced) {
-        int size = av_audio_fifo_size(media->buffer);
-        if (size < media->encoder_context->frame_size) return false;
+    AVCodecContext* encoder_context = media->encoder_context;
+    if (!forced && buffered_samples(media) < encoder_context->frame_size) return false;
+
+    if (media->passthrough_frame->buf[0]) {
+        av_frame_unref(media->output_frame);
+        av_frame_move_ref(media->output_frame, media->passthrough_frame);
+        // Decoder timestamps mean nothing to the encoder, it counts samples
+        media->output_frame->pts = media->next_pts;
+        media->next_pts += media->output_frame->nb_samples;
+        return true;
     }
 
-    int read = av_audio_fifo_read(media->buffer, (void**)media->output_frame->data, media->output_frame->nb_samples);
+    if (!media->buffer->read(media->output_frame, encoder_context->frame_size)) return false;
+    media->output_frame->channel_layout = encoder_context->channel_layout;
+    media->output_frame->sample_rate = encoder_context->sample_rate;
+    // Containers other than MP3 keep timestamps, and the encoders only get them right when the input has them
+    media->output_frame->pts = media->next_pts;
+    media->next_pts += media->output_frame->nb_samples;
 
-    std::cout << "Read: " << read << std::endl;
-    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Read: %d", read);
+    std::cout << "Read: " << media->output_frame->nb_samples << std::endl;
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Read: %d", media->output_frame->nb_samples);
 
-    return read;
+    return true;
 }
 
-extern "C"
-JNIEXPORT jlong JNICALL
-Java_tech_smallwonder_mp3fy_MP3fy_initializeNative(JNIEnv *env, jobject thiz, jstring input_file,
-                                                   jstring output_file) {
-    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Starting library initialization...");
-    jboolean isCopy = JNI_TRUE;
-    auto media = open_input_file(env->GetStringUTFChars(input_file, &isCopy));
-    if (!media) return -1;
+/////////////////////////////////////////////////////////////////////////////////
 
-    if (!open_output_file(media, env->GetStringUTFChars(output_file, &isCopy))) {
-        delete media;
-        return -1;
+//                             PIPELINED CONVERSION                             //
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// Queue depths between the stages. Encoding is the slow stage, these only have to be deep enough so that the
+// reader and the decoder never make the encoder wait.
+static const size_t PIPELINE_PACKET_QUEUE_SIZE = 64;
+static const size_t PIPELINE_FRAME_QUEUE_SIZE = 16;
+static const size_t PIPELINE_ENCODED_QUEUE_SIZE = 64;
+
+struct Pipeline {
+    SpscQueue<AVPacket*> decoder_queue{PIPELINE_PACKET_QUEUE_SIZE};
+    SpscQueue<AVFrame*> encoder_queue{PIPELINE_FRAME_QUEUE_SIZE};
+    SpscQueue<AVPacket*> muxer_queue{PIPELINE_ENCODED_QUEUE_SIZE};
+    std::atomic<bool> failed{false};
+
+    void fail() {
+        failed.store(true);
+        decoder_queue.abort();
+        encoder_queue.abort();
+        muxer_queue.abort();
     }
 
-    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Successfully initialized the library!");
+    ~Pipeline() {
+        AVPacket* packet;
+        AVFrame* frame;
+        while (decoder_queue.try_pop(packet)) av_packet_free(&packet);
+        while (encoder_queue.try_pop(frame)) av_frame_free(&frame);
+        while (muxer_queue.try_pop(packet)) av_packet_free(&packet);
+    }
+};
+
+static void demux_stage(Media* media, Pipeline* pipeline) {
+    AVPacket* packet = av_packet_alloc();
+
+    while (!media->range_done && av_read_frame(media->input_format_context, packet) >= 0) {
+        if (packet->stream_index != media->audio_stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        update_percentage(media, packet);
+
+        AVPacket* queued = av_packet_alloc();
+        av_packet_move_ref(queued, packet);
+        if (!pipeline->decoder_queue.push(queued)) {
+            av_packet_free(&queued);
+            break;
+        }
+    }
 
-    return reinterpret_cast<jlong>(media);
+    av_packet_free(&packet);
+    pipeline->decoder_queue.close();
 }
 
-extern "C"
-JNIEXPORT jboolean JNICALL
-Java_tech_smallwonder_mp3fy_MP3fy_convertNative(JNIEnv *env, jobject thiz, jlong media_id) {
-    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Coming back to start the native conversion");
-    auto* media = reinterpret_cast<Media*>(media_id);
-    if (!media) return false;
+/**
+ * Copies a decoded frame into buffers of its own. Decoders hand out frames from their buffer pool, and FFmpeg is built
+ * without pthreads, so the pool's lock does nothing: its buffers may only go back to it on the decoding thread
+ */
+static AVFrame* copy_decoded_frame(const AVFrame* decoded) {
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) return nullptr;
+    frame->format = decoded->format;
+    frame->nb_samples = decoded->nb_samples;
+    frame->channels = decoded->channels;
+    frame->channel_layout = decoded->channel_layout;
+    if (av_frame_get_buffer(frame, 0) < 0 || av_frame_copy(frame, decoded) < 0 || av_frame_copy_props(frame, decoded) < 0) {
+        av_frame_free(&frame);
+    }
+    return frame;
+}
 
-    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Starting work now...");
-    while (av_read_frame(media->input_format_context, media->decoder_packet) >= 0) {
-        if (media->decoder_packet->stream_index != media->audio_stream_index) continue;
-        if (send_packet(media)) {
-            while (receive_frame(media)) {
-                // Send to the encoder
-                // Fill output frame with data
-                if (!fill_output_frame(media)) {
-                    continue;
-                }
+static bool drain_decoder(Media* media, Pipeline* pipeline, AVFrame* decoded) {
+    while (avcodec_receive_frame(media->decoder_context, decoded) >= 0) {
+        AVFrame* frame = copy_decoded_frame(decoded);
+        av_frame_unref(decoded);
+        if (!frame) return false;
+        if (!pipeline->encoder_queue.push(frame)) {
+            av_frame_free(&frame);
+            return false;
+        }
+    }
+    return true;
+}
 
-                if (send_frame(media)) {
-                    while (receive_packet(media)) {
-                        if (write_frame(media)) {
-                            if (media->decoder_packet->pts != AV_NOPTS_VALUE) {
-                                auto time_in_seconds = media->decoder_packet->pts * ((double)media->input_stream->time_base.num / media->input_stream->time_base.den);
-                                media->percentage = (time_in_seconds / (media->input_format_context->duration / AV_TIME_BASE)) * 100;
-                                __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Wrote frame %d%s", media->percentage, "%");
-                            }
-                        }
-                    }
-                }
-            }
+static void decode_stage(Media* media, Pipeline* pipeline) {
+    AVFrame* decoded = av_frame_alloc();
+    if (!decoded) {
+        pipeline->fail();
+        return;
+    }
+
+    AVPacket* packet;
+    while (pipeline->decoder_queue.pop(packet)) {
+        // Corrupt packets are skipped just like in the serial loop
+        int ret = avcodec_send_packet(media->decoder_context, packet);
+        av_packet_free(&packet);
+        if (ret < 0) continue;
+
+        if (!drain_decoder(media, pipeline, decoded)) {
+            pipeline->fail();
+            av_frame_free(&decoded);
+            return;
         }
+    }
+
+    if (pipeline->failed.load()) {
+        av_frame_free(&decoded);
+        return;
+    }
+
+    // EOF, get the frames the decoder is still holding on to
+    avcodec_send_packet(media->decoder_context, nullptr);
+    bool drained = drain_decoder(media, pipeline, decoded);
+    av_frame_free(&decoded);
+    if (!drained) {
+        pipeline->fail();
+        return;
+    }
+
+    pipeline->encoder_queue.close();
+}
+
+static bool encode_and_queue(Media* media, Pipeline* pipeline, AVFrame* frame) {
+    if (avcodec_send_frame(media->encoder_context, frame) < 0) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Pipeline: could not send frame to the encoder");
+        return false;
+    }
+
+    for (;;) {
+        AVPacket* packet = av_packet_alloc();
+        if (!packet) return false;
+        if (avcodec_receive_packet(media->encoder_context, packet) < 0) {
+            av_packet_free(&packet);
+            return true;
+        }
+        if (!pipeline->muxer_queue.push(packet)) {
+            av_packet_free(&packet);
+            return false;
+        }
+    }
+}
+
+static void encode_stage(Media* media, Pipeline* pipeline) {
+    AVFrame* frame;
+    while (pipeline->encoder_queue.pop(frame)) {
+        bool pushed = push_decoded_frame(media, frame);
+        av_frame_free(&frame);
+        if (!pushed) {
+            pipeline->fail();
+            return;
+        }
+
+        while (fill_output_frame(media)) {
+            if (!encode_and_queue(media, pipeline, media->output_frame)) {
+                pipeline->fail();
+                return;
+            }
+        }
+    }
+
+    if (pipeline->failed.load()) return;
+
+    // Whatever is left in the ring goes out as one short frame, then the encoder gets flushed
+    if (!flush_resampler(media)) {
+        pipeline->fail();
+        return;
+    }
+    while (fill_output_frame(media)) {
+        if (!encode_and_queue(media, pipeline, media->output_frame)) {
+            pipeline->fail();
+            return;
+        }
+    }
+    if (fill_output_frame(media, true) && !encode_and_queue(media, pipeline, media->output_frame)) {
+        pipeline->fail();
+        return;
+    }
+    if (!encode_and_queue(media, pipeline, nullptr)) {
+        pipeline->fail();
+        return;
+    }
+
+    pipeline->muxer_queue.close();
+}
+
+/**
+ * Runs the conversion as four stages (demux, decode, encode, mux) connected by bounded queues, so that reading and
+ * decoding happen while the encoder is busy instead of before it. The muxer runs on the calling thread.
+ * @return true if every stage finished cleanly
+ */
+static bool convert_pipelined(Media* media) {
+    Pipeline pipeline;
+
+    std::thread demuxer(demux_stage, media, &pipeline);
+    std::thread decoder(decode_stage, media, &pipeline);
+    std::thread encoder(encode_stage, media, &pipeline);
+
+    AVPacket* packet;
+    while (pipeline.muxer_queue.pop(packet)) {
+        bool written = write_packet(media, packet);
+        av_packet_free(&packet);
+        if (!written) {
+            __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Pipeline: could not write packet");
+            pipeline.fail();
+            break;
+        }
+    }
+
+    demuxer.join();
+    decoder.join();
+    encoder.join();
+
+    return !pipeline.failed.load();
+}
+
+/**
+ * Moves the audio packets from the input to the output as they are. Used when the input audio already fits the output
+ * container, see can_stream_copy.
+ * A conversion range is cut at packet boundaries here, packets can't be split without decoding them.
+ */
+static bool convert_stream_copy(Media* media) {
+    AVPacket* packet = media->decoder_packet;
+    AVStream* stream = media->input_stream;
+    bool written = true;
+
+    // The output starts at 0 whatever part of the input it comes from
+    int64_t offset = AV_NOPTS_VALUE;
+    int64_t end_ts = AV_NOPTS_VALUE;
+    if (has_range(media)) {
+        int64_t stream_start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        if (media->range_start != AV_NOPTS_VALUE && media->range_start > 0) {
+            int64_t start_ts = stream_start + av_rescale_q(media->range_start, AV_TIME_BASE_Q, stream->time_base);
+            if (av_seek_frame(media->input_format_context, media->audio_stream_index, start_ts, AVSEEK_FLAG_BACKWARD) < 0) {
+                __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not seek to the start of the range");
+                return false;
+            }
+        }
+        if (media->range_end != AV_NOPTS_VALUE) {
+            end_ts = stream_start + av_rescale_q(media->range_end, AV_TIME_BASE_Q, stream->time_base);
+        }
+    }
+
+    while (written && av_read_frame(media->input_format_context, packet) >= 0) {
+        if (packet->stream_index == media->audio_stream_index) {
+            if (end_ts != AV_NOPTS_VALUE && packet->pts != AV_NOPTS_VALUE && packet->pts >= end_ts) {
+                av_packet_unref(packet);
+                break;
+            }
+            update_percentage(media, packet);
+            if (has_range(media)) {
+                if (offset == AV_NOPTS_VALUE) offset = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+                if (offset != AV_NOPTS_VALUE) {
+                    if (packet->pts != AV_NOPTS_VALUE) packet->pts -= offset;
+                    if (packet->dts != AV_NOPTS_VALUE) packet->dts -= offset;
+                }
+            }
+            av_packet_rescale_ts(packet, stream->time_base, media->output_stream->time_base);
+            packet->stream_index = media->output_stream->index;
+            packet->pos = -1;
+            written = mux_packet(media->output_format_context, packet);
+        }
+        av_packet_unref(packet);
+    }
+
+    return written;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+//                             SEGMENTED CONVERSION                             //
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// Segments shorter than this are not worth the extra open/seek/probe of the input
+static const int MIN_SEGMENT_SECONDS = 60;
+
+// Whole encoder frames fed to a segment encoder before its boundary and thrown away afterwards. They take the
+// encoder delay and let the psychoacoustic model settle, so the first kept frame sounds like it would in one long encode
+static const int SEGMENT_PREROLL_FRAMES = 8;
+
+struct Segment {
+    int index = 0;
+    // Boundaries in samples at the encoder sample rate, counted from the start of the audio stream.
+    // Both are multiples of the encoder frame size, end is -1 for the last segment
+    int64_t start_sample = 0;
+    int64_t end_sample = -1;
+    std::string temp_path;
+    // Size of every kept encoded packet, in the order they were written to temp_path
+    std::vector<int> packet_sizes;
+    // Encoder input samples that belong to the kept packets, i.e. without the pre-roll
+    int64_t encoded_samples = 0;
+    std::atomic<int64_t> samples_done{0};
+    bool succeeded = false;
+};
+
+struct SegmentJob {
+    Media* media = nullptr;
+    // In decoded samples, only used for the progress
+    int64_t total_samples = 0;
+    std::vector<std::unique_ptr<Segment>> segments;
+};
+
+static void free_segment_media(Media* media) {
+    close_resampler(media);
+    free_codec(&media->encoder_context);
+    free_codec(&media->decoder_context);
+    close_input(&media->input_format_context);
+    av_frame_free(&media->output_frame);
+    av_frame_free(&media->frame);
+    av_frame_free(&media->passthrough_frame);
+    av_packet_free(&media->decoder_packet);
+    av_packet_free(&media->encoder_packet);
+    delete media;
+}
+
+static void update_segmented_percentage(SegmentJob* job) {
+    int64_t done = 0;
+    for (auto& segment : job->segments) done += segment->samples_done.load();
+    // The last percent is for joining the segments
+    job->media->percentage = std::min<int64_t>(99, done * 100 / std::max<int64_t>(1, job->total_samples));
+}
+
+/**
+ * Encodes one segment of the input into a temp file of raw encoded frames.
+ * Runs on its own thread with its own demuxer, decoder and encoder.
+ */
+static void segment_worker(SegmentJob* job, Segment* segment) {
+    // Reads are positional, so sharing the descriptor with the other segments is fine
+    Media* media = open_input_file(job->media->input_url.empty() ? nullptr : job->media->input_url.c_str(), job->media->input_fd);
+    if (!media) return;
+    media->profile = job->media->profile;
+    media->output_codec = job->media->output_codec;
+
+    // The bit reservoir lets a frame borrow bytes from the frames before it. Those frames come from another
+    // encoder once the segments are joined, so it has to be off in this mode
+    AVDictionary* options = nullptr;
+    if (media->output_codec->codec_id == AV_CODEC_ID_MP3) av_dict_set(&options, "reservoir", "0", 0);
+    media->encoder_context = open_encoder(media, false, &options);
+    av_dict_free(&options);
+
+    FILE* temp_file = fopen(segment->temp_path.c_str(), "wb");
+    if (!media->encoder_context || !temp_file || !open_resampler(media)) {
+        if (temp_file) fclose(temp_file);
+        free_segment_media(media);
+        return;
+    }
+
+    AVCodecContext* decoder_context = media->decoder_context;
+    AVCodecContext* encoder_context = media->encoder_context;
+    int frame_size = encoder_context->frame_size;
+    AVRational sample_time_base = {1, decoder_context->sample_rate};
+
+    media->output_frame = av_frame_alloc();
+
+    int64_t preroll_samples = segment->index == 0 ? 0 : (int64_t)SEGMENT_PREROLL_FRAMES * frame_size;
+    int64_t packets_to_drop = preroll_samples / frame_size;
+    int64_t packets_to_keep = segment->end_sample < 0 ? -1 : (segment->end_sample - segment->start_sample) / frame_size;
+
+    // The part of the decoded audio that goes into the encoder, in decoded samples
+    int64_t feed_start = av_rescale(segment->start_sample - preroll_samples, decoder_context->sample_rate, encoder_context->sample_rate);
+    int64_t feed_end = segment->end_sample < 0 ? -1 : av_rescale(segment->end_sample, decoder_context->sample_rate, encoder_context->sample_rate);
+
+    int64_t stream_start = media->input_stream->start_time != AV_NOPTS_VALUE ? media->input_stream->start_time : 0;
+    if (segment->index > 0) {
+        int64_t seek_sample = std::max<int64_t>(0, feed_start - (int64_t)DECODER_PREROLL_SECONDS * decoder_context->sample_rate);
+        int64_t seek_ts = stream_start + av_rescale_q(seek_sample, sample_time_base, media->input_stream->time_base);
+        if (av_seek_frame(media->input_format_context, media->audio_stream_index, seek_ts, AVSEEK_FLAG_BACKWARD) < 0) {
+            __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Segment %d: seek failed", segment->index);
+            fclose(temp_file);
+            free_segment_media(media);
+            return;
+        }
+    }
+
+    int64_t position = AV_NOPTS_VALUE;
+    int64_t packet_index = 0;
+    int64_t packets_kept = 0;
+    bool ok = true;
+    bool reached_end = false;
+
+    auto drain_encoder = [&]() {
+        while (ok && avcodec_receive_packet(encoder_context, media->encoder_packet) >= 0) {
+            bool keep = packet_index >= packets_to_drop && (packets_to_keep < 0 || packets_kept < packets_to_keep);
+            if (keep) {
+                ok = fwrite(media->encoder_packet->data, 1, media->encoder_packet->size, temp_file) == (size_t)media->encoder_packet->size;
+                segment->packet_sizes.push_back(media->encoder_packet->size);
+                packets_kept++;
+            }
+            packet_index++;
+            av_packet_unref(media->encoder_packet);
+        }
+    };
+
+    auto encode_fifo = [&](bool flush) {
+        while (ok && (buffered_samples(media) >= frame_size || (flush && buffered_samples(media) > 0))) {
+            if (!fill_output_frame(media, flush)) break;
+            ok = avcodec_send_frame(encoder_context, media->output_frame) >= 0;
+            drain_encoder();
+        }
+    };
+
+    auto consume_frames = [&]() {
+        while (ok && !reached_end && avcodec_receive_frame(decoder_context, media->frame) >= 0) {
+            AVFrame* frame = media->frame;
+            if (position == AV_NOPTS_VALUE) {
+                int64_t timestamp = frame->best_effort_timestamp;
+                position = segment->index == 0 || timestamp == AV_NOPTS_VALUE ? 0 :
+                           av_rescale_q(timestamp - stream_start, media->input_stream->time_base, sample_time_base);
+            }
+
+            int64_t frame_start = position;
+            int64_t frame_end = position + frame->nb_samples;
+            position = frame_end;
+
+            int64_t from = std::max(frame_start, feed_start);
+            int64_t to = feed_end < 0 ? frame_end : std::min(frame_end, feed_end);
+            if (to > from) {
+                ok = push_samples(media, frame, (int)(from - frame_start), (int)(to - from));
+                segment->samples_done.fetch_add(to - from);
+                update_segmented_percentage(job);
+            }
+            if (feed_end >= 0 && frame_end >= feed_end) reached_end = true;
+
+            av_frame_unref(frame);
+            encode_fifo(false);
+        }
+    };
+
+    while (ok && !reached_end && av_read_frame(media->input_format_context, media->decoder_packet) >= 0) {
+        if (media->decoder_packet->stream_index == media->audio_stream_index &&
+            avcodec_send_packet(decoder_context, media->decoder_packet) >= 0) {
+            consume_frames();
+        }
+        av_packet_unref(media->decoder_packet);
+    }
+
+    if (ok && !reached_end) {
+        avcodec_send_packet(decoder_context, nullptr);
+        consume_frames();
+    }
+
+    if (ok) {
+        ok = flush_resampler(media);
+        encode_fifo(false);
+        encode_fifo(true);
+        ok = ok && avcodec_send_frame(encoder_context, nullptr) >= 0;
+        drain_encoder();
+    }
+
+    ok = fclose(temp_file) == 0 && ok;
+    segment->encoded_samples = media->buffer->samples_written() - preroll_samples;
+    free_segment_media(media);
+
+    segment->succeeded = ok;
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Segment %d finished with %zu frames", segment->index, segment->packet_sizes.size());
+}
+
+/**
+ * Writes the frames of every segment, in order, into the output file opened by initialize
+ */
+static bool join_segments(SegmentJob* job) {
+    Media* media = job->media;
+    int frame_size = media->encoder_context->frame_size;
+    int64_t frame_index = 0;
+
+    // The segment encoders don't know about each other, so the encoder delay and the padding at the end are worked out
+    // here and handed to the muxer the way a single encoder would (it puts them in the Xing/LAME header)
+    int64_t total_frames = 0;
+    int64_t total_samples = 0;
+    for (auto& segment : job->segments) {
+        total_frames += segment->packet_sizes.size();
+        total_samples += segment->encoded_samples;
+    }
+    int delay = media->encoder_context->initial_padding;
+    int64_t padding = total_frames * frame_size - delay - total_samples;
+
+    for (auto& segment : job->segments) {
+        FILE* temp_file = fopen(segment->temp_path.c_str(), "rb");
+        if (!temp_file) return false;
+
+        for (int size : segment->packet_sizes) {
+            if (av_new_packet(media->encoder_packet, size) < 0 ||
+                fread(media->encoder_packet->data, 1, size, temp_file) != (size_t)size) {
+                av_packet_unref(media->encoder_packet);
+                fclose(temp_file);
+                return false;
+            }
+
+            media->encoder_packet->pts = media->encoder_packet->dts = frame_index * frame_size;
+            // The encoder time base counts samples, write_frame takes it to the stream's
+            media->encoder_packet->duration = frame_size;
+            bool first = frame_index == 0;
+            bool last = frame_index == total_frames - 1;
+            frame_index++;
+
+            if ((first && delay > 0) || (last && padding > 0 && padding < frame_size * 2)) {
+                uint8_t* skip_samples = av_packet_new_side_data(media->encoder_packet, AV_PKT_DATA_SKIP_SAMPLES, 10);
+                if (skip_samples) {
+                    AV_WL32(skip_samples, first ? delay : 0);
+                    AV_WL32(skip_samples + 4, last ? (uint32_t)padding : 0);
+                }
+            }
+
+            bool written = write_frame(media);
+            av_packet_unref(media->encoder_packet);
+            if (!written) {
+                fclose(temp_file);
+                return false;
+            }
+        }
+
+        fclose(temp_file);
+    }
+
+    return true;
+}
+
+/**
+ * Splits the input timeline into one segment per core and encodes them in parallel, each with its own demuxer,
+ * decoder and encoder. Segment boundaries sit on encoder frame boundaries, so joining them is just writing their
+ * frames one after the other.
+ * @return true if every segment was encoded and joined, false otherwise. Returns false without touching anything if
+ * the input is too short to be split, the caller should fall back to another mode then
+ */
+static bool convert_segmented(Media* media, bool* attempted) {
+    *attempted = false;
+
+    int frame_size = media->encoder_context->frame_size;
+    int sample_rate = media->encoder_context->sample_rate;
+    int64_t duration = media->input_format_context->duration;
+    if (!media->output_codec->can_segment || frame_size <= 0 || duration <= 0) return false;
+    // Every segment reopens the input, and is encoded into a temp file next to the output
+    if ((media->input_url.empty() && media->input_fd < 0) || media->output_url.empty()) return false;
+
+    int64_t total_samples = av_rescale(duration, sample_rate, AV_TIME_BASE);
+    int64_t max_segments = total_samples / ((int64_t)MIN_SEGMENT_SECONDS * sample_rate);
+    unsigned threads = media->thread_budget ? media->thread_budget : std::thread::hardware_concurrency();
+    int count = (int)std::min<int64_t>(std::max(1u, threads), max_segments);
+    if (count < 2) return false;
+
+    *attempted = true;
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Starting segmented conversion with %d segments", count);
+
+    SegmentJob job;
+    job.media = media;
+    job.total_samples = av_rescale(duration, media->decoder_context->sample_rate, AV_TIME_BASE);
+
+    int64_t frames = total_samples / frame_size;
+    for (int i = 0; i < count; i++) {
+        std::unique_ptr<Segment> segment(new Segment);
+        segment->index = i;
+        segment->start_sample = frames * i / count * frame_size;
+        segment->end_sample = i == count - 1 ? -1 : frames * (i + 1) / count * frame_size;
+        segment->temp_path = media->output_url + ".segment" + std::to_string(i);
+        job.segments.push_back(std::move(segment));
+    }
+
+    std::vector<std::thread> workers;
+    for (auto& segment : job.segments) {
+        workers.emplace_back(segment_worker, &job, segment.get());
+    }
+    for (auto& worker : workers) worker.join();
+
+    bool succeeded = std::all_of(job.segments.begin(), job.segments.end(), [](const std::unique_ptr<Segment>& segment) {
+        return segment->succeeded;
+    });
+
+    if (succeeded) succeeded = join_segments(&job);
+
+    for (auto& segment : job.segments) unlink(segment->temp_path.c_str());
+
+    if (succeeded) media->percentage = 100;
+    return succeeded;
+}
+
+// Session states, these have to match the STATE_* constants in ConversionSession.java
+enum SessionState {
+    SESSION_IDLE = 0,
+    SESSION_QUEUED = 1,
+    SESSION_RUNNING = 2,
+    SESSION_SUCCEEDED = 3,
+    SESSION_FAILED = 4,
+    SESSION_CANCELLED = 5,
+};
+
+/**
+ * One conversion, from initialize until the Java side releases it. Java only ever holds the id, so a stale handle
+ * can't reach freed memory, and every session has its own Media so any number of them can run side by side.
+ */
+struct Session {
+    jlong id = 0;
+    Media* media = nullptr;
+    std::atomic<int> state{SESSION_IDLE};
+    // Global reference to the ConversionSession to notify once a queued conversion is done
+    jobject callback = nullptr;
+
+    ~Session() {
+        // Never converted, so the files are still open
+        if (media && (state == SESSION_IDLE || state == SESSION_CANCELLED)) {
+            close_output_file(media, true);
+            close_input_file(media);
+        }
+        delete media;
+    }
+};
+
+/**
+ * Maps the handles given to Java to their sessions. A session stays alive while it's registered or converting,
+ * whichever ends last.
+ */
+struct SessionRegistry {
+    std::mutex mutex;
+    std::map<jlong, std::shared_ptr<Session>> sessions;
+    jlong next_id = 1;
+
+    jlong add(Media* media) {
+        std::shared_ptr<Session> session(new Session);
+        session->media = media;
+        std::lock_guard<std::mutex> lock(mutex);
+        session->id = next_id++;
+        sessions[session->id] = session;
+        return session->id;
+    }
+
+    std::shared_ptr<Session> find(jlong id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto session = sessions.find(id);
+        return session == sessions.end() ? nullptr : session->second;
+    }
+
+    void remove(jlong id) {
+        std::shared_ptr<Session> session;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = sessions.find(id);
+            if (found == sessions.end()) return;
+            session = std::move(found->second);
+            sessions.erase(found);
+        }
+        // The session might get closed right here, which is better done without holding the lock
+    }
+};
+
+static SessionRegistry& session_registry() {
+    static SessionRegistry registry;
+    return registry;
+}
+
+/**
+ * Runs the conversions started with ConversionSession.start(). One conversion per core by default
+ */
+static WorkerPool& conversion_pool() {
+    static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+/**
+ * Copies the fields of a tech.smallwonder.mp3fy.EncodingProfile into its native counterpart
+ */
+static EncodingProfile read_encoding_profile(JNIEnv* env, jobject profile_object) {
+    EncodingProfile profile;
+    if (!profile_object) return profile;
+
+    jclass profile_class = env->GetObjectClass(profile_object);
+    profile.sample_rate = env->GetIntField(profile_object, env->GetFieldID(profile_class, "sampleRate", "I"));
+    profile.channels = env->GetIntField(profile_object, env->GetFieldID(profile_class, "channels", "I"));
+    profile.resample_quality = env->GetIntField(profile_object, env->GetFieldID(profile_class, "resampleQuality", "I"));
+    profile.bitrate_mode = env->GetIntField(profile_object, env->GetFieldID(profile_class, "bitrateMode", "I"));
+    profile.bitrate = env->GetIntField(profile_object, env->GetFieldID(profile_class, "bitrate", "I"));
+    profile.vbr_quality = env->GetIntField(profile_object, env->GetFieldID(profile_class, "vbrQuality", "I"));
+    profile.speed_tier = env->GetIntField(profile_object, env->GetFieldID(profile_class, "speedTier", "I"));
+    env->DeleteLocalRef(profile_class);
+
+    return profile;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_initializeNative(JNIEnv *env, jobject thiz, jstring input_file,
+                                                   jint input_fd, jstring output_file,
+                                                   jboolean allow_stream_copy, jobject profile) {
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Starting library initialization...");
+    jboolean isCopy = JNI_TRUE;
+    auto media = open_input_file(input_file ? env->GetStringUTFChars(input_file, &isCopy) : nullptr, input_fd);
+    if (!media) return -1;
+
+    media->profile = read_encoding_profile(env, profile);
+
+    if (!open_output_file(media, env->GetStringUTFChars(output_file, &isCopy), allow_stream_copy)) {
+        discard_output_file(media);
+        close_input_file(media);
+        delete media;
+        return -1;
+    }
+
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Successfully initialized the library!");
+
+    return session_registry().add(media);
+}
+
+// Where a MediaInput reads from, these have to match the TYPE_* constants in MediaInput.java
+enum MediaInputType {
+    MEDIA_INPUT_PATH = 0,
+    MEDIA_INPUT_FD = 1,
+    MEDIA_INPUT_BYTES = 2,
+    MEDIA_INPUT_DIRECT_BUFFER = 3,
+    MEDIA_INPUT_STREAM = 4,
+};
+
+// Where a MediaOutput writes to, these have to match the TYPE_* constants in MediaOutput.java
+enum MediaOutputType {
+    MEDIA_OUTPUT_PATH = 0,
+    MEDIA_OUTPUT_STREAM = 1,
+    MEDIA_OUTPUT_MEMORY = 2,
+};
+
+static jobject get_object_field(JNIEnv* env, jobject object, const char* name, const char* signature) {
+    jclass object_class = env->GetObjectClass(object);
+    jobject value = env->GetObjectField(object, env->GetFieldID(object_class, name, signature));
+    env->DeleteLocalRef(object_class);
+    return value;
+}
+
+static jint get_int_field(JNIEnv* env, jobject object, const char* name) {
+    jclass object_class = env->GetObjectClass(object);
+    jint value = env->GetIntField(object, env->GetFieldID(object_class, name, "I"));
+    env->DeleteLocalRef(object_class);
+    return value;
+}
+
+static std::string get_string_field(JNIEnv* env, jobject object, const char* name) {
+    auto value = (jstring)get_object_field(env, object, name, "Ljava/lang/String;");
+    if (!value) return "";
+
+    const char* chars = env->GetStringUTFChars(value, nullptr);
+    std::string string = chars;
+    env->ReleaseStringUTFChars(value, chars);
+    env->DeleteLocalRef(value);
+    return string;
+}
+
+/**
+ * Opens the input described by a tech.smallwonder.mp3fy.MediaInput. A direct ByteBuffer is read where it is, the
+ * buffer only stays referenced until the input is closed. A byte array is copied once, since the VM may move it
+ */
+static Media* open_media_input(JNIEnv* env, jobject input) {
+    std::string path = get_string_field(env, input, "path");
+    AVIOContext* io_context = nullptr;
+
+    switch (get_int_field(env, input, "type")) {
+        case MEDIA_INPUT_PATH:
+            return open_input_file(path.c_str());
+        case MEDIA_INPUT_FD:
+            return open_input_file(nullptr, get_int_field(env, input, "fd"));
+        case MEDIA_INPUT_BYTES: {
+            auto bytes = (jbyteArray)get_object_field(env, input, "bytes", "[B");
+            jint offset = get_int_field(env, input, "offset");
+            jint length = get_int_field(env, input, "length");
+            auto* data = bytes ? (uint8_t*)av_malloc(std::max(1, length)) : nullptr;
+            if (data) {
+                env->GetByteArrayRegion(bytes, offset, length, reinterpret_cast<jbyte*>(data));
+                io_context = create_memory_input(data, length, [data]() { av_free(data); });
+            }
+            if (bytes) env->DeleteLocalRef(bytes);
+            break;
+        }
+        case MEDIA_INPUT_DIRECT_BUFFER: {
+            jobject buffer = get_object_field(env, input, "buffer", "Ljava/nio/ByteBuffer;");
+            auto* address = buffer ? static_cast<uint8_t*>(env->GetDirectBufferAddress(buffer)) : nullptr;
+            if (address) {
+                JavaVM* vm;
+                env->GetJavaVM(&vm);
+                jobject reference = env->NewGlobalRef(buffer);
+                io_context = create_memory_input(address + get_int_field(env, input, "offset"), get_int_field(env, input, "length"), [vm, reference]() {
+                    JNIEnv* release_env = attach_current_thread(vm);
+                    if (release_env) release_env->DeleteGlobalRef(reference);
+                });
+            }
+            if (buffer) env->DeleteLocalRef(buffer);
+            break;
+        }
+        case MEDIA_INPUT_STREAM: {
+            jobject stream = get_object_field(env, input, "stream", "Ljava/io/InputStream;");
+            if (stream) {
+                io_context = create_java_input(env, stream);
+                env->DeleteLocalRef(stream);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    if (!io_context) return nullptr;
+    // The path is only a name here, its extension helps probing
+    return open_input_file(path.empty() ? nullptr : path.c_str(), -1, io_context);
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_initializeWithIoNative(JNIEnv *env, jobject thiz, jobject input, jobject output,
+                                                         jboolean allow_stream_copy, jobject profile) {
+    auto media = open_media_input(env, input);
+    if (!media) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not open the input");
+        return -1;
+    }
+
+    media->profile = read_encoding_profile(env, profile);
+
+    // Outputs that aren't files are only named for their format
+    std::string url = get_string_field(env, output, "path");
+    AVIOContext* io_context = nullptr;
+    int output_type = get_int_field(env, output, "type");
+    if (output_type != MEDIA_OUTPUT_PATH) {
+        url = "output." + get_string_field(env, output, "format");
+        if (output_type == MEDIA_OUTPUT_MEMORY) {
+            io_context = create_memory_output(&media->output_memory);
+        } else {
+            jobject stream = get_object_field(env, output, "stream", "Ljava/io/OutputStream;");
+            if (stream) {
+                io_context = create_java_output(env, stream);
+                env->DeleteLocalRef(stream);
+            }
+        }
+    }
+
+    bool opened = (output_type == MEDIA_OUTPUT_PATH || io_context) && open_output_file(media, url.c_str(), allow_stream_copy, io_context);
+    if (!opened) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not open the output");
+        discard_output_file(media);
+        close_input_file(media);
+        delete media;
+        return -1;
+    }
+
+    return session_registry().add(media);
+}
+
+static bool convert_serial(Media* media) {
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Starting work now...");
+    while (!media->range_done && av_read_frame(media->input_format_context, media->decoder_packet) >= 0) {
+        if (media->decoder_packet->stream_index != media->audio_stream_index) {
+            av_packet_unref(media->decoder_packet);
+            continue;
+        }
+        if (send_packet(media)) {
+            while (receive_frame(media)) {
+                // Send to the encoder every full frame we have by now
+                while (fill_output_frame(media)) {
+                    if (send_frame(media)) {
+                        while (receive_packet(media)) {
+                            if (write_frame(media)) {
+                                if (media->decoder_packet->pts != AV_NOPTS_VALUE) {
+                                    update_percentage(media, media->decoder_packet);
+                                    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Wrote frame %d%s", media->percentage.load(), "%");
+                                }
+                            }
+                            av_packet_unref(media->encoder_packet);
+                        }
+                    }
+                }
+            }
+        }
+
+        av_packet_unref(media->decoder_packet);
+    }
+
+    // Drain the buffer
+    flush_resampler(media);
+    while (fill_output_frame(media, true) > 0) {
+        if (send_frame(media)) {
+            while (receive_packet(media)) {
+                write_frame(media);
+                av_packet_unref(media->encoder_packet);
+            }
+        }
+    }
+
+    // And then the encoder
+    bool converted = avcodec_send_frame(media->encoder_context, nullptr) >= 0;
+    while (receive_packet(media)) {
+        converted = write_frame(media) && converted;
+        av_packet_unref(media->encoder_packet);
+    }
+
+    return converted;
+}
+
+static bool convert(Media* media, int mode) {
+    if (media->stream_copy) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Starting stream copy...");
+        return convert_stream_copy(media);
+    }
+
+    if (!seek_to_range(media)) return false;
+
+    if (mode == CONVERSION_MODE_SEGMENTED && has_range(media)) {
+        // Segments cover the whole input. A range is usually short anyway
+        mode = CONVERSION_MODE_PIPELINED;
+    }
+
+    if (mode == CONVERSION_MODE_SEGMENTED) {
+        bool attempted;
+        bool converted = convert_segmented(media, &attempted);
+        if (attempted) return converted;
+
+        // Too short to be worth splitting, the pipeline is the next best thing
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Input too short for segments, converting in one piece");
+        mode = CONVERSION_MODE_PIPELINED;
+    }
+
+    if (mode == CONVERSION_MODE_PIPELINED) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Starting pipelined conversion...");
+        return convert_pipelined(media);
+    }
+
+    return convert_serial(media);
+}
+
+/**
+ * Converts the media of a session on the calling thread and closes its files
+ * @return true if the whole conversion succeeded
+ */
+static bool run_session(Session* session, int mode) {
+    Media* media = session->media;
+
+    auto started = std::chrono::steady_clock::now();
+    double audio_seconds = media->input_format_context->duration / (double)AV_TIME_BASE;
+
+    bool converted = convert(media, mode);
+
+    converted = close_output_file(media, !converted) && converted;
+
+    close_input_file(media);
+    session->state = converted ? SESSION_SUCCEEDED : SESSION_FAILED;
+
+    // Realtime factor, to compare encoding profiles and conversion modes
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    if (audio_seconds > 0 && elapsed > 0) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Session %lld: converted %.1fs of audio in %.2fs (%.1fx realtime)",
+                            (long long)session->id, audio_seconds, elapsed, audio_seconds / elapsed);
+    }
+
+    return converted;
+}
+
+static void notify_session_finished(JavaVM* vm, Session* session, bool converted) {
+    // Stays attached, the pool threads call back into Java for every session (and stream IO might have attached it)
+    JNIEnv* env = attach_current_thread(vm);
+    if (!env) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not attach to the VM, session %lld finished unnoticed", (long long)session->id);
+        return;
+    }
+
+    jclass session_class = env->GetObjectClass(session->callback);
+    env->CallVoidMethod(session->callback, env->GetMethodID(session_class, "onFinished", "(Z)V"), (jboolean)converted);
+    if (env->ExceptionCheck()) {
+        // A listener threw. There is no Java frame up this thread to pass it to
+        env->ExceptionClear();
+    }
+    env->DeleteLocalRef(session_class);
+    env->DeleteGlobalRef(session->callback);
+    session->callback = nullptr;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_tech_smallwonder_mp3fy_ConversionSession_convertNative(JNIEnv *env, jobject thiz, jlong session_id, jint mode) {
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Coming back to start the native conversion");
+    std::shared_ptr<Session> session = session_registry().find(session_id);
+    if (!session) return false;
+
+    int idle = SESSION_IDLE;
+    if (!session->state.compare_exchange_strong(idle, SESSION_RUNNING)) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Session %lld has already been started", (long long)session_id);
+        return false;
+    }
+
+    return run_session(session.get(), mode);
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_tech_smallwonder_mp3fy_ConversionSession_submitNative(JNIEnv *env, jobject thiz, jlong session_id, jint mode) {
+    std::shared_ptr<Session> session = session_registry().find(session_id);
+    if (!session) return false;
+
+    int idle = SESSION_IDLE;
+    if (!session->state.compare_exchange_strong(idle, SESSION_QUEUED)) return false;
+
+    JavaVM* vm;
+    env->GetJavaVM(&vm);
+    session->callback = env->NewGlobalRef(thiz);
+
+    WorkerPool& pool = conversion_pool();
+    // Segmented conversions get their share of the cores instead of all of them
+    session->media->thread_budget = std::max(1u, std::thread::hardware_concurrency() / (unsigned)pool.concurrency());
+
+    pool.submit(session_id, [vm, session, mode]() {
+        int queued = SESSION_QUEUED;
+        if (!session->state.compare_exchange_strong(queued, SESSION_RUNNING)) return;
+        bool converted = run_session(session.get(), mode);
+        notify_session_finished(vm, session.get(), converted);
+    });
+
+    return true;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_tech_smallwonder_mp3fy_ConversionSession_cancelNative(JNIEnv *env, jobject thiz, jlong session_id) {
+    std::shared_ptr<Session> session = session_registry().find(session_id);
+    if (!session) return false;
+
+    int queued = SESSION_QUEUED;
+    if (!conversion_pool().cancel(session_id) || !session->state.compare_exchange_strong(queued, SESSION_CANCELLED)) {
+        return false;
+    }
+
+    env->DeleteGlobalRef(session->callback);
+    session->callback = nullptr;
+    return true;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_tech_smallwonder_mp3fy_ConversionSession_setTimeRangeNative(JNIEnv *env, jobject thiz, jlong session_id,
+                                                                  jlong start_ms, jlong end_ms) {
+    std::shared_ptr<Session> session = session_registry().find(session_id);
+    if (!session || session->state != SESSION_IDLE) return false;
+
+    Media* media = session->media;
+    media->range_start = start_ms > 0 ? av_rescale(start_ms, AV_TIME_BASE, 1000) : AV_NOPTS_VALUE;
+    media->range_end = end_ms > 0 ? av_rescale(end_ms, AV_TIME_BASE, 1000) : AV_NOPTS_VALUE;
+    return true;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_tech_smallwonder_mp3fy_ConversionSession_getStateNative(JNIEnv *env, jobject thiz, jlong session_id) {
+    std::shared_ptr<Session> session = session_registry().find(session_id);
+    if (!session) return -1;
+
+    return session->state;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_tech_smallwonder_mp3fy_ConversionSession_getPercentageNative(JNIEnv *env, jobject thiz, jlong session_id) {
+    std::shared_ptr<Session> session = session_registry().find(session_id);
+    if (!session) return -1;
+
+    return session->media->percentage;
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_tech_smallwonder_mp3fy_ConversionSession_getOutputNative(JNIEnv *env, jobject thiz, jlong session_id) {
+    std::shared_ptr<Session> session = session_registry().find(session_id);
+    if (!session || session->state != SESSION_SUCCEEDED || !session->media->output_memory) return nullptr;
+
+    // No copy, the buffer points into the session's memory
+    std::vector<uint8_t>& output = *session->media->output_memory;
+    return env->NewDirectByteBuffer(output.data(), (jlong)output.size());
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_ConversionSession_releaseNative(JNIEnv *env, jobject thiz, jlong session_id) {
+    session_registry().remove(session_id);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setMaxConcurrentConversionsNative(JNIEnv *env, jobject thiz, jint count) {
+    conversion_pool().set_concurrency(count);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setReadBufferSizeNative(JNIEnv *env, jobject thiz, jint bytes) {
+    set_input_buffer_size(bytes);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setInputBackendNative(JNIEnv *env, jobject thiz, jint backend) {
+    set_input_backend(backend);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setOutputBackendNative(JNIEnv *env, jobject thiz, jint backend) {
+    set_output_backend(backend);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setWriteBufferSizeNative(JNIEnv *env, jobject thiz, jint bytes) {
+    set_output_buffer_size(bytes);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setOutputSyncIntervalNative(JNIEnv *env, jobject thiz, jlong bytes) {
+    set_output_sync_interval(bytes);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setIoThreadsNative(JNIEnv *env, jobject thiz, jint count) {
+    set_io_threads(count);
+}
+
+// How much of an input is looked at for its metadata, these have to match the PROBE_LEVEL_* constants in MP3fy.java
+enum ProbeLevel {
+    // Container tags, there as soon as the header is read
+    PROBE_LEVEL_TAGS = 0,
+    // Tags and the album art, which the demuxers read along with the header too
+    PROBE_LEVEL_TAGS_AND_ART = 1,
+    // Everything avformat_find_stream_info works out, by reading and decoding the start of the audio stream
+    PROBE_LEVEL_STREAM_INFO = 2,
+};
 
-        av_packet_unref(media->decoder_packet);
-    }
+// Limits passed to the demuxer as probesize and analyzeduration, 0 leaves FFmpeg's defaults
+static std::atomic<int64_t> probe_size{0};
+static std::atomic<int64_t> analyze_duration{0};
 
-    // Drain the buffer
-    while (fill_output_frame(media, true) > 0) {
-        if (send_frame(media)) {
-            while (receive_packet(media)) {
-                if (write_frame(media)) {} else {}
-            }
+/**
+ * Fills in the duration and bitrate from what the header said. Otherwise avformat_find_stream_info works them out, by
+ * reading (and decoding) the start of every stream
+ */
+static void estimate_header_timings(AVFormatContext* context) {
+    if (context->duration == AV_NOPTS_VALUE) {
+        for (unsigned int i = 0; i < context->nb_streams; i++) {
+            AVStream* stream = context->streams[i];
+            if (stream->duration == AV_NOPTS_VALUE || (stream->disposition & AV_DISPOSITION_ATTACHED_PIC)) continue;
+            int64_t duration = av_rescale_q(stream->duration, stream->time_base, AV_TIME_BASE_Q);
+            if (context->duration == AV_NOPTS_VALUE || duration > context->duration) context->duration = duration;
         }
     }
 
-    close_output_file(media);
-
-    close_input_file(media);
-
-    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Deleting media...");
-    delete media;
-    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Deleted media");
-
-    return true;
+    if (context->bit_rate <= 0) {
+        int64_t bit_rate = 0;
+        for (unsigned int i = 0; i < context->nb_streams; i++) {
+            if (!(context->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC)) bit_rate += context->streams[i]->codecpar->bit_rate;
+        }
+        if (bit_rate <= 0 && context->duration > 0 && context->pb) {
+            int64_t size = avio_size(context->pb);
+            if (size > 0) bit_rate = av_rescale(size * 8, AV_TIME_BASE, context->duration);
+        }
+        context->bit_rate = bit_rate;
+    }
 }
 
-static AVFormatContext* create_context_and_parse_header(const char* url) {
+/**
+ * Opens the input from url, or from fd if it isn't -1, for reading its metadata. Close it with close_input
+ * @param level One of the ProbeLevel values. Below PROBE_LEVEL_STREAM_INFO nothing is decoded, the duration and
+ * bitrate are the ones the header gives
+ */
+static AVFormatContext* create_context_and_parse_header(const char* url, int fd = -1, int level = PROBE_LEVEL_TAGS_AND_ART) {
     AVFormatContext* formatContext = nullptr;
 
-    if (avformat_open_input(&formatContext, url, nullptr, nullptr) < 0) {
+    AVDictionary* options = nullptr;
+    if (probe_size.load() > 0) av_dict_set_int(&options, "probesize", probe_size.load(), 0);
+    if (analyze_duration.load() > 0) av_dict_set_int(&options, "analyzeduration", analyze_duration.load(), 0);
+    int ret = open_input(&formatContext, url, fd, INPUT_ACCESS_PROBE, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Not able to open input file");
         return nullptr;
     }
 
-    if (avformat_find_stream_info(formatContext, nullptr) < 0) {
+    if (level < PROBE_LEVEL_STREAM_INFO) {
+        estimate_header_timings(formatContext);
+        return formatContext;
+    }
+
+    // Only the audio stream and the album art are of interest here, so stream info is not gathered for video
+    int audio_stream_index = av_find_best_stream(formatContext, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (audio_stream_index >= 0) {
+        discard_unused_streams(formatContext, audio_stream_index, true);
+    }
+
+    if (find_stream_info(formatContext) < 0) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy",
                             "Unable to find information about this input stream");
+        close_input(&formatContext);
         return nullptr;
     }
 
     return formatContext;
 }
 
-
-static jclass create_java_class(JNIEnv* env, const std::string& fullQualifiedName) {
-    return env->FindClass(fullQualifiedName.c_str());
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setProbeLimitsNative(JNIEnv *env, jobject thiz, jlong size, jlong duration_ms) {
+    probe_size = std::max<jlong>(0, size);
+    analyze_duration = std::max<jlong>(0, duration_ms) * 1000;
 }
 
-static std::map<std::string, std::string> get_all_metadata(AVFormatContext* format_context) {
-    std::map<std::string, std::string> metadatas;
+
+/**
+ * Describes an input opened with create_context_and_parse_header, the way the metadata cache keeps it
+ */
+static CachedMetadata describe_input(AVFormatContext* context, int level) {
+    CachedMetadata metadata;
+    // Both levels below PROBE_LEVEL_STREAM_INFO read the same header, the album art comes with it
+    metadata.probe_level = std::max<int>(level, PROBE_LEVEL_TAGS_AND_ART);
+    metadata.duration = context->duration != AV_NOPTS_VALUE ? context->duration : 0;
+    metadata.bit_rate = context->bit_rate;
+
+    metadata.audio_stream = av_find_best_stream(context, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (metadata.audio_stream >= 0) {
+        AVCodecParameters* parameters = context->streams[metadata.audio_stream]->codecpar;
+        metadata.codec_id = parameters->codec_id;
+        metadata.sample_rate = parameters->sample_rate;
+        metadata.channels = parameters->channels;
+    } else {
+        metadata.audio_stream = -1;
+    }
+
+    for (unsigned int i = 0; i < context->nb_streams; i++) {
+        if (context->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC) {
+            metadata.album_art_stream = i;
+            metadata.album_art_size = context->streams[i]->attached_pic.size;
+            metadata.album_art_hash = hash_album_art(context->streams[i]->attached_pic.data, metadata.album_art_size);
+            break;
+        }
+    }
 
     AVDictionaryEntry* tag = nullptr;
-    while ((tag = av_dict_get(format_context->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
-        metadatas[std::string(tag->key)] = std::string(tag->value);
+    while ((tag = av_dict_get(context->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
+        metadata.tags.emplace_back(tag->key, tag->value);
+    }
+    return metadata;
+}
 
-        __android_log_print(ANDROID_LOG_INFO, "MP3Fy",
-                            "[Key: %s, Value: %s]", tag->key, tag->value);
+/**
+ * Reads the metadata of the input at level, from the metadata cache if it's a local file that hasn't changed since
+ * it was last probed. Inputs given as a descriptor are always probed
+ * @param context If not null, gets the input opened for the probe (null on a cache hit) instead of it being closed,
+ * for whatever the cache doesn't keep (the album art). Close it with close_input
+ * @return false if the input couldn't be opened
+ */
+static bool probe_metadata(const char* url, int fd, int level, CachedMetadata* metadata, AVFormatContext** context = nullptr) {
+    if (context) *context = nullptr;
+
+    CachedFileKey key;
+    bool cacheable = url && fd == -1;
+    if (cacheable && find_cached_metadata(url, level, metadata, &key)) return true;
+
+    AVFormatContext* format_context = create_context_and_parse_header(url, fd, level);
+    if (!format_context) return false;
+
+    *metadata = describe_input(format_context, level);
+    if (cacheable) store_cached_metadata(url, key, *metadata);
+
+    if (context) {
+        *context = format_context;
+    } else {
+        close_input(&format_context);
     }
+    return true;
+}
 
-    return metadatas;
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setMetadataCacheNative(JNIEnv *env, jobject thiz, jstring path) {
+    if (!path) return open_metadata_cache(nullptr);
+
+    const char* chars = env->GetStringUTFChars(path, nullptr);
+    bool opened = open_metadata_cache(chars);
+    env->ReleaseStringUTFChars(path, chars);
+    return opened;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_compactMetadataCacheNative(JNIEnv *env, jobject thiz, jboolean drop_missing) {
+    return compact_metadata_cache(drop_missing);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_clearMetadataCacheNative(JNIEnv *env, jobject thiz) {
+    clear_metadata_cache();
+}
+
+static jclass create_java_class(JNIEnv* env, const std::string& fullQualifiedName) {
+    return env->FindClass(fullQualifiedName.c_str());
 }
 
 /**
- * Gets the album art from this format context and returns it as a shared pointer (so that the memory doesn't have to be freed by anybody when it goes out of scope)
- * @param format_context The format context associated with the audio file to extract its album art
- * @param size The size of the returned album art.
- * @return
+ * Gets the stream holding the album art of this format context, its picture is the stream's attached_pic
+ * @return null if there's no album art
  */
-static std::shared_ptr<signed char> get_album_art(AVFormatContext* format_context, int* size) {
+static const AVStream* get_album_art(AVFormatContext* format_context) {
     for (int i = 0; i < format_context->nb_streams; i++) {
         if (format_context->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC) {
-            AVPacket packet = format_context->streams[i]->attached_pic;
-            *size = packet.size;
-            std::shared_ptr<signed char> art_ptr(new signed char[packet.size]);
-            std::memcpy(art_ptr.get(), packet.data, packet.size);
-            return art_ptr;
+            return format_context->streams[i];
         }
     }
 
-    return std::shared_ptr<signed char>(nullptr);
+    return nullptr;
 }
 
-static std::map<std::string, std::string> get_metadata_list(const std::string& filePath) {
+static std::map<std::string, std::string> get_metadata_list(const char* path, int fd) {
     std::map<std::string, std::string> metadatas;
 
-    auto formatContext = create_context_and_parse_header(filePath.c_str());
-
-    if (!formatContext) {
+    CachedMetadata metadata;
+    if (!probe_metadata(path, fd, PROBE_LEVEL_TAGS, &metadata)) {
         return metadatas;
     }
 
-    metadatas = get_all_metadata(formatContext);
-
-//    avformat_close_input(&formatContext);
-    av_free(formatContext);
+    metadatas.insert(metadata.tags.begin(), metadata.tags.end());
 
     return metadatas;
 }
 
-static jobject get_jni_metadatas(JNIEnv* env, AVFormatContext* context) {
+static jobject get_jni_metadatas(JNIEnv* env, const std::vector<std::pair<std::string, std::string>>& metadata_list) {
     jclass hashMapClass = create_java_class(env, "java/util/HashMap");
     jmethodID init = env->GetMethodID(hashMapClass, "<init>", "()V");
 
     jobject hashMap = env->NewObject(hashMapClass, init);
 
     jmethodID putMethodID = env->GetMethodID(hashMapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
-    jboolean isCopy;
-
-    auto metadata_list = get_all_metadata(context);
-
     std::for_each(metadata_list.begin(), metadata_list.end(), [&](const std::pair<std::string, std::string>& pair) {
         jstring key_java = env->NewStringUTF(pair.first.c_str());
         jstring value_java = env->NewStringUTF(pair.second.c_str());
@@ -447,26 +2188,26 @@ static jobject get_jni_metadatas(JNIEnv* env, AVFormatContext* context) {
 }
 
 static jobject get_jni_bitmap(JNIEnv* env, AVFormatContext* format_context) {
-    int size;
-    auto album_art = get_album_art(format_context, &size);
+    auto album_art = get_album_art(format_context);
 
     if (album_art != nullptr) {
+        int size = album_art->attached_pic.size;
 
         jclass bitmap_factory_class = create_java_class(env, "android/graphics/BitmapFactory");
         jmethodID decode_bitmap_method_id = env->GetStaticMethodID(bitmap_factory_class, "decodeByteArray", "([BII)Landroid/graphics/Bitmap;");
 
         // Create the new byte array
         auto byte_array = env->NewByteArray(size);
-        env->SetByteArrayRegion(byte_array, 0, size, album_art.get());
+        env->SetByteArrayRegion(byte_array, 0, size, reinterpret_cast<const jbyte*>(album_art->attached_pic.data));
 
         jobject bitmap = env->CallStaticObjectMethod(bitmap_factory_class, decode_bitmap_method_id, byte_array, 0, size);
 
         jobject final_bitmap = env->NewGlobalRef(bitmap);
 
+        env->DeleteLocalRef(bitmap);
+        env->DeleteLocalRef(byte_array);
         env->DeleteLocalRef(bitmap_factory_class);
 
-        av_free(format_context);
-
         return final_bitmap;
     }
 
@@ -475,7 +2216,7 @@ static jobject get_jni_bitmap(JNIEnv* env, AVFormatContext* format_context) {
 
 extern "C"
 JNIEXPORT jobject JNICALL
-Java_tech_smallwonder_mp3fy_MP3fy_getAllMetadataNative(JNIEnv *env, jobject thiz, jstring path) {
+Java_tech_smallwonder_mp3fy_MP3fy_getAllMetadataNative(JNIEnv *env, jobject thiz, jstring path, jint fd) {
 
     jclass hashMapClass = create_java_class(env, "java/util/HashMap");
     jmethodID init = env->GetMethodID(hashMapClass, "<init>", "()V");
@@ -485,7 +2226,7 @@ Java_tech_smallwonder_mp3fy_MP3fy_getAllMetadataNative(JNIEnv *env, jobject thiz
     jmethodID putMethodID = env->GetMethodID(hashMapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
     jboolean isCopy;
 
-    auto metadata_list = get_metadata_list(std::string(env->GetStringUTFChars(path, &isCopy)));
+    auto metadata_list = get_metadata_list(path ? env->GetStringUTFChars(path, &isCopy) : nullptr, fd);
 
     std::for_each(metadata_list.begin(), metadata_list.end(), [&](const std::pair<std::string, std::string>& pair) {
         jstring key_java = env->NewStringUTF(pair.first.c_str());
@@ -506,7 +2247,7 @@ Java_tech_smallwonder_mp3fy_MP3fy_getAllMetadataNative(JNIEnv *env, jobject thiz
 
 extern "C"
 JNIEXPORT jobject JNICALL
-Java_tech_smallwonder_mp3fy_MP3fy_getAudioFileInfoNative(JNIEnv *env, jobject thiz, jstring path) {
+Java_tech_smallwonder_mp3fy_MP3fy_getAudioFileInfoNative(JNIEnv *env, jobject thiz, jstring path, jint fd, jint level) {
     jclass audio_file_info_class = create_java_class(env, "tech/smallwonder/mp3fy/AudioFileInfo");
     jmethodID init = env->GetMethodID(audio_file_info_class, "<init>", "()V");
     jobject audio_file_info = env->NewObject(audio_file_info_class, init);
@@ -518,16 +2259,23 @@ Java_tech_smallwonder_mp3fy_MP3fy_getAudioFileInfoNative(JNIEnv *env, jobject th
 
     jboolean isCopy = JNI_FALSE;
 
-    auto formatContext = create_context_and_parse_header(env->GetStringUTFChars(path, &isCopy));
+    const char* url = path ? env->GetStringUTFChars(path, &isCopy) : nullptr;
+    CachedMetadata metadata;
+    AVFormatContext* formatContext = nullptr;
 
-    if (!formatContext) {
+    if (!probe_metadata(url, fd, level, &metadata, &formatContext)) {
         return nullptr;
     }
 
-    env->SetIntField(audio_file_info, bitrate_field, formatContext->bit_rate);
-    env->SetLongField(audio_file_info, duration_field, formatContext->duration);
-    env->SetObjectField(audio_file_info, metadata_list_field, get_jni_metadatas(env, formatContext));
-    env->SetObjectField(audio_file_info, bitmap_field, get_jni_bitmap(env, formatContext));
+    env->SetIntField(audio_file_info, bitrate_field, metadata.bit_rate);
+    env->SetLongField(audio_file_info, duration_field, metadata.duration);
+    env->SetObjectField(audio_file_info, metadata_list_field, get_jni_metadatas(env, metadata.tags));
+    if (level >= PROBE_LEVEL_TAGS_AND_ART && metadata.album_art_stream >= 0) {
+        // The cache only knows there is album art, the file has to be opened for it
+        if (!formatContext) formatContext = create_context_and_parse_header(url, fd, PROBE_LEVEL_TAGS_AND_ART);
+        if (formatContext) env->SetObjectField(audio_file_info, bitmap_field, get_jni_bitmap(env, formatContext));
+    }
+    close_input(&formatContext);
 
     jobject audio_file_info_global = env->NewGlobalRef(audio_file_info);
     env->DeleteLocalRef(audio_file_info_class);
@@ -538,22 +2286,532 @@ Java_tech_smallwonder_mp3fy_MP3fy_getAudioFileInfoNative(JNIEnv *env, jobject th
 
 extern "C"
 JNIEXPORT jobject JNICALL
-Java_tech_smallwonder_mp3fy_MP3fy_getAlbumArtNative(JNIEnv *env, jobject thiz, jstring path) {
+Java_tech_smallwonder_mp3fy_MP3fy_getAlbumArtNative(JNIEnv *env, jobject thiz, jstring path, jint fd) {
     jboolean isCopy = JNI_FALSE;
-    auto formatContext = create_context_and_parse_header(env->GetStringUTFChars(path, &isCopy));
+    auto formatContext = create_context_and_parse_header(path ? env->GetStringUTFChars(path, &isCopy) : nullptr, fd);
 
     if (!formatContext) {
         return nullptr;
     }
 
-    return get_jni_bitmap(env, formatContext);
-}extern "C"
-JNIEXPORT jint JNICALL
-Java_tech_smallwonder_mp3fy_MP3fy_getPercentageNative(JNIEnv *env, jobject thiz, jlong media_id) {
-    auto* media = reinterpret_cast<Media*>(media_id);
-    if (!media) return -1;
+    jobject bitmap = get_jni_bitmap(env, formatContext);
+    close_input(&formatContext);
+    return bitmap;
+}
+
+/**
+ * Decodes the album art of the input into a thumbnail, see decode_thumbnail. Files the metadata cache knows to have
+ * no album art aren't even opened
+ * @return 0 on success, a negative AVERROR otherwise
+ */
+static int decode_album_art_thumbnail(JNIEnv* env, const char* url, int fd, uint8_t* pixels, int width, int height, int stride, int format) {
+    CachedMetadata metadata;
+    AVFormatContext* context = nullptr;
+    if (!probe_metadata(url, fd, PROBE_LEVEL_TAGS_AND_ART, &metadata, &context)) return AVERROR(EIO);
+    if (metadata.album_art_stream < 0) {
+        close_input(&context);
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+
+    // With the metadata cached too, a cover that has been seen before costs neither opening the file nor decoding
+    if (metadata.album_art_hash &&
+        find_cached_thumbnail(metadata.album_art_hash, metadata.album_art_size, pixels, width, height, stride, format)) {
+        close_input(&context);
+        return 0;
+    }
+
+    if (!context) context = create_context_and_parse_header(url, fd, PROBE_LEVEL_TAGS_AND_ART);
+    if (!context) return AVERROR(EIO);
+
+    const AVStream* album_art = get_album_art(context);
+    int ret = album_art ? decode_thumbnail(env, album_art, pixels, width, height, stride, format) : AVERROR_STREAM_NOT_FOUND;
+    close_input(&context);
+    return ret;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_getAlbumArtThumbnailNative(JNIEnv *env, jobject thiz, jstring path, jint fd,
+                                                              jobject bitmap) {
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, bitmap, &info) != ANDROID_BITMAP_RESULT_SUCCESS) return JNI_FALSE;
+
+    int format;
+    if (info.format == ANDROID_BITMAP_FORMAT_RGBA_8888) {
+        format = THUMBNAIL_FORMAT_RGBA_8888;
+    } else if (info.format == ANDROID_BITMAP_FORMAT_RGB_565) {
+        format = THUMBNAIL_FORMAT_RGB_565;
+    } else {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Thumbnails only go to ARGB_8888 and RGB_565 bitmaps");
+        return JNI_FALSE;
+    }
+
+    const char* url = path ? env->GetStringUTFChars(path, nullptr) : nullptr;
+    void* pixels = nullptr;
+    int ret = AVERROR(EINVAL);
+    if (AndroidBitmap_lockPixels(env, bitmap, &pixels) == ANDROID_BITMAP_RESULT_SUCCESS) {
+        ret = decode_album_art_thumbnail(env, url, fd, static_cast<uint8_t*>(pixels), info.width, info.height, info.stride, format);
+        AndroidBitmap_unlockPixels(env, bitmap);
+    }
+    if (url) env->ReleaseStringUTFChars(path, url);
+    return ret == 0;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_getAlbumArtPixelsNative(JNIEnv *env, jobject thiz, jstring path, jint fd,
+                                                           jobject buffer, jint width, jint height, jint format) {
+    auto* pixels = static_cast<uint8_t*>(env->GetDirectBufferAddress(buffer));
+    int stride = width * thumbnail_bytes_per_pixel(format);
+    if (!pixels || stride <= 0 || height <= 0 || env->GetDirectBufferCapacity(buffer) < (jlong)stride * height) {
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "The thumbnail needs a direct buffer of at least %d bytes", stride * height);
+        return JNI_FALSE;
+    }
+
+    const char* url = path ? env->GetStringUTFChars(path, nullptr) : nullptr;
+    int ret = decode_album_art_thumbnail(env, url, fd, pixels, width, height, stride, format);
+    if (url) env->ReleaseStringUTFChars(path, url);
+    return ret == 0;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setAlbumArtCacheSizeNative(JNIEnv *env, jobject thiz, jlong bytes) {
+    set_thumbnail_cache_size(bytes);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_getAlbumArtCacheStatsNative(JNIEnv *env, jobject thiz) {
+    ThumbnailCacheStats stats = get_thumbnail_cache_stats();
+    jclass stats_class = create_java_class(env, "tech/smallwonder/mp3fy/AlbumArtCacheStats");
+    jmethodID init = env->GetMethodID(stats_class, "<init>", "(JJJJ)V");
+    jobject stats_object = env->NewObject(stats_class, init, (jlong)stats.hits, (jlong)stats.misses, (jlong)stats.entries, (jlong)stats.bytes);
+    env->DeleteLocalRef(stats_class);
+    return stats_object;
+}
+
+/**
+ * A MediaProbe: the album art packet, referenced from the demuxer's buffer so it outlives the closed input
+ */
+struct MediaProbe {
+    jlong id = 0;
+    AVPacket* album_art = nullptr;
+    AVCodecID album_art_codec = AV_CODEC_ID_NONE;
+
+    ~MediaProbe() {
+        av_packet_free(&album_art);
+    }
+};
+
+/**
+ * Maps the handles given to Java to their probes, like SessionRegistry does for conversions
+ */
+struct ProbeRegistry {
+    std::mutex mutex;
+    std::map<jlong, std::shared_ptr<MediaProbe>> probes;
+    jlong next_id = 1;
+
+    jlong add(const std::shared_ptr<MediaProbe>& probe) {
+        std::lock_guard<std::mutex> lock(mutex);
+        probe->id = next_id++;
+        probes[probe->id] = probe;
+        return probe->id;
+    }
+
+    std::shared_ptr<MediaProbe> find(jlong id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto probe = probes.find(id);
+        return probe == probes.end() ? nullptr : probe->second;
+    }
+
+    void remove(jlong id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        probes.erase(id);
+    }
+};
+
+static ProbeRegistry& probe_registry() {
+    static ProbeRegistry registry;
+    return registry;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_probeNative(JNIEnv *env, jobject thiz, jstring path, jint fd) {
+    const char* url = path ? env->GetStringUTFChars(path, nullptr) : nullptr;
+    CachedMetadata metadata;
+    AVFormatContext* context = nullptr;
+    bool probed = probe_metadata(url, fd, PROBE_LEVEL_TAGS_AND_ART, &metadata, &context);
+    // A cache hit doesn't bring the album art along, it only tells whether there's some to open the file for
+    if (probed && metadata.album_art_stream >= 0 && !context) {
+        context = create_context_and_parse_header(url, fd, PROBE_LEVEL_TAGS_AND_ART);
+        probed = context != nullptr;
+    }
+    if (url) env->ReleaseStringUTFChars(path, url);
+    if (!probed) return -1;
+
+    std::shared_ptr<MediaProbe> probe(new MediaProbe);
+    const AVStream* album_art = context ? get_album_art(context) : nullptr;
+    if (album_art && album_art->attached_pic.size > 0) {
+        // Another reference to the demuxer's buffer, which stays around once the input is closed
+        probe->album_art = av_packet_alloc();
+        if (probe->album_art && av_packet_ref(probe->album_art, &album_art->attached_pic) < 0) av_packet_free(&probe->album_art);
+        probe->album_art_codec = album_art->codecpar->codec_id;
+    }
+    close_input(&context);
+
+    return probe_registry().add(probe);
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_tech_smallwonder_mp3fy_MediaProbe_getAlbumArtNative(JNIEnv *env, jobject thiz, jlong probe_id) {
+    std::shared_ptr<MediaProbe> probe = probe_registry().find(probe_id);
+    if (!probe || !probe->album_art) return nullptr;
+
+    // Reads the packet in place, it stays valid until the probe is released (MediaProbe drops the buffer then)
+    return env->NewDirectByteBuffer(probe->album_art->data, probe->album_art->size);
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_tech_smallwonder_mp3fy_MediaProbe_getAlbumArtMimeTypeNative(JNIEnv *env, jobject thiz, jlong probe_id) {
+    std::shared_ptr<MediaProbe> probe = probe_registry().find(probe_id);
+    if (!probe || !probe->album_art) return nullptr;
+
+    const AVCodecDescriptor* descriptor = avcodec_descriptor_get(probe->album_art_codec);
+    if (!descriptor || !descriptor->mime_types || !descriptor->mime_types[0]) return nullptr;
+    return env->NewStringUTF(descriptor->mime_types[0]);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MediaProbe_releaseNative(JNIEnv *env, jobject thiz, jlong probe_id) {
+    probe_registry().remove(probe_id);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+//                             METADATA SCAN                                    //
+
+/////////////////////////////////////////////////////////////////////////////////
+
+static const int DEFAULT_SCAN_BATCH_SIZE = 64;
+
+struct ScannedFile {
+    std::string path;
+    CachedMetadata metadata;
+};
+
+/**
+ * One MetadataScan, from startNative until it's finished and released (whichever ends last)
+ */
+struct MetadataScan {
+    jlong id = 0;
+    JavaVM* vm = nullptr;
+    // Global reference to the Java MetadataScan, the batches go to it
+    jobject callback = nullptr;
+    int probe_level = PROBE_LEVEL_TAGS;
+    size_t batch_size = DEFAULT_SCAN_BATCH_SIZE;
+    // Lowercase, without the dot. Empty for every file
+    std::vector<std::string> extensions;
+    std::atomic<bool> cancelled{false};
+    std::atomic<int64_t> found{0};
+    std::atomic<int64_t> done{0};
+    // Set once every file to read has been found, from then on done reaching found means the end
+    std::atomic<bool> listed{false};
+    std::atomic<bool> finished{false};
+    std::mutex mutex;
+    std::vector<ScannedFile> pending;
+    // Java gets one batch at a time
+    std::mutex delivery;
+};
+
+/**
+ * Maps the handles given to Java to their scans, like SessionRegistry does for conversions
+ */
+struct ScanRegistry {
+    std::mutex mutex;
+    std::map<jlong, std::shared_ptr<MetadataScan>> scans;
+    jlong next_id = 1;
+
+    jlong add(const std::shared_ptr<MetadataScan>& scan) {
+        std::lock_guard<std::mutex> lock(mutex);
+        scan->id = next_id++;
+        scans[scan->id] = scan;
+        return scan->id;
+    }
+
+    std::shared_ptr<MetadataScan> find(jlong id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto scan = scans.find(id);
+        return scan == scans.end() ? nullptr : scan->second;
+    }
+
+    void remove(jlong id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        scans.erase(id);
+    }
+};
+
+static ScanRegistry& scan_registry() {
+    static ScanRegistry registry;
+    return registry;
+}
+
+/**
+ * Reads the files of every metadata scan, one thread per core. Separate from the conversion pool, so a library scan
+ * doesn't hold conversions up
+ */
+static WorkerPool& scan_pool() {
+    static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+/**
+ * Hands a batch to the Java MetadataScan in a single call, as flat arrays
+ */
+static void deliver_batch(MetadataScan* scan, const std::vector<ScannedFile>& files) {
+    if (files.empty()) return;
+    JNIEnv* env = attach_current_thread(scan->vm);
+    if (!env) return;
+
+    auto count = (jsize)files.size();
+    jclass string_class = env->FindClass("java/lang/String");
+    jobjectArray paths = env->NewObjectArray(count, string_class, nullptr);
+    jlongArray durations = env->NewLongArray(count);
+    jintArray bit_rates = env->NewIntArray(count);
+    jbooleanArray album_art = env->NewBooleanArray(count);
+    jintArray tag_counts = env->NewIntArray(count);
+
+    jsize tag_strings = 0;
+    for (const ScannedFile& file : files) tag_strings += (jsize)file.metadata.tags.size() * 2;
+    jobjectArray tags = env->NewObjectArray(tag_strings, string_class, nullptr);
+
+    std::vector<jlong> duration_values;
+    std::vector<jint> bit_rate_values;
+    std::vector<jboolean> album_art_values;
+    std::vector<jint> tag_count_values;
+    jsize tag_index = 0;
+    for (jsize i = 0; i < count; i++) {
+        const ScannedFile& file = files[i];
+        jstring path = env->NewStringUTF(file.path.c_str());
+        env->SetObjectArrayElement(paths, i, path);
+        env->DeleteLocalRef(path);
+
+        duration_values.push_back(file.metadata.duration);
+        bit_rate_values.push_back((jint)file.metadata.bit_rate);
+        album_art_values.push_back(file.metadata.album_art_stream >= 0);
+        tag_count_values.push_back((jint)file.metadata.tags.size());
+
+        for (const auto& tag : file.metadata.tags) {
+            jstring key = env->NewStringUTF(tag.first.c_str());
+            jstring value = env->NewStringUTF(tag.second.c_str());
+            env->SetObjectArrayElement(tags, tag_index++, key);
+            env->SetObjectArrayElement(tags, tag_index++, value);
+            env->DeleteLocalRef(key);
+            env->DeleteLocalRef(value);
+        }
+    }
+    env->SetLongArrayRegion(durations, 0, count, duration_values.data());
+    env->SetIntArrayRegion(bit_rates, 0, count, bit_rate_values.data());
+    env->SetBooleanArrayRegion(album_art, 0, count, album_art_values.data());
+    env->SetIntArrayRegion(tag_counts, 0, count, tag_count_values.data());
+
+    jclass scan_class = env->GetObjectClass(scan->callback);
+    jmethodID on_batch = env->GetMethodID(scan_class, "onBatch", "([Ljava/lang/String;[J[I[Z[I[Ljava/lang/String;)V");
+    env->CallVoidMethod(scan->callback, on_batch, paths, durations, bit_rates, album_art, tag_counts, tags);
+    if (env->ExceptionCheck()) {
+        // The listener threw. There is no Java frame up this thread to pass it to
+        env->ExceptionClear();
+    }
+
+    env->DeleteLocalRef(scan_class);
+    env->DeleteLocalRef(tags);
+    env->DeleteLocalRef(tag_counts);
+    env->DeleteLocalRef(album_art);
+    env->DeleteLocalRef(bit_rates);
+    env->DeleteLocalRef(durations);
+    env->DeleteLocalRef(paths);
+    env->DeleteLocalRef(string_class);
+}
+
+/**
+ * Delivers what's left and tells Java the scan is over, once every file found has been read
+ */
+static void finish_scan_if_done(MetadataScan* scan) {
+    if (!scan->listed || scan->done.load() != scan->found.load()) return;
+    bool finished = false;
+    if (!scan->finished.compare_exchange_strong(finished, true)) return;
+
+    std::vector<ScannedFile> batch;
+    {
+        std::lock_guard<std::mutex> lock(scan->mutex);
+        batch.swap(scan->pending);
+    }
+
+    std::lock_guard<std::mutex> delivery(scan->delivery);
+    deliver_batch(scan, batch);
+
+    JNIEnv* env = attach_current_thread(scan->vm);
+    if (!env) return;
+    jclass scan_class = env->GetObjectClass(scan->callback);
+    env->CallVoidMethod(scan->callback, env->GetMethodID(scan_class, "onFinished", "(Z)V"), (jboolean)scan->cancelled.load());
+    if (env->ExceptionCheck()) env->ExceptionClear();
+    env->DeleteLocalRef(scan_class);
+    env->DeleteGlobalRef(scan->callback);
+    scan->callback = nullptr;
+
+    __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Scan %lld: read %lld files%s", (long long)scan->id,
+                        (long long)scan->done.load(), scan->cancelled ? ", cancelled" : "");
+}
 
-    return media->percentage;
+static void scan_file(const std::shared_ptr<MetadataScan>& scan, const std::string& path) {
+    ScannedFile file;
+    file.path = path;
+    bool audio = !scan->cancelled && probe_metadata(path.c_str(), -1, scan->probe_level, &file.metadata) &&
+                 file.metadata.audio_stream >= 0;
+
+    std::vector<ScannedFile> batch;
+    if (audio) {
+        std::lock_guard<std::mutex> lock(scan->mutex);
+        scan->pending.push_back(std::move(file));
+        if (scan->pending.size() >= scan->batch_size) batch.swap(scan->pending);
+    }
+
+    if (!batch.empty()) {
+        std::lock_guard<std::mutex> delivery(scan->delivery);
+        deliver_batch(scan.get(), batch);
+    }
+
+    scan->done++;
+    finish_scan_if_done(scan.get());
+}
+
+static bool has_scanned_extension(const MetadataScan* scan, const char* name) {
+    if (scan->extensions.empty()) return true;
+    const char* dot = strrchr(name, '.');
+    if (!dot) return false;
+
+    std::string extension(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return std::find(scan->extensions.begin(), scan->extensions.end(), extension) != scan->extensions.end();
+}
+
+/**
+ * Queues every file under directory, depth first. Symbolic links are skipped, so the walk can't loop
+ */
+static void walk_directory(const std::shared_ptr<MetadataScan>& scan, const std::string& directory) {
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) return;
+
+    while (dirent* entry = readdir(dir)) {
+        if (scan->cancelled) break;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        std::string path = directory + "/" + entry->d_name;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            // Some file systems don't fill the type in
+            struct stat info;
+            if (lstat(path.c_str(), &info) < 0) continue;
+            type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) {
+            walk_directory(scan, path);
+        } else if (type == DT_REG && has_scanned_extension(scan.get(), entry->d_name)) {
+            scan->found++;
+            scan_pool().submit(scan->id, [scan, path]() { scan_file(scan, path); });
+        }
+    }
+    closedir(dir);
+}
+
+static std::vector<std::string> get_string_array(JNIEnv* env, jobjectArray array) {
+    std::vector<std::string> strings;
+    if (!array) return strings;
+
+    jsize length = env->GetArrayLength(array);
+    for (jsize i = 0; i < length; i++) {
+        auto string = (jstring)env->GetObjectArrayElement(array, i);
+        if (!string) continue;
+        const char* chars = env->GetStringUTFChars(string, nullptr);
+        strings.emplace_back(chars);
+        env->ReleaseStringUTFChars(string, chars);
+        env->DeleteLocalRef(string);
+    }
+    return strings;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_tech_smallwonder_mp3fy_MetadataScan_startNative(JNIEnv *env, jobject thiz, jobjectArray paths, jstring directory,
+                                                      jobjectArray extensions, jint probe_level, jint batch_size) {
+    std::shared_ptr<MetadataScan> scan(new MetadataScan);
+    env->GetJavaVM(&scan->vm);
+    scan->callback = env->NewGlobalRef(thiz);
+    scan->probe_level = probe_level;
+    if (batch_size > 0) scan->batch_size = (size_t)batch_size;
+    scan->extensions = get_string_array(env, extensions);
+    for (std::string& extension : scan->extensions) {
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    }
+    scan_registry().add(scan);
+
+    if (directory) {
+        const char* chars = env->GetStringUTFChars(directory, nullptr);
+        std::string root = chars;
+        env->ReleaseStringUTFChars(directory, chars);
+
+        // Listing a big tree takes a while too, the first files get read in the meantime
+        scan_pool().submit(scan->id, [scan, root]() {
+            walk_directory(scan, root);
+            scan->listed = true;
+            finish_scan_if_done(scan.get());
+        });
+    } else {
+        std::vector<std::string> files = get_string_array(env, paths);
+        scan->found = (int64_t)files.size();
+        for (std::string& path : files) {
+            scan_pool().submit(scan->id, [scan, path]() { scan_file(scan, path); });
+        }
+        scan->listed = true;
+        finish_scan_if_done(scan.get());
+    }
+
+    return scan->id;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MetadataScan_cancelNative(JNIEnv *env, jobject thiz, jlong scan_id) {
+    std::shared_ptr<MetadataScan> scan = scan_registry().find(scan_id);
+    if (!scan) return;
+
+    // Queued files are still taken off the queue one by one, but they are skipped without being opened
+    scan->cancelled = true;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_tech_smallwonder_mp3fy_MetadataScan_getFilesDoneNative(JNIEnv *env, jobject thiz, jlong scan_id) {
+    std::shared_ptr<MetadataScan> scan = scan_registry().find(scan_id);
+    return scan ? scan->done.load() : -1;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_tech_smallwonder_mp3fy_MetadataScan_getFilesFoundNative(JNIEnv *env, jobject thiz, jlong scan_id) {
+    std::shared_ptr<MetadataScan> scan = scan_registry().find(scan_id);
+    return scan ? scan->found.load() : -1;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MetadataScan_releaseNative(JNIEnv *env, jobject thiz, jlong scan_id) {
+    scan_registry().remove(scan_id);
 }
 
 extern "C"
@@ -584,13 +2842,40 @@ Java_tech_smallwonder_mp3fy_MP3fy_editMetadataInformationNative(JNIEnv *env, job
     AVFormatContext* context = nullptr;
     auto input_file_path = env->GetStringUTFChars(input_file, &isCopy);
     auto output_file_path = env->GetStringUTFChars(output_file, &isCopy);
-    if (avformat_open_input(&context, input_file_path, nullptr, nullptr) < 0) {
+
+    if (strcmp(input_file_path, output_file_path) == 0) {
+        // Only the tags change, which usually fit where the old ones are (and their padding)
+        TagEdit edit;
+        edit.tags = metadatas;
+        std::vector<uint8_t> album_art_data(album_art_len);
+        if (album_art_len != 0) {
+            env->GetByteArrayRegion(album_art, 0, album_art_len, reinterpret_cast<jbyte*>(album_art_data.data()));
+            edit.album_art = album_art_data.data();
+            edit.album_art_size = album_art_len;
+        }
+
+        int ret = edit_tags_in_place(input_file_path, edit);
+        // Tags that outgrew their space get a new file around them, the audio copied as it is instead of remuxed
+        if (ret == AVERROR(ENOSPC)) ret = rewrite_tags(input_file_path, edit);
+        if (ret == 0) {
+            drop_cached_metadata(input_file_path);
+            return JNI_TRUE;
+        }
+        if (ret != AVERROR(ENOSPC) && ret != AVERROR(ENOTSUP)) {
+            __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Unable to edit the tags in place: %s", av_err2str(ret));
+            return JNI_FALSE;
+        }
+        __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "The tags can't be edited in place, rewriting the file");
+    }
+
+    if (open_input(&context, input_file_path, -1) < 0) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Unable to open input file");
         return JNI_FALSE;
     }
 
-    if (avformat_find_stream_info(context, nullptr) < 0) {
+    if (find_stream_info(context) < 0) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "No stream information found!");
+        close_input(&context);
         return JNI_FALSE;
     }
 
@@ -599,10 +2884,12 @@ Java_tech_smallwonder_mp3fy_MP3fy_editMetadataInformationNative(JNIEnv *env, job
 
     if (audio_stream_index < 0) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Unable to find audio stream index");
-        av_free(context);
+        close_input(&context);
         return JNI_FALSE;
     }
 
+    discard_unused_streams(context, audio_stream_index, true);
+
     AVStream* audio_stream = context->streams[audio_stream_index];
 
     AVStream* output_stream;
@@ -610,6 +2897,7 @@ Java_tech_smallwonder_mp3fy_MP3fy_editMetadataInformationNative(JNIEnv *env, job
 
     if (int ret = avformat_alloc_output_context2(&output_format_context, nullptr, nullptr, output_file_path) < 0) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Unable to allocate output context");
+        close_input(&context);
         return JNI_FALSE;
     }
 
@@ -617,26 +2905,27 @@ Java_tech_smallwonder_mp3fy_MP3fy_editMetadataInformationNative(JNIEnv *env, job
     AVCodec* decoder = avcodec_find_decoder(audio_stream->codecpar->codec_id);
     if (!decoder) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "No decoder found for this audio file");
-        avformat_close_input(&context);
+        close_input(&context);
         return JNI_FALSE;
     }
     AVCodecContext* decoder_context = avcodec_alloc_context3(decoder);
     if (!decoder_context) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Unable to create decoder context");
-        av_free(context);
-//        avformat_close_input(&context);
+        close_input(&context);
         return JNI_FALSE;
     }
 
     // Copy the codec parameters to the decoder context
     if (avcodec_parameters_to_context(decoder_context, audio_stream->codecpar) < 0) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Unable to copy codec parameters to context");
+        close_input(&context);
         return JNI_FALSE;
     }
 
     // Open the codec
-    if (avcodec_open2(decoder_context, decoder, nullptr) < 0) {
+    if (open_codec(decoder_context, decoder, nullptr) < 0) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Unable to open decoder");
+        close_input(&context);
         return JNI_FALSE;
     }
 
@@ -677,6 +2966,7 @@ Java_tech_smallwonder_mp3fy_MP3fy_editMetadataInformationNative(JNIEnv *env, job
             packet2->size = album_art_len;
             auto dataz = (uint8_t*) av_malloc(album_art_len);
             if (!dataz) {
+                close_input(&context);
                 return JNI_FALSE;
             }
             memcpy(dataz, art_ptr, album_art_len);
@@ -703,18 +2993,33 @@ Java_tech_smallwonder_mp3fy_MP3fy_editMetadataInformationNative(JNIEnv *env, job
     output_stream->time_base = audio_stream->time_base;
     int ret;
     if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&output_format_context->pb, output_file_path, AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Unable to get access to the output file!");
-            return JNI_FALSE;
+        // Local files are written into a temp file that replaces the output once complete, so the output can be the
+        // input too
+        const char* protocol = avio_find_protocol_name(output_file_path);
+        AVIOContext* file_io = protocol && strcmp(protocol, "file") == 0 ? open_output_io(output_file_path, avio_size(context->pb)) : nullptr;
+        if (file_io) {
+            attach_output_io(output_format_context, file_io);
+        } else {
+            ret = avio_open(&output_format_context->pb, output_file_path, AVIO_FLAG_WRITE);
+            if (ret < 0) {
+                __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Unable to get access to the output file!");
+                close_input(&context);
+                return JNI_FALSE;
+            }
         }
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Opened output file");
     }
+    if (strcmp(output_format_context->oformat->name, "mp3") == 0 || strcmp(output_format_context->oformat->name, "flac") == 0) {
+        output_format_context->metadata_header_padding = tag_padding();
+    }
 
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Writing header...");
     ret = avformat_write_header(output_format_context, nullptr);
     if (ret < 0) {
         __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Could not write header! Error: %s", av_err2str(ret));
+        close_output_io(output_format_context, true);
+        avformat_free_context(output_format_context);
+        close_input(&context);
         return JNI_FALSE;
     }
 
@@ -766,14 +3071,21 @@ Java_tech_smallwonder_mp3fy_MP3fy_editMetadataInformationNative(JNIEnv *env, job
     }
 
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Finishing up...");
-    av_write_trailer(output_format_context);
+    bool written = av_write_trailer(output_format_context) >= 0;
+    written = close_output_io(output_format_context, !written) && written;
     avformat_free_context(output_format_context);
     av_packet_free(&packet);
     if (album_art_len != 0) av_packet_free(&packet2);
-    av_free(context);
+    close_input(&context);
 
     __android_log_print(ANDROID_LOG_INFO, "MP3Fy", "Finished up");
-    return JNI_TRUE;
+    return written;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_tech_smallwonder_mp3fy_MP3fy_setTagPaddingNative(JNIEnv *env, jobject thiz, jint bytes) {
+    set_tag_padding(bytes);
 }
 
 extern "C"
@@ -0,0 +1,33 @@
+package tech.smallwonder.mp3fy;
+
+/**
+ * How the album art thumbnail cache is doing, see MP3fy.getAlbumArtCacheStats()
+ */
+public class AlbumArtCacheStats {
+    /**
+     * Thumbnails served from the cache, without decoding anything
+     */
+    public final long hits;
+
+    /**
+     * Thumbnails that had to be decoded
+     */
+    public final long misses;
+
+    /**
+     * Thumbnails in the cache right now
+     */
+    public final long entries;
+
+    /**
+     * Memory the thumbnails in the cache take
+     */
+    public final long bytes;
+
+    AlbumArtCacheStats(long hits, long misses, long entries, long bytes) {
+        this.hits = hits;
+        this.misses = misses;
+        this.entries = entries;
+        this.bytes = bytes;
+    }
+}
@@ -0,0 +1,162 @@
+package tech.smallwonder.mp3fy;
+
+import java.nio.ByteBuffer;
+
+import tech.smallwonder.mp3fy.interfaces.OnFailureListener;
+import tech.smallwonder.mp3fy.interfaces.OnSuccessListener;
+
+/**
+ * One conversion, created with MP3fy.createSession(). Every session has its own native state, so any number of them
+ * can exist and convert at the same time.
+ * Sessions started with start() share a native worker pool, see MP3fy.setMaxConcurrentConversions().
+ * Call release() once you're done with a session, or the native resources stay around.
+ */
+public class ConversionSession {
+    /**
+     * Created, but not started yet
+     */
+    public static final int STATE_IDLE = 0;
+
+    /**
+     * Waiting for a free worker
+     */
+    public static final int STATE_QUEUED = 1;
+
+    public static final int STATE_RUNNING = 2;
+
+    public static final int STATE_SUCCEEDED = 3;
+
+    public static final int STATE_FAILED = 4;
+
+    /**
+     * Cancelled while it was still queued
+     */
+    public static final int STATE_CANCELLED = 5;
+
+    private final long handle;
+
+    private final int conversionMode;
+
+    private OnSuccessListener successListener;
+
+    private OnFailureListener failureListener;
+
+    ConversionSession(long handle, int conversionMode) {
+        this.handle = handle;
+        this.conversionMode = conversionMode;
+    }
+
+    /**
+     * Converts only part of the input. The input is seeked to just before startMs, so a short clip from a long file
+     * only costs decoding the clip. The cut is sample accurate, except when the audio is copied without re-encoding
+     * (see MP3fy.initialize(String, String, boolean)), which cuts at the nearest packet.
+     * Has to be called before the conversion is started.
+     * @param startMs - Where the output starts, in milliseconds from the start of the input
+     * @param endMs - Where the output ends, 0 for the end of the input
+     * @return false if the session has already been started
+     */
+    public boolean setTimeRange(long startMs, long endMs) {
+        return setTimeRangeNative(handle, startMs, endMs);
+    }
+
+    /**
+     * Converts on the calling thread, which is blocked until the conversion is done.
+     * @return true if the conversion was successful, false otherwise or if the session was already started
+     */
+    public boolean convert() {
+        return convertNative(handle, conversionMode);
+    }
+
+    /**
+     * Queues the conversion on the native worker pool and returns right away. One of the listeners is called on the
+     * worker thread when the conversion is done.
+     * @param listener - The success listener
+     * @param listener2 - The failure/error listener
+     * @return false if the session was already started
+     */
+    public boolean start(OnSuccessListener listener, OnFailureListener listener2) {
+        successListener = listener;
+        failureListener = listener2;
+        return submitNative(handle, conversionMode);
+    }
+
+    /**
+     * Takes the session out of the queue. Conversions that have already started run to the end.
+     * The listeners are not called for a cancelled session.
+     * @return true if the session was still queued and won't be converted anymore
+     */
+    public boolean cancel() {
+        return cancelNative(handle);
+    }
+
+    /**
+     * @return one of the STATE_* constants, -1 if the session has been released
+     */
+    public int getState() {
+        return getStateNative(handle);
+    }
+
+    /**
+     * @return the progress of the conversion in percent, -1 if the session has been released
+     */
+    public int getPercentage() {
+        return getPercentageNative(handle);
+    }
+
+    /**
+     * The output of a session created with MediaOutput.toMemory(). The buffer is direct and points into native memory
+     * without any copy, so it's only valid until release(). Copy what you need to keep before that.
+     * @return the output, null if the conversion hasn't succeeded (yet) or the output didn't go to memory
+     */
+    public ByteBuffer getOutput() {
+        return getOutputNative(handle);
+    }
+
+    /**
+     * Frees the native side of the session. A queued or running conversion still finishes (and calls its listener),
+     * cancel() it first if it shouldn't.
+     */
+    public void release() {
+        releaseNative(handle);
+    }
+
+    /**
+     * Called from the native worker thread when a conversion started with start() is done
+     */
+    private void onFinished(boolean success) {
+        if (success) {
+            if (successListener != null) successListener.onSuccess();
+        } else {
+            if (failureListener != null) failureListener.onFailure();
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////////////////////
+
+    //                             NATIVE METHODS GO HERE                          //
+
+    //////////////////////////////////////////////////////////////////////////////////
+
+    /**
+     * Converts the media of this session on the calling thread
+     * @param mode - One of the MP3fy.CONVERSION_MODE_* constants
+     */
+    private native boolean convertNative(long session_id, int mode);
+
+    /**
+     * Queues the conversion on the worker pool, onFinished() is called when it's done
+     */
+    private native boolean submitNative(long session_id, int mode);
+
+    private native boolean cancelNative(long session_id);
+
+    private native boolean setTimeRangeNative(long session_id, long start_ms, long end_ms);
+
+    private native int getStateNative(long session_id);
+
+    private native int getPercentageNative(long session_id);
+
+    private native ByteBuffer getOutputNative(long session_id);
+
+    private native void releaseNative(long session_id);
+}
@@ -0,0 +1,120 @@
+package tech.smallwonder.mp3fy;
+
+/**
+ * Describes the audio produced by a conversion. Pass it to MP3fy.initialize().
+ * Fields left at 0 keep whatever the input has, as long as the encoder supports it (MP3 only goes up to 48kHz stereo for example, anything else gets resampled or downmixed).
+ */
+public class EncodingProfile {
+    /**
+     * Fastest resampling, a short filter that is fine for speech
+     */
+    public static final int RESAMPLE_QUALITY_FAST = 0;
+
+    /**
+     * Good quality resampling for any material. This is the default
+     */
+    public static final int RESAMPLE_QUALITY_DEFAULT = 1;
+
+    /**
+     * Longer filter with a higher cutoff, for music that is resampled before being encoded at high bitrates
+     */
+    public static final int RESAMPLE_QUALITY_HIGH = 2;
+
+    /**
+     * Constant bitrate, every frame uses the bitrate set in the bitrate field
+     */
+    public static final int BITRATE_MODE_CBR = 0;
+
+    /**
+     * Variable bitrate driven by vbrQuality. Usually the best size/quality trade-off
+     */
+    public static final int BITRATE_MODE_VBR = 1;
+
+    /**
+     * Average bitrate, varies per frame but stays close to the bitrate field on average
+     */
+    public static final int BITRATE_MODE_ABR = 2;
+
+    /**
+     * Let the encoder decide how much work it puts into each frame
+     */
+    public static final int SPEED_TIER_DEFAULT = -1;
+
+    /**
+     * Slowest encoding, best quality for a given bitrate
+     */
+    public static final int SPEED_TIER_BEST = 0;
+
+    /**
+     * A good balance between speed and quality
+     */
+    public static final int SPEED_TIER_STANDARD = 1;
+
+    /**
+     * Fastest encoding, noticeably worse at low bitrates
+     */
+    public static final int SPEED_TIER_FAST = 2;
+
+    /**
+     * The output sample rate in Hz, e.g. 22050 or 24000 for speech. 0 keeps the input sample rate
+     */
+    public int sampleRate = 0;
+
+    /**
+     * The number of output channels, 1 for mono and 2 for stereo. 0 keeps the input channels
+     */
+    public int channels = 0;
+
+    /**
+     * One of the RESAMPLE_QUALITY_* constants. Only used when the audio actually has to be resampled
+     */
+    public int resampleQuality = RESAMPLE_QUALITY_DEFAULT;
+
+    /**
+     * One of the BITRATE_MODE_* constants
+     */
+    public int bitrateMode = BITRATE_MODE_CBR;
+
+    /**
+     * The bitrate in bits per second (e.g. 128000) for CBR and ABR. 0 uses the encoder default
+     */
+    public int bitrate = 0;
+
+    /**
+     * The VBR quality, from 0 (best, biggest files) to 9 (worst, smallest files). Only used for BITRATE_MODE_VBR
+     */
+    public int vbrQuality = 4;
+
+    /**
+     * One of the SPEED_TIER_* constants
+     */
+    public int speedTier = SPEED_TIER_DEFAULT;
+
+    public EncodingProfile() {}
+
+    /**
+     * Spoken word (podcasts, lectures): 22050Hz mono at 48kbps ABR, encoded and resampled with the fast settings.
+     * Encodes several times faster than the defaults and gives much smaller files.
+     */
+    public static EncodingProfile speech() {
+        EncodingProfile profile = new EncodingProfile();
+        profile.sampleRate = 22050;
+        profile.channels = 1;
+        profile.resampleQuality = RESAMPLE_QUALITY_FAST;
+        profile.bitrateMode = BITRATE_MODE_ABR;
+        profile.bitrate = 48000;
+        profile.speedTier = SPEED_TIER_FAST;
+        return profile;
+    }
+
+    /**
+     * Music at transparent quality: VBR quality 2 with the standard speed tier
+     */
+    public static EncodingProfile music() {
+        EncodingProfile profile = new EncodingProfile();
+        profile.bitrateMode = BITRATE_MODE_VBR;
+        profile.vbrQuality = 2;
+        profile.speedTier = SPEED_TIER_STANDARD;
+        return profile;
+    }
+}
@@ -4,15 +4,108 @@ import android.graphics.Bitmap;
 
 import java.io.ByteArrayOutputStream;
 import java.io.File;
+import java.nio.ByteBuffer;
 import java.util.HashMap;
 
 import tech.smallwonder.mp3fy.interfaces.OnFailureListener;
 import tech.smallwonder.mp3fy.interfaces.OnMetadataAvailableListener;
+import tech.smallwonder.mp3fy.interfaces.OnMetadataBatchListener;
 import tech.smallwonder.mp3fy.interfaces.OnSuccessListener;
 
 public class MP3fy {
 
-    private long media_handle;
+    /**
+     * Reads, decodes, encodes and writes one packet at a time on the converting thread. This is the default.
+     */
+    public static final int CONVERSION_MODE_SERIAL = 0;
+
+    /**
+     * Runs reading, decoding, encoding and writing on their own threads, connected by bounded queues.
+     * This hides the I/O and decoding cost behind the encoder on multi-core devices.
+     */
+    public static final int CONVERSION_MODE_PIPELINED = 1;
+
+    /**
+     * Splits long inputs into one segment per core and encodes the segments in parallel, then joins them into one MP3.
+     * The MP3 bit reservoir is disabled in this mode. Inputs shorter than a couple of minutes are converted with
+     * CONVERSION_MODE_PIPELINED instead.
+     */
+    public static final int CONVERSION_MODE_SEGMENTED = 2;
+
+    /**
+     * Reads local files with large positional reads, helped by the kernel read-ahead. This is the default.
+     */
+    public static final int INPUT_BACKEND_BUFFERED = 0;
+
+    /**
+     * Maps local files into memory and reads them from there. Seeking costs nothing, which makes metadata scans (that
+     * jump around the start and the end of files) faster. Files that can't be mapped are read with INPUT_BACKEND_BUFFERED.
+     * Don't use it for files that might get truncated while they are being read.
+     */
+    public static final int INPUT_BACKEND_MMAP = 1;
+
+    /**
+     * Reads local files a few blocks ahead on a small pool of I/O threads shared by every conversion, so a conversion
+     * only waits for the disk when the disk can't keep up. Helps most with many conversions at once on slow storage.
+     * Only conversions read this way, metadata is read with INPUT_BACKEND_BUFFERED.
+     */
+    public static final int INPUT_BACKEND_ASYNC = 2;
+
+    /**
+     * Writes output files on the converting thread. This is the default.
+     */
+    public static final int OUTPUT_BACKEND_BUFFERED = 0;
+
+    /**
+     * Hands output writes to the shared I/O threads (see INPUT_BACKEND_ASYNC), conversions only wait when several
+     * writes are already pending.
+     */
+    public static final int OUTPUT_BACKEND_ASYNC = 1;
+
+    /**
+     * Never sync output files, the kernel writes them back when it likes. This is the default
+     */
+    public static final long OUTPUT_SYNC_NEVER = -1;
+
+    /**
+     * Sync output files once, when they are complete
+     */
+    public static final long OUTPUT_SYNC_ON_CLOSE = 0;
+
+    /**
+     * Only read the container header for its tags, nothing gets decoded. Duration and bitrate are the ones the header
+     * gives, which for some formats (raw AAC, MP3 without a Xing header) are estimates or missing (0). getAllMetadata()
+     * always reads this way
+     */
+    public static final int PROBE_LEVEL_TAGS = 0;
+
+    /**
+     * Tags and the album art, which is stored in the header too. Nothing gets decoded
+     */
+    public static final int PROBE_LEVEL_TAGS_AND_ART = 1;
+
+    /**
+     * Also reads and decodes the start of the audio to work out exact stream information. Much slower, especially
+     * for video files. This is what getAudioFileInfo() without a level reads
+     */
+    public static final int PROBE_LEVEL_STREAM_INFO = 2;
+
+    // Pixel layouts of getAlbumArtPixels(), these have to match the ThumbnailFormat enum in AlbumArt.h
+
+    /**
+     * 4 bytes per pixel, like Bitmap.Config.ARGB_8888
+     */
+    public static final int THUMBNAIL_FORMAT_RGBA_8888 = 0;
+
+    /**
+     * 2 bytes per pixel, like Bitmap.Config.RGB_565
+     */
+    public static final int THUMBNAIL_FORMAT_RGB_565 = 1;
+
+    // The session of initialize()/convert(), sessions from createSession() belong to the caller
+    private volatile ConversionSession session;
+
+    private int conversion_mode = CONVERSION_MODE_SERIAL;
 
     private static MP3fy instance = new MP3fy();
 
@@ -45,8 +138,206 @@ public class MP3fy {
      * @return true if the operation succeeds and false otherwise
      */
     public boolean initialize(String fileToConvert, String outputFile) {
-        media_handle = initializeNative(fileToConvert, outputFile);
-        return media_handle != -1;
+        return initialize(fileToConvert, outputFile, false);
+    }
+
+    /**
+     * Like initialize(String, String), but can skip decoding and encoding entirely when the audio inside the input already fits the output file,
+     * i.e. MP3 audio (an .mp3 file, or MP3 audio inside an MP4/MKV/AVI) going to an .mp3 file. The audio is then copied as it is, which is much faster and lossless.
+     * MP3 is the only output the bundled FFmpeg can write, so other audio is always re-encoded.
+     * @param fileToConvert - The input file
+     * @param outputFile - The expected output. The extension decides the container
+     * @param allowStreamCopy - Whether the input audio may be copied without re-encoding when possible
+     * @return true if the operation succeeds and false otherwise
+     */
+    public boolean initialize(String fileToConvert, String outputFile, boolean allowStreamCopy) {
+        return replaceSession(createSession(fileToConvert, outputFile, allowStreamCopy, null));
+    }
+
+    /**
+     * Like initialize(String, String), but the output audio follows the given profile (e.g. 22050Hz mono for speech).
+     * @param fileToConvert - The input file
+     * @param outputFile - The expected output. This is the MP3 file
+     * @param profile - Describes the output audio
+     * @return true if the operation succeeds and false otherwise
+     */
+    public boolean initialize(String fileToConvert, String outputFile, EncodingProfile profile) {
+        return replaceSession(createSession(fileToConvert, outputFile, false, profile));
+    }
+
+    /**
+     * Prepares a conversion that is independent of every other one, so several files can be converted at the same time.
+     * The session uses the conversion mode set when it is created.
+     * @param fileToConvert - The input file
+     * @param outputFile - The expected output. This is the MP3 file
+     * @param allowStreamCopy - Whether the input audio may be copied without re-encoding when possible
+     * @param profile - Describes the output audio, null for the defaults
+     * @return the session, or null if the files could not be opened
+     */
+    public ConversionSession createSession(String fileToConvert, String outputFile, boolean allowStreamCopy, EncodingProfile profile) {
+        long handle = initializeNative(fileToConvert, -1, outputFile, allowStreamCopy, profile);
+        if (handle == -1) return null;
+        return new ConversionSession(handle, conversion_mode);
+    }
+
+    /**
+     * Like createSession(String, String, boolean, EncodingProfile), but reads the input from an already open file descriptor
+     * (e.g. from ParcelFileDescriptor.getFd()). The descriptor is not closed, keep it open until the session is released.
+     * @param inputFd - Readable file descriptor of the input
+     * @return the session, or null if the input could not be read
+     */
+    public ConversionSession createSession(int inputFd, String outputFile, boolean allowStreamCopy, EncodingProfile profile) {
+        long handle = initializeNative(null, inputFd, outputFile, allowStreamCopy, profile);
+        if (handle == -1) return null;
+        return new ConversionSession(handle, conversion_mode);
+    }
+
+    /**
+     * Like createSession(String, String, boolean, EncodingProfile), for inputs and outputs that aren't files: memory,
+     * a direct ByteBuffer or streams.
+     * @param input - Where the input is read from, see MediaInput
+     * @param output - Where the output is written to, see MediaOutput
+     * @return the session, or null if the input or the output could not be opened
+     */
+    public ConversionSession createSession(MediaInput input, MediaOutput output, boolean allowStreamCopy, EncodingProfile profile) {
+        long handle = initializeWithIoNative(input, output, allowStreamCopy, profile);
+        if (handle == -1) return null;
+        return new ConversionSession(handle, conversion_mode);
+    }
+
+    /**
+     * Sets how many bytes are read from an input at a time, for the inputs opened from now on. The default of 256KB
+     * already makes a lot fewer read calls than FFmpeg's 32KB. Larger values help on slow storage at the cost of memory
+     * per open input.
+     * @param bytes - The buffer size in bytes, at least 4096
+     */
+    public void setReadBufferSize(int bytes) {
+        setReadBufferSizeNative(bytes);
+    }
+
+    /**
+     * Sets how local files are read, for the inputs opened from now on (conversions, metadata and album art, metadata editing).
+     * @param backend - One of the INPUT_BACKEND_* constants
+     */
+    public void setInputBackend(int backend) {
+        setInputBackendNative(backend);
+    }
+
+    /**
+     * Sets how output files are written, for the conversions initialized from now on.
+     * @param backend - One of the OUTPUT_BACKEND_* constants
+     */
+    public void setOutputBackend(int backend) {
+        setOutputBackendNative(backend);
+    }
+
+    /**
+     * Sets how many bytes are written to an output file at a time, for the conversions initialized from now on. The
+     * default is 256KB, FFmpeg writes 32KB at a time.
+     * @param bytes - The buffer size in bytes, at least 4096
+     */
+    public void setWriteBufferSize(int bytes) {
+        setWriteBufferSizeNative(bytes);
+    }
+
+    /**
+     * Sets how often output files are synced to the disk, for the conversions initialized from now on. Output files
+     * are always written into a temp file next to them that replaces them once the conversion succeeded, so a failed
+     * conversion never leaves a partial file behind. Syncing on top of that makes the new file survive a power loss.
+     * The time spent syncing is logged.
+     * @param bytes - Sync every this many bytes and once complete, or OUTPUT_SYNC_NEVER or OUTPUT_SYNC_ON_CLOSE
+     */
+    public void setOutputSyncInterval(long bytes) {
+        setOutputSyncIntervalNative(bytes);
+    }
+
+    /**
+     * Limits how much of a file metadata reads look at, for files that take a lot of reading to be recognized.
+     * @param probeSize - At most this many bytes are read to detect the format (and, with PROBE_LEVEL_STREAM_INFO,
+     *                  the stream info), 0 for FFmpeg's default of 5MB
+     * @param analyzeDurationMs - At most this much of the media is analyzed with PROBE_LEVEL_STREAM_INFO, 0 for
+     *                          FFmpeg's default of 5 seconds
+     */
+    public void setProbeLimits(long probeSize, long analyzeDurationMs) {
+        setProbeLimitsNative(probeSize, analyzeDurationMs);
+    }
+
+    /**
+     * Keeps what metadata reads (getAllMetadata, getAudioFileInfo, scanMetadata) find out about local files in a cache
+     * file, so a file that hasn't changed (same size, modification time and inode) isn't probed again, even after a
+     * restart. Looking a file up costs a stat. Files opened by descriptor aren't cached.
+     * @param path - The cache file, e.g. in Context.getCacheDir(). Created if it doesn't exist, null to stop caching
+     * @return false if the cache couldn't be opened, nothing is cached then
+     */
+    public boolean setMetadataCache(String path) {
+        return setMetadataCacheNative(path);
+    }
+
+    /**
+     * Rewrites the metadata cache without the entries superseded since files got probed again. This happens by
+     * itself when the cache is opened and mostly made of those.
+     * @param dropMissing - Also drop the entries of files that changed or were deleted, which costs a stat each
+     * @return how many files are left in the cache, -1 on error or if there's no cache
+     */
+    public int compactMetadataCache(boolean dropMissing) {
+        return compactMetadataCacheNative(dropMissing);
+    }
+
+    public void clearMetadataCache() {
+        clearMetadataCacheNative();
+    }
+
+    /**
+     * Sets how much padding MP3 and FLAC outputs (conversions and editMetadataInformation() rewrites) get after their
+     * tags, 4KB by default. Edits of the tags that fit in it don't rewrite the file, see editMetadataInformation().
+     * @param bytes - The padding, 0 for none
+     */
+    public void setTagPadding(int bytes) {
+        setTagPaddingNative(bytes);
+    }
+
+    /**
+     * Sets how many threads do the reads and writes of INPUT_BACKEND_ASYNC and OUTPUT_BACKEND_ASYNC, 4 by default.
+     * They are shared by every conversion, more threads only help when the storage can serve more requests at once.
+     * @param count - The number of threads, at least 1
+     */
+    public void setIoThreads(int count) {
+        setIoThreadsNative(count);
+    }
+
+    /**
+     * Sets how many sessions started with ConversionSession.start() (or convertAsync()) convert at the same time.
+     * The others wait in a queue. Defaults to the number of cores.
+     * @param count - At least 1
+     */
+    public void setMaxConcurrentConversions(int count) {
+        setMaxConcurrentConversionsNative(count);
+    }
+
+    private synchronized boolean replaceSession(ConversionSession newSession) {
+        // A conversion that is still going on keeps its native state until it is done
+        if (session != null) session.release();
+        session = newSession;
+        return session != null;
+    }
+
+    /**
+     * Converts only part of the file passed to initialize(), see ConversionSession.setTimeRange()
+     * @param startMs - Where the output starts, in milliseconds from the start of the input
+     * @param endMs - Where the output ends, 0 for the end of the input
+     * @return false if there is no initialized conversion or it has already been started
+     */
+    public boolean setTimeRange(long startMs, long endMs) {
+        ConversionSession current = session;
+        return current != null && current.setTimeRange(startMs, endMs);
+    }
+
+    /**
+     * Sets how the next conversions will be carried out.
+     * @param mode - One of the CONVERSION_MODE_* constants
+     */
+    public void setConversionMode(int mode) {
+        conversion_mode = mode;
     }
 
     /**
@@ -55,7 +346,8 @@ public class MP3fy {
      * @return true if the conversion operation was successful and false otherwise
      */
     public boolean convert() {
-        return convertNative(media_handle);
+        ConversionSession current = session;
+        return current != null && current.convert();
     }
 
     /**
@@ -65,26 +357,20 @@ public class MP3fy {
      * @param listener2 - The failure/error listener
      */
     public void convertAsync(final OnSuccessListener listener, final OnFailureListener listener2) {
-        new Thread(new Runnable() {
-            @Override
-            public void run() {
-                boolean success = convertNative(media_handle);
-                if (success) {
-                    listener.onSuccess();
-                } else {
-                    listener2.onFailure();
-                }
-            }
-        }).start();
+        ConversionSession current = session;
+        if (current == null || !current.start(listener, listener2)) {
+            listener2.onFailure();
+        }
     }
 
     /**
-     * Returns the current progress of the conversion process. This can and should only be used in async mode of the media conversion function. Any other scenario might cause this code to crash. You've been warned!
-     * @return the current conversion progress, -1 on error.
+     * Returns the current progress of the conversion started with convert() or convertAsync(). Safe to call from any thread at any time.
+     * @return the current conversion progress, -1 if there is no conversion.
      */
     public int getPercentage() {
-        if (media_handle == -1) return -1;
-        return getPercentageNative(media_handle);
+        ConversionSession current = session;
+        if (current == null) return -1;
+        return current.getPercentage();
     }
 
     /**
@@ -96,7 +382,14 @@ public class MP3fy {
      * @return - ArrayList of HashMap<String, String> containing the metadata or an empty HashMap on error
      */
     public HashMap<String, String> getAllMetadata(String path) {
-        return getAllMetadataNative(path);
+        return getAllMetadataNative(path, -1);
+    }
+
+    /**
+     * Like getAllMetadata(String), but reads the file from an already open file descriptor, which is not closed
+     */
+    public HashMap<String, String> getAllMetadata(int fd) {
+        return getAllMetadataNative(null, fd);
     }
 
     /**
@@ -106,7 +399,7 @@ public class MP3fy {
         new Thread(new Runnable() {
             @Override
             public void run() {
-                HashMap<String, String> metadata = getAllMetadataNative(path);
+                HashMap<String, String> metadata = getAllMetadataNative(path, -1);
                 metadataAvailableListener.onMetadataAvailable(metadata);
             }
         }).start();
@@ -122,6 +415,30 @@ public class MP3fy {
         return getAllMetadata(file.getAbsolutePath());
     }
 
+    /**
+     * Reads the metadata of many files at once, on a native worker pool with a thread per core. Results are delivered
+     * in batches to the listener, on the worker threads. Files that can't be read as audio are skipped.
+     * @param paths - The files to read
+     * @param probeLevel - One of the PROBE_LEVEL_* constants. Below PROBE_LEVEL_STREAM_INFO nothing gets decoded
+     * @param batchSize - How many files go into one batch, 0 for 64
+     * @return the scan, or null if it could not be started
+     */
+    public MetadataScan scanMetadata(String[] paths, int probeLevel, int batchSize, OnMetadataBatchListener listener) {
+        MetadataScan scan = new MetadataScan(listener);
+        return scan.start(paths, null, null, probeLevel, batchSize) ? scan : null;
+    }
+
+    /**
+     * Like scanMetadata(String[], int, int, OnMetadataBatchListener), for every file under a directory and its
+     * subdirectories. The tree is listed natively while the first files are already being read. Symbolic links are
+     * not followed.
+     * @param extensions - Only files with these extensions (e.g. "mp3", case insensitive) are read, null for all of them
+     */
+    public MetadataScan scanMetadata(String directory, String[] extensions, int probeLevel, int batchSize, OnMetadataBatchListener listener) {
+        MetadataScan scan = new MetadataScan(listener);
+        return scan.start(null, directory, extensions, probeLevel, batchSize) ? scan : null;
+    }
+
     /**
      * Fetches the album art associated with the specified image file (if there's one)
      * This method might take some time to complete, so it's probably better to call this in a background thread
@@ -129,7 +446,14 @@ public class MP3fy {
      * @return the album art bitmap if there's one or null otherwise
      */
     public Bitmap getAlbumArt(String path) {
-        return getAlbumArtNative(path);
+        return getAlbumArtNative(path, -1);
+    }
+
+    /**
+     * Like getAlbumArt(String), but reads the file from an already open file descriptor, which is not closed
+     */
+    public Bitmap getAlbumArt(int fd) {
+        return getAlbumArtNative(null, fd);
     }
 
     /**
@@ -142,6 +466,74 @@ public class MP3fy {
         return getAlbumArt(file.getAbsolutePath());
     }
 
+    /**
+     * Reads the header of the file and keeps what it holds, the album art in particular, without the file. Unlike
+     * getAlbumArt(), the album art isn't copied or decoded, see MediaProbe.getAlbumArt()
+     * @return null if the file couldn't be read
+     */
+    public MediaProbe probe(String path) {
+        long handle = probeNative(path, -1);
+        return handle == -1 ? null : new MediaProbe(handle);
+    }
+
+    /**
+     * Like probe(String), but reads the file from an already open file descriptor, which is not closed
+     */
+    public MediaProbe probe(int fd) {
+        long handle = probeNative(null, fd);
+        return handle == -1 ? null : new MediaProbe(handle);
+    }
+
+    /**
+     * Decodes the album art straight into a bitmap of the size it's going to be shown at, e.g. one reused for a list
+     * item. The picture is cropped around its center to the aspect ratio of the bitmap. JPEGs are only decoded at the
+     * resolution the bitmap needs, so this is much cheaper than getAlbumArt() for small thumbnails.
+     * @param bitmap - A mutable ARGB_8888 or RGB_565 bitmap
+     * @return false if there's no album art, or it couldn't be decoded. The bitmap is left as it was then
+     */
+    public boolean getAlbumArtThumbnail(String path, Bitmap bitmap) {
+        return getAlbumArtThumbnailNative(path, -1, bitmap);
+    }
+
+    /**
+     * Like getAlbumArtThumbnail(String, Bitmap), but reads the file from an already open file descriptor, which is
+     * not closed
+     */
+    public boolean getAlbumArtThumbnail(int fd, Bitmap bitmap) {
+        return getAlbumArtThumbnailNative(null, fd, bitmap);
+    }
+
+    /**
+     * Like getAlbumArtThumbnail(String, Bitmap), but decodes into a direct buffer, e.g. for a texture
+     * @param pixels - A direct buffer of at least width * height pixels, rows are packed
+     * @param format - THUMBNAIL_FORMAT_RGBA_8888 or THUMBNAIL_FORMAT_RGB_565
+     */
+    public boolean getAlbumArtPixels(String path, ByteBuffer pixels, int width, int height, int format) {
+        return getAlbumArtPixelsNative(path, -1, pixels, width, height, format);
+    }
+
+    /**
+     * Like getAlbumArtPixels(String, ByteBuffer, int, int, int), but reads the file from an already open file
+     * descriptor, which is not closed
+     */
+    public boolean getAlbumArtPixels(int fd, ByteBuffer pixels, int width, int height, int format) {
+        return getAlbumArtPixelsNative(null, fd, pixels, width, height, format);
+    }
+
+    /**
+     * Sets how much memory the thumbnails of getAlbumArtThumbnail() and getAlbumArtPixels() may take, 8MB by default.
+     * Thumbnails are cached by the content of the album art, so the tracks of an album sharing a cover only cost one
+     * decode per thumbnail size. The least recently used ones make room for new ones.
+     * @param bytes - 0 turns the cache off
+     */
+    public void setAlbumArtCacheSize(long bytes) {
+        setAlbumArtCacheSizeNative(bytes);
+    }
+
+    public AlbumArtCacheStats getAlbumArtCacheStats() {
+        return getAlbumArtCacheStatsNative();
+    }
+
     /**
      * Gets information about the audio file, including the album art.
      * This method might take some time to complete, so it's probably better to call this in a background thread
@@ -149,7 +541,30 @@ public class MP3fy {
      * @return the audio file information or null on error.
      */
     public AudioFileInfo getAudioFileInfo(String path) {
-        return getAudioFileInfoNative(path);
+        return getAudioFileInfoNative(path, -1, PROBE_LEVEL_STREAM_INFO);
+    }
+
+    /**
+     * Like getAudioFileInfo(String), but reads only as much of the file as the level asks for. The levels below
+     * PROBE_LEVEL_STREAM_INFO are much faster, but can leave the duration, bitrate, sample rate and channels at 0
+     * @param probeLevel - One of the PROBE_LEVEL_* constants. The album art is only there from PROBE_LEVEL_TAGS_AND_ART on
+     */
+    public AudioFileInfo getAudioFileInfo(String path, int probeLevel) {
+        return getAudioFileInfoNative(path, -1, probeLevel);
+    }
+
+    /**
+     * Like getAudioFileInfo(String), but reads the file from an already open file descriptor, which is not closed
+     */
+    public AudioFileInfo getAudioFileInfo(int fd) {
+        return getAudioFileInfoNative(null, fd, PROBE_LEVEL_STREAM_INFO);
+    }
+
+    /**
+     * Like getAudioFileInfo(String, int), but reads the file from an already open file descriptor, which is not closed
+     */
+    public AudioFileInfo getAudioFileInfo(int fd, int probeLevel) {
+        return getAudioFileInfoNative(null, fd, probeLevel);
     }
 
     /**
@@ -164,7 +579,11 @@ public class MP3fy {
 
     /**
      * Edit metadata info stored in inputFile and store the result in outputFile, with the album art
-     * Note that not all metadata will be set if the audio file format does not allow it
+     * Note that not all metadata will be set if the audio file format does not allow it.
+     * outputFile may be inputFile: the tags are then edited where they are in the file when they fit in their padding
+     * (ID3v2 of MP3, FLAC, Ogg Vorbis and Opus, MP4/M4A), which only writes the bytes that changed. Growing tags of
+     * MP3, FLAC and MP4 get a new file with the audio copied as it is by the kernel, without a remux. Otherwise the file
+     * is remuxed. Either way the new file replaces the old once complete
      * @param inputFile Audio file to set metadata
      * @param metadataInfos Metadata information to be set
      * @param newBitmap Bitmap to use as the album art
@@ -188,6 +607,7 @@ public class MP3fy {
     /**
      * Edit metadata info stored in inputFile and store the result in outputFile
      * Note that not all metadata will be set if the audio file format does not allow it.
+     * outputFile may be inputFile, see editMetadataInformation(String, HashMap, Bitmap, String).
      * It is the caller's responsibility to ascertain that all the information set is reflected in the new file
      * @param inputFile Audio file to set metadata
      * @param metadataInfos Metadata information to be set
@@ -212,48 +632,80 @@ public class MP3fy {
      * Initializes the input and output file and prepares for conversion
      * Please make sure the input and output file paths are valid before passing to this function
      *
-     * @return The pointer handle to the media file
+     * @return The handle of the new native session, -1 on error
      */
-    private native long initializeNative(String inputFile, String outputFile);
+    private native long initializeNative(String inputFile, int inputFd, String outputFile, boolean allowStreamCopy, EncodingProfile profile);
 
     /**
-     * Starts the audio conversion and writes the data to the audio file specified in @initialize.
-     * @return true if the whole operation was successful and false otherwise
+     * Like initializeNative, with the input and output described by a MediaInput and a MediaOutput
      */
-    private native boolean convertNative(long media_id);
+    private native long initializeWithIoNative(MediaInput input, MediaOutput output, boolean allowStreamCopy, EncodingProfile profile);
+
+    private native void setMaxConcurrentConversionsNative(int count);
+
+    private native void setReadBufferSizeNative(int bytes);
+
+    private native void setInputBackendNative(int backend);
+
+    private native void setOutputBackendNative(int backend);
+
+    private native void setIoThreadsNative(int count);
+
+    private native void setProbeLimitsNative(long probeSize, long analyzeDurationMs);
+
+    private native void setWriteBufferSizeNative(int bytes);
+
+    private native boolean setMetadataCacheNative(String path);
+
+    private native int compactMetadataCacheNative(boolean dropMissing);
+
+    private native void clearMetadataCacheNative();
+
+    private native void setOutputSyncIntervalNative(long bytes);
 
     /**
      * Fetches all the metadata available in this media file
-     * @param path - The path to the file we want to fetch the metadata
+     * @param path - The path to the file we want to fetch the metadata, null when reading from fd
+     * @param fd - Open file descriptor to read the file from, -1 to open path
      * @return - ArrayList of HashMap<String, String> containing the metadata or an empty HashMap on error
      */
-    private native HashMap<String, String> getAllMetadataNative(String path);
+    private native HashMap<String, String> getAllMetadataNative(String path, int fd);
 
     /**
      * Returns the associated cover image from this audio file (if any)
-     * @param path A valid path to an audio file.
+     * @param path A valid path to an audio file, null when reading from fd
+     * @param fd Open file descriptor to read the file from, -1 to open path
      * @return the bitmap associated with this audio file. Returns null if there is no
      */
-    private native Bitmap getAlbumArtNative(String path);
+    private native Bitmap getAlbumArtNative(String path, int fd);
 
     /**
-     * Returns the information about this audio file in the AudioFileInfo class.
-     * Members can be queried for information.
-     * @param path - A valid path to an audio file.
-     * @return the AudioFileInfo or null on error.
+     * @return the handle of the new native probe, -1 on error
      */
-    private native AudioFileInfo getAudioFileInfoNative(String path);
+    private native long probeNative(String path, int fd);
+
+    private native boolean getAlbumArtThumbnailNative(String path, int fd, Bitmap bitmap);
+
+    private native boolean getAlbumArtPixelsNative(String path, int fd, ByteBuffer pixels, int width, int height, int format);
+
+    private native void setAlbumArtCacheSizeNative(long bytes);
+
+    private native AlbumArtCacheStats getAlbumArtCacheStatsNative();
 
     /**
-     * Returns the current progress of the conversion process (in percentage)
-     * This can and should only be used when converting in asynchronous mode and also have to make sure that there is a valid conversion in progress before calling this method. Any other circumstance will cause undefined behavior :)
-     * @param media_id - The pointer (handle) to the media instance we're currently manipulating
-     * @return the percentage of the conversion process on success, and -1 on error. It might even crash the entire application if not used appropriately, so use this carefully.
+     * Returns the information about this audio file in the AudioFileInfo class.
+     * Members can be queried for information.
+     * @param path - A valid path to an audio file, null when reading from fd
+     * @param fd - Open file descriptor to read the file from, -1 to open path
+     * @param probeLevel - One of the PROBE_LEVEL_* constants
+     * @return the AudioFileInfo or null on error.
      */
-    private native int getPercentageNative(long media_id);
+    private native AudioFileInfo getAudioFileInfoNative(String path, int fd, int probeLevel);
 
     private native boolean editMetadataInformationNative(String inputFile, String[] keys, String[] values, int length, byte[] albumArt, int albumArtLen, int width, int height, String outputFile);
 
+    private native void setTagPaddingNative(int bytes);
+
     private native void pipeStdErrToLogcatNative();
 
 }
@@ -0,0 +1,95 @@
+package tech.smallwonder.mp3fy;
+
+import java.io.InputStream;
+import java.nio.ByteBuffer;
+
+/**
+ * Where a conversion reads its input from. Pass it to MP3fy.createSession(MediaInput, MediaOutput, boolean, EncodingProfile).
+ * Only inputs from a path or a file descriptor can be converted in CONVERSION_MODE_SEGMENTED, the others fall back to
+ * the pipelined mode.
+ */
+public class MediaInput {
+    // These have to match the MediaInputType enum in lib.cpp
+    static final int TYPE_PATH = 0;
+    static final int TYPE_FD = 1;
+    static final int TYPE_BYTES = 2;
+    static final int TYPE_DIRECT_BUFFER = 3;
+    static final int TYPE_STREAM = 4;
+
+    // Read from native code
+    private final int type;
+    private String path;
+    private int fd = -1;
+    private byte[] bytes;
+    private ByteBuffer buffer;
+    private int offset;
+    private int length;
+    private InputStream stream;
+
+    private MediaInput(int type) {
+        this.type = type;
+    }
+
+    public static MediaInput fromPath(String path) {
+        MediaInput input = new MediaInput(TYPE_PATH);
+        input.path = path;
+        return input;
+    }
+
+    /**
+     * @param fd - Readable file descriptor, it is not closed. Keep it open until the session is released
+     */
+    public static MediaInput fromFd(int fd) {
+        MediaInput input = new MediaInput(TYPE_FD);
+        input.fd = fd;
+        return input;
+    }
+
+    /**
+     * Reads the input from memory. The array is copied once into native memory, use a direct ByteBuffer to avoid that
+     */
+    public static MediaInput fromBytes(byte[] bytes) {
+        MediaInput input = new MediaInput(TYPE_BYTES);
+        input.bytes = bytes;
+        input.length = bytes.length;
+        return input;
+    }
+
+    /**
+     * Reads the input from the remaining bytes of the buffer. A direct buffer is read where it is, without any copy,
+     * so don't change its contents until the session is released. Other buffers are copied once.
+     */
+    public static MediaInput fromByteBuffer(ByteBuffer buffer) {
+        if (!buffer.isDirect()) {
+            byte[] bytes = new byte[buffer.remaining()];
+            buffer.duplicate().get(bytes);
+            return fromBytes(bytes);
+        }
+
+        MediaInput input = new MediaInput(TYPE_DIRECT_BUFFER);
+        input.buffer = buffer;
+        input.offset = buffer.position();
+        input.length = buffer.remaining();
+        return input;
+    }
+
+    /**
+     * Reads the input from a stream as the conversion goes, on the converting thread. The stream is not closed.
+     * Streams can't seek: formats that keep their index at the end (most M4A files) can't be read this way, and
+     * neither can a time range be set.
+     */
+    public static MediaInput fromStream(InputStream stream) {
+        MediaInput input = new MediaInput(TYPE_STREAM);
+        input.stream = stream;
+        return input;
+    }
+
+    /**
+     * Names the input, the extension helps detecting the format of memory and stream inputs. Ignored for the others
+     * @param name - e.g. "input.mp3"
+     */
+    public MediaInput withName(String name) {
+        if (type != TYPE_PATH && type != TYPE_FD) path = name;
+        return this;
+    }
+}
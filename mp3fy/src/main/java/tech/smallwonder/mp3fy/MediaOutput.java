@@ -0,0 +1,57 @@
+package tech.smallwonder.mp3fy;
+
+import java.io.OutputStream;
+
+/**
+ * Where a conversion writes its output to. Pass it to MP3fy.createSession(MediaInput, MediaOutput, boolean, EncodingProfile).
+ * Only outputs to a path can be converted in CONVERSION_MODE_SEGMENTED, the others fall back to the pipelined mode.
+ */
+public class MediaOutput {
+    // These have to match the MediaOutputType enum in lib.cpp
+    static final int TYPE_PATH = 0;
+    static final int TYPE_STREAM = 1;
+    static final int TYPE_MEMORY = 2;
+
+    // Read from native code
+    private final int type;
+    private String path;
+    private String format;
+    private OutputStream stream;
+
+    private MediaOutput(int type) {
+        this.type = type;
+    }
+
+    /**
+     * @param path - The output file. This is the MP3 file
+     */
+    public static MediaOutput toPath(String path) {
+        MediaOutput output = new MediaOutput(TYPE_PATH);
+        output.path = path;
+        return output;
+    }
+
+    /**
+     * Writes the output to a stream as the conversion goes, on the converting thread. The stream is flushed at the
+     * end, but not closed.
+     * Streams can't seek back, so the output won't have a Xing header.
+     * @param format - Extension of the output, "mp3"
+     */
+    public static MediaOutput toStream(OutputStream stream, String format) {
+        MediaOutput output = new MediaOutput(TYPE_STREAM);
+        output.stream = stream;
+        output.format = format;
+        return output;
+    }
+
+    /**
+     * Writes the output into native memory that grows as needed, get it with ConversionSession.getOutput() once the
+     * conversion succeeded.
+     * @param format - Extension of the output, "mp3"
+     */
+    public static MediaOutput toMemory(String format) {
+        MediaOutput output = new MediaOutput(TYPE_MEMORY);
+        output.format = format;
+        return output;
+    }
+}
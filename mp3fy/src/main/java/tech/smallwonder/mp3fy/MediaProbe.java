@@ -0,0 +1,59 @@
+package tech.smallwonder.mp3fy;
+
+import java.nio.ByteBuffer;
+
+/**
+ * What was read from the header of a file, created with MP3fy.probe(). The file itself isn't kept open.
+ * Call release() once you're done with a probe, or the native resources stay around.
+ */
+public class MediaProbe {
+    private final long handle;
+
+    private ByteBuffer albumArt;
+
+    MediaProbe(long handle) {
+        this.handle = handle;
+    }
+
+    /**
+     * The album art as it's stored in the file (usually a JPEG or a PNG, see getAlbumArtMimeType()), without any
+     * copy: the buffer reads the demuxer's own packet. Hand it to an uploader, a cache or BitmapFactory as it is.
+     * @return a read-only direct buffer, valid until release(). Null if there's no album art
+     */
+    public synchronized ByteBuffer getAlbumArt() {
+        if (albumArt == null) {
+            ByteBuffer buffer = getAlbumArtNative(handle);
+            if (buffer == null) return null;
+            albumArt = buffer.asReadOnlyBuffer();
+        }
+        // Every caller gets its own position
+        return albumArt.duplicate();
+    }
+
+    /**
+     * @return the mime type of the album art, e.g. "image/jpeg". Null if there's no album art, or it isn't known
+     */
+    public String getAlbumArtMimeType() {
+        return getAlbumArtMimeTypeNative(handle);
+    }
+
+    /**
+     * Frees the native side of the probe. Buffers from getAlbumArt() must not be used anymore after this
+     */
+    public synchronized void release() {
+        albumArt = null;
+        releaseNative(handle);
+    }
+
+    /////////////////////////////////////////////////////////////////////////////////
+
+    //                             NATIVE METHODS GO HERE                          //
+
+    //////////////////////////////////////////////////////////////////////////////////
+
+    private native ByteBuffer getAlbumArtNative(long probe_id);
+
+    private native String getAlbumArtMimeTypeNative(long probe_id);
+
+    private native void releaseNative(long probe_id);
+}
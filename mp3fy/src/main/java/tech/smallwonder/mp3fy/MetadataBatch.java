@@ -0,0 +1,67 @@
+package tech.smallwonder.mp3fy;
+
+import java.util.HashMap;
+
+/**
+ * Metadata of a batch of files from a MetadataScan, in flat arrays so that a whole batch crosses JNI at once.
+ * Files that could not be read as audio are left out.
+ */
+public class MetadataBatch {
+    private final String[] paths;
+    private final long[] durations;
+    private final int[] bitrates;
+    private final boolean[] albumArt;
+    // Index of the first key of each file in tags, which holds keys and values one after the other
+    private final int[] tagOffsets;
+    private final String[] tags;
+
+    MetadataBatch(String[] paths, long[] durations, int[] bitrates, boolean[] albumArt, int[] tagCounts, String[] tags) {
+        this.paths = paths;
+        this.durations = durations;
+        this.bitrates = bitrates;
+        this.albumArt = albumArt;
+        this.tags = tags;
+
+        tagOffsets = new int[paths.length + 1];
+        for (int i = 0; i < paths.length; i++) {
+            tagOffsets[i + 1] = tagOffsets[i] + tagCounts[i] * 2;
+        }
+    }
+
+    public int size() {
+        return paths.length;
+    }
+
+    public String getPath(int index) {
+        return paths[index];
+    }
+
+    /**
+     * @return the duration in microseconds, 0 if the header doesn't tell
+     */
+    public long getDuration(int index) {
+        return durations[index];
+    }
+
+    public int getBitrate(int index) {
+        return bitrates[index];
+    }
+
+    /**
+     * @return whether the file has album art, get it with MP3fy.getAlbumArt()
+     */
+    public boolean hasAlbumArt(int index) {
+        return albumArt[index];
+    }
+
+    /**
+     * @return the tags of the file, see AudioFileInfo.MetadataKeys
+     */
+    public HashMap<String, String> getMetadata(int index) {
+        HashMap<String, String> metadata = new HashMap<>();
+        for (int i = tagOffsets[index]; i < tagOffsets[index + 1]; i += 2) {
+            metadata.put(tags[i], tags[i + 1]);
+        }
+        return metadata;
+    }
+}
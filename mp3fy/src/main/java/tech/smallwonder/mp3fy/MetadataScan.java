@@ -0,0 +1,84 @@
+package tech.smallwonder.mp3fy;
+
+import tech.smallwonder.mp3fy.interfaces.OnMetadataBatchListener;
+
+/**
+ * Reads the metadata of many files in parallel on a native worker pool, see MP3fy.scanMetadata().
+ * Call release() once you're done with a scan, or the native resources stay around.
+ */
+public class MetadataScan {
+    private long handle = -1;
+
+    private final OnMetadataBatchListener listener;
+
+    MetadataScan(OnMetadataBatchListener listener) {
+        this.listener = listener;
+    }
+
+    /**
+     * Starts reading either the paths, or every file under directory
+     * @return false if the scan could not be started
+     */
+    boolean start(String[] paths, String directory, String[] extensions, int probeLevel, int batchSize) {
+        handle = startNative(paths, directory, extensions, probeLevel, batchSize);
+        return handle != -1;
+    }
+
+    /**
+     * Stops the scan. Files being read right now still end up in a last batch, then onFinished(true) is called.
+     */
+    public void cancel() {
+        cancelNative(handle);
+    }
+
+    /**
+     * @return how many files have been read so far (including the ones that weren't audio)
+     */
+    public long getFilesDone() {
+        return getFilesDoneNative(handle);
+    }
+
+    /**
+     * @return how many files there are to read. When scanning a directory, this grows until the whole tree is listed
+     */
+    public long getFilesFound() {
+        return getFilesFoundNative(handle);
+    }
+
+    /**
+     * Frees the native side of the scan. A running scan goes on until it's done, cancel() it first if it shouldn't.
+     */
+    public void release() {
+        releaseNative(handle);
+    }
+
+    /**
+     * Called from native worker threads, one at a time
+     */
+    private void onBatch(String[] paths, long[] durations, int[] bitrates, boolean[] albumArt, int[] tagCounts, String[] tags) {
+        listener.onBatch(new MetadataBatch(paths, durations, bitrates, albumArt, tagCounts, tags));
+    }
+
+    private void onFinished(boolean cancelled) {
+        listener.onFinished(cancelled);
+    }
+
+    /////////////////////////////////////////////////////////////////////////////////
+
+    //                             NATIVE METHODS GO HERE                          //
+
+    //////////////////////////////////////////////////////////////////////////////////
+
+    /**
+     * @return the handle of the new native scan, -1 on error
+     */
+    private native long startNative(String[] paths, String directory, String[] extensions, int probeLevel, int batchSize);
+
+    private native void cancelNative(long scan_id);
+
+    private native long getFilesDoneNative(long scan_id);
+
+    private native long getFilesFoundNative(long scan_id);
+
+    private native void releaseNative(long scan_id);
+}
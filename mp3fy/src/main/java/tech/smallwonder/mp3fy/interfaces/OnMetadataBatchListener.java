@@ -0,0 +1,16 @@
+package tech.smallwonder.mp3fy.interfaces;
+
+import tech.smallwonder.mp3fy.MetadataBatch;
+
+/**
+ * Receives the results of a MetadataScan. Both methods are called on native worker threads, one call at a time.
+ */
+public interface OnMetadataBatchListener {
+    void onBatch(MetadataBatch batch);
+
+    /**
+     * Called once, after the last batch
+     * @param cancelled - Whether the scan was cancelled before every file was read
+     */
+    void onFinished(boolean cancelled);
+}